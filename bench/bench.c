@@ -0,0 +1,725 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  bench.c
+ *
+ *    Description:  Benchmarks for the clustering core. Runs the drivers on
+ *                  synthetic gaussian blobs and, optionally, on real images
+ *                  and prints the timings as JSON so runs can be compared
+ *                  between versions.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 09:30:12
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	"distance.h"
+#include	"parallel.h"
+#include	"profile.h"
+#include	"ppm.h"
+#include	"stream.h"
+#include	<stdio.h>
+#include	<time.h>
+#include	<unistd.h>
+
+#ifdef BENCH_IMAGES
+#include	<SDL2/SDL_image.h>
+#include	<SDL2/SDL.h>
+#endif
+
+/* the phased drivers give up after this many iterations */
+#define BENCH_MAX_ITER 300
+
+typedef struct BenchConfig {
+    int n_samples;
+    int dims;
+    int n_clusters;
+    double separation;
+    int n_threads;
+    int repeats;
+    uint64_t seed;
+    int check;              /* -c, check results rather than time them */
+} BenchConfig;
+
+/* one workload, either generated or read from an image */
+typedef struct Workload {
+    const char *name;
+    double *samples;
+    int n_samples;
+    int dims;
+} Workload;
+
+typedef struct BenchResult {
+    double seed_s;
+    double assign_s;
+    double update_s;
+    double train_s;
+    int iterations;
+    double distance_evals;
+    double inertia;
+} BenchResult;
+
+static int n_results = 0;
+static int n_failed = 0;
+
+/* with -p, where each driver's time went. Reset after every result */
+static KMeansProfile *profile = NULL;
+static ProfileScope profiling;
+
+static const char *phase_names[KMEANS_N_PHASES] = {
+    "seed", "assign", "update", "silhouette"
+};
+
+static double
+now ( void )
+{
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}		/* -----  end of function now  ----- */
+
+
+static double
+gaussian ( Rng *rng )
+{
+    /* Box-Muller. 1-u keeps us away from log(0) */
+    double u = 1.0 - Rng_uniform( rng );
+    double v = Rng_uniform( rng );
+    return sqrt( -2.0 * log(u) ) * cos( 2.0 * M_PI * v );
+}		/* -----  end of function gaussian  ----- */
+
+
+/* n_samples points in n_clusters unit variance blobs. The blob centres are
+ * spread uniformly over a cube whose side grows with separation and with the
+ * number of blobs, so the blobs stay about as far apart as k grows */
+static void
+make_blobs ( Workload *w, BenchConfig *cfg )
+{
+    int dims = cfg->dims, k = cfg->n_clusters;
+    double side = cfg->separation * pow( k, 1.0 / dims );
+    double *centres = malloc( sizeof(double) * k * dims );
+    int i, j;
+    Rng rng;
+
+    Rng_seed( &rng, cfg->seed );
+
+    w->name = "blobs";
+    w->n_samples = cfg->n_samples;
+    w->dims = dims;
+    w->samples = malloc( sizeof(double) * cfg->n_samples * dims );
+    if( !centres || !w->samples ) {
+        fprintf( stderr, "ERROR: unable to allocate %d samples\n",
+                cfg->n_samples );
+        exit(1);
+    }
+
+    for( i=0; i<k*dims; i++ ) {
+        centres[i] = Rng_uniform( &rng ) * side;
+    }
+
+    for( i=0; i<cfg->n_samples; i++ ) {
+        double *c = &centres[Rng_below( &rng, k ) * dims];
+        for( j=0; j<dims; j++ ) {
+            w->samples[(size_t) i*dims + j] = c[j] + gaussian( &rng );
+        }
+    }
+
+    free(centres);
+}		/* -----  end of function make_blobs  ----- */
+
+
+#ifdef BENCH_IMAGES
+/* every pixel of the image as an RGB sample, as Segmenter_threshold sees
+ * them before it deduplicates the colours */
+static int
+load_image ( Workload *w, const char *filename )
+{
+    SDL_Surface *img = IMG_Load( filename );
+    if( !img ) {
+        fprintf( stderr, "ERROR: %s: %s\n", filename, IMG_GetError() );
+        return -1;
+    }
+
+    SDL_Surface *rgba = SDL_ConvertSurfaceFormat( img, SDL_PIXELFORMAT_RGBA32,
+            0 );
+    SDL_FreeSurface( img );
+    if( !rgba ) {
+        fprintf( stderr, "ERROR: %s: %s\n", filename, SDL_GetError() );
+        return -1;
+    }
+
+    int x, y, n = 0;
+    w->name = filename;
+    w->dims = 3;
+    w->n_samples = rgba->w * rgba->h;
+    w->samples = malloc( sizeof(double) * w->n_samples * 3 );
+    if( !w->samples ) {
+        SDL_FreeSurface( rgba );
+        return -1;
+    }
+
+    for( y=0; y<rgba->h; y++ ) {
+        unsigned char *row = (unsigned char *) rgba->pixels + y * rgba->pitch;
+        for( x=0; x<rgba->w; x++, n++ ) {
+            w->samples[n*3] = row[x*4];
+            w->samples[n*3 + 1] = row[x*4 + 1];
+            w->samples[n*3 + 2] = row[x*4 + 2];
+        }
+    }
+
+    SDL_FreeSurface( rgba );
+    return 0;
+}		/* -----  end of function load_image  ----- */
+#endif
+
+
+static double
+inertia ( double *centroids, Workload *w, int n_clusters )
+{
+    double tot = 0;
+    int i;
+    for( i=0; i<w->n_samples; i++ ) {
+        double d;
+        distance_sq_nearest_rows( centroids, &w->samples[(size_t) i*w->dims],
+                w->dims, n_clusters, &d );
+        tot += d;
+    }
+    return tot;
+}		/* -----  end of function inertia  ----- */
+
+
+/* The same loop as cluster_kmeans, but made of the serial building blocks
+ * so that assignment and update can be timed separately */
+static void
+run_phased ( Workload *w, int n_clusters, int kmpp, Rng *rng,
+        BenchResult *r )
+{
+    int dims = w->dims, n = w->n_samples;
+    double *centroids = malloc( sizeof(double) * n_clusters * dims );
+    int *labels = calloc( n, sizeof(int) );
+    int *counts = calloc( n_clusters, sizeof(int) );
+    double t;
+
+    t = now();
+    if( kmpp ) {
+        kmpp_init_centroids( centroids, w->samples, dims, n_clusters, n,
+                rng );
+    } else {
+        lloyd_init_centroids( centroids, w->samples, dims, n_clusters, n,
+                rng );
+    }
+    r->seed_s = now() - t;
+
+    counts[0] = n;
+    r->assign_s = r->update_s = 0;
+    for( r->iterations=0; r->iterations<BENCH_MAX_ITER; ) {
+        t = now();
+        int changed = reassign_clusters( centroids, w->samples, dims,
+                n_clusters, n, labels, counts );
+        r->assign_s += now() - t;
+
+        t = now();
+        recompute_centroids( centroids, w->samples, dims, n_clusters, n,
+                labels, counts );
+        r->update_s += now() - t;
+
+        r->iterations++;
+        if( !changed ) {
+            break;
+        }
+    }
+    r->train_s = r->assign_s + r->update_s;
+    r->distance_evals = (double) n * n_clusters * r->iterations;
+    r->inertia = inertia( centroids, w, n_clusters );
+
+    free(centroids);
+    free(labels);
+    free(counts);
+}		/* -----  end of function run_phased  ----- */
+
+
+/* the engine reports its phases through the monitor */
+static int
+engine_iteration ( const KMeansIterStats *stats, void *data )
+{
+    BenchResult *r = data;
+    r->assign_s += stats->assign_seconds;
+    r->update_s += stats->update_seconds;
+    r->distance_evals += stats->distance_evals;
+    r->iterations = stats->iteration;
+    return 0;
+}		/* -----  end of function engine_iteration  ----- */
+
+
+/* any of the threaded engines behind KMeans_cluster */
+typedef int (*Engine) ( double *centroids, double *samples, double *weights,
+        int dims, int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor );
+
+static void
+run_engine ( Workload *w, int n_clusters, int n_threads, Engine engine,
+        Rng *rng, BenchResult *r )
+{
+    int dims = w->dims, n = w->n_samples;
+    double *centroids = malloc( sizeof(double) * n_clusters * dims );
+    int *labels = malloc( sizeof(int) * n );
+    KMeansMonitor monitor = { engine_iteration, r };
+    double t;
+
+    t = now();
+    lloyd_init_centroids( centroids, w->samples, dims, n_clusters, n, rng );
+    r->seed_s = now() - t;
+
+    r->assign_s = r->update_s = r->distance_evals = 0;
+    r->iterations = 0;
+    t = now();
+    engine( centroids, w->samples, NULL, dims, n_clusters, n, labels,
+            n_threads, &monitor );
+    r->train_s = now() - t;
+    r->inertia = inertia( centroids, w, n_clusters );
+
+    free(centroids);
+    free(labels);
+}		/* -----  end of function run_engine  ----- */
+
+
+/* draws the sampled silhouette scores */
+#define BENCH_DRAWS 1000
+
+static void
+run_silhouette ( Workload *w, int n_clusters, int n_threads, KMeansScore mode,
+        Rng *rng, BenchResult *r )
+{
+    int dims = w->dims, n = w->n_samples;
+    double *centroids = malloc( sizeof(double) * n_clusters * dims );
+    int *labels = malloc( sizeof(int) * n );
+
+    lloyd_init_centroids( centroids, w->samples, dims, n_clusters, n, rng );
+    cluster_kmeans( centroids, w->samples, dims, n_clusters, n, labels );
+
+    ProfileMark mark;
+    profile_begin( &mark );
+
+    double t = now();
+    if( mode == KMEANS_SCORE_SAMPLED ) {
+        r->inertia = silhouette_sampled( w->samples, NULL, labels, dims,
+                n_clusters, n, BENCH_DRAWS, n_threads, rng, NULL );
+    } else {
+        r->inertia = silhouette_margin( centroids, w->samples, NULL, n, dims,
+                n_clusters, n_threads );
+    }
+    r->train_s = now() - t;
+    profile_end( &mark, KMEANS_PHASE_SILHOUETTE );
+    r->seed_s = r->assign_s = r->update_s = r->distance_evals = NAN;
+    r->iterations = 0;
+
+    free(centroids);
+    free(labels);
+}		/* -----  end of function run_silhouette  ----- */
+
+
+/* a field of a result, or null when the driver doesn't measure it */
+static void
+print_field ( const char *key, double value, const char *fmt )
+{
+    printf( ", \"%s\": ", key );
+    if( isnan(value) ) {
+        printf( "null" );
+    } else {
+        printf( fmt, value );
+    }
+}		/* -----  end of function print_field  ----- */
+
+
+/* the counters are null where the kernel wouldn't give us any */
+static void
+print_profile ( void )
+{
+    int i;
+
+    /* the distances are only added up on leaving */
+    profile_leave( &profiling );
+
+    printf( ", \"profile\": {" );
+    for( i=0; i<KMEANS_N_PHASES; i++ ) {
+        KMeansPhaseCounts *c = &profile->phases[i];
+        int hw = profile->counters;
+
+        printf( "%s\"%s\": {\"calls\": %lld", (i)? ", " : "",
+                phase_names[i], c->calls );
+        print_field( "seconds", c->seconds, "%.6f" );
+        print_field( "cycles", (hw)? (double) c->cycles : NAN, "%.0f" );
+        print_field( "instructions", (hw)? (double) c->instructions : NAN,
+                "%.0f" );
+        print_field( "llc_misses", (hw)? (double) c->llc_misses : NAN,
+                "%.0f" );
+        print_field( "branch_misses", (hw)? (double) c->branch_misses : NAN,
+                "%.0f" );
+        printf( "}" );
+    }
+    print_field( "distance_evals", (double) profile->distance_evals, "%.0f" );
+    printf( "}" );
+
+    memset( profile->phases, 0, sizeof(profile->phases) );
+    profile->distance_evals = 0;
+    profile_enter( profile, &profiling );
+}		/* -----  end of function print_profile  ----- */
+
+
+static void
+print_result ( Workload *w, const char *driver, int repeat, int n_clusters,
+        BenchResult *r )
+{
+    printf( "%s    {\"workload\": \"%s\", \"driver\": \"%s\", "
+            "\"repeat\": %d, \"n_samples\": %d, \"dims\": %d, "
+            "\"n_clusters\": %d", (n_results++)? ",\n" : "", w->name, driver,
+            repeat, w->n_samples, w->dims, n_clusters );
+
+    print_field( "seed_s", r->seed_s, "%.6f" );
+    print_field( "assign_s", r->assign_s, "%.6f" );
+    print_field( "update_s", r->update_s, "%.6f" );
+    print_field( "train_s", r->train_s, "%.6f" );
+    print_field( "iterations", (r->iterations > 0)? r->iterations : NAN,
+            "%.0f" );
+    print_field( "distance_evals", r->distance_evals, "%.0f" );
+    print_field( "samples_per_s", (r->iterations > 0)?
+            (double) w->n_samples * r->iterations / r->train_s : NAN, "%.1f" );
+    print_field( (strncmp( driver, "silhouette", 10 ))? "inertia" :
+            "silhouette",
+            r->inertia, "%.9g" );
+    if( profile ) {
+        print_profile();
+    }
+    printf( "}" );
+}		/* -----  end of function print_result  ----- */
+
+
+static void
+run_workload ( Workload *w, BenchConfig *cfg )
+{
+    BenchResult r;
+    Rng rng;
+    int i;
+
+    profile_enter( profile, &profiling );
+    for( i=0; i<cfg->repeats; i++ ) {
+        /* every driver starts from the same seed */
+        Rng_seed( &rng, cfg->seed + i );
+        run_phased( w, cfg->n_clusters, 0, &rng, &r );
+        print_result( w, "lloyd", i, cfg->n_clusters, &r );
+
+        Rng_seed( &rng, cfg->seed + i );
+        run_phased( w, cfg->n_clusters, 1, &rng, &r );
+        print_result( w, "kmpp", i, cfg->n_clusters, &r );
+
+        Rng_seed( &rng, cfg->seed + i );
+        run_engine( w, cfg->n_clusters, cfg->n_threads,
+                cluster_kmeans_parallel, &rng, &r );
+        print_result( w, "engine", i, cfg->n_clusters, &r );
+
+        Rng_seed( &rng, cfg->seed + i );
+        run_engine( w, cfg->n_clusters, cfg->n_threads,
+                cluster_kmeans_filter, &rng, &r );
+        print_result( w, "filter", i, cfg->n_clusters, &r );
+
+        Rng_seed( &rng, cfg->seed + i );
+        run_engine( w, cfg->n_clusters, cfg->n_threads,
+                cluster_kmeans_gemm, &rng, &r );
+        print_result( w, "gemm", i, cfg->n_clusters, &r );
+
+        Rng_seed( &rng, cfg->seed + i );
+        run_silhouette( w, cfg->n_clusters, cfg->n_threads,
+                KMEANS_SCORE_MARGIN, &rng, &r );
+        print_result( w, "silhouette", i, cfg->n_clusters, &r );
+
+        Rng_seed( &rng, cfg->seed + i );
+        run_silhouette( w, cfg->n_clusters, cfg->n_threads,
+                KMEANS_SCORE_SAMPLED, &rng, &r );
+        print_result( w, "silhouette_sampled", i, cfg->n_clusters, &r );
+    }
+    profile_leave( &profiling );
+}		/* -----  end of function run_workload  ----- */
+
+
+/* one check's line of the results, and its tally */
+static void
+print_outcome ( const char *workload, const char *check, const char *key, 
+        int value, int match )
+{
+    printf( "%s    {\"workload\": \"%s\", \"check\": \"%s\", "
+            "\"%s\": %d, \"match\": %s}", (n_results++)? ",\n" : "",
+            workload, check, key, value, (match)? "true" : "false" );
+    n_failed += !match;
+}		/* -----  end of function print_outcome  ----- */
+
+
+/* The same model trained twice, differing only in how the work is split 
+ * up, must come out bit for bit the same. Reports whether it did */
+static void
+print_check ( Workload *w, const char *check, const char *key, int value,
+        KMeans *a, const int *la, KMeans *b, const int *lb,
+        KMeansStatus sa, KMeansStatus sb )
+{
+    int match = sa != KMEANS_NO_MEMORY && sa != KMEANS_FAILED && sa == sb &&
+        !memcmp( a->centroids, b->centroids,
+                sizeof(double) * a->n_clusters * a->n_features ) &&
+        !memcmp( la, lb, sizeof(int) * w->n_samples );
+
+    print_outcome( w->name, check, key, value, match );
+}		/* -----  end of function print_check  ----- */
+
+
+/* n_init restarts on one thread and on n_threads */
+static void
+check_restarts ( Workload *w, BenchConfig *cfg, int n_threads )
+{
+    KMeans *a = KMeans_new( cfg->n_clusters, w->dims );
+    KMeans *b = KMeans_new( cfg->n_clusters, w->dims );
+    int *la = malloc( sizeof(int) * w->n_samples );
+    int *lb = malloc( sizeof(int) * w->n_samples );
+    KMeansStatus sa = KMEANS_NO_MEMORY, sb = KMEANS_NO_MEMORY;
+
+    if( a && b && la && lb ) {
+        a->n_init = b->n_init = 8;
+        a->n_threads = 1;
+        b->n_threads = n_threads;
+        KMeans_seed( a, cfg->seed );
+        KMeans_seed( b, cfg->seed );
+        sa = KMeans_cluster( a, w->samples, w->n_samples, la );
+        sb = KMeans_cluster( b, w->samples, w->n_samples, lb );
+    }
+    print_check( w, "restarts", "n_threads", n_threads, a, la, b, lb, sa, sb );
+
+    KMeans_free(a);
+    KMeans_free(b);
+    free(la);
+    free(lb);
+}		/* -----  end of function check_restarts  ----- */
+
+
+/* each shard worker copies its rows out of the workload, which it has 
+ * from before the fork */
+static int
+load_rows ( double *samples, int start, int end, void *data )
+{
+    Workload *w = data;
+    memcpy( samples, &w->samples[(size_t) start * w->dims],
+            sizeof(double) * (end - start) * w->dims );
+    return 0;
+}		/* -----  end of function load_rows  ----- */
+
+
+/* Lloyd over n_shards worker processes against Lloyd in this one, from 
+ * the same seed */
+static void
+check_sharded ( Workload *w, BenchConfig *cfg, int n_shards )
+{
+    KMeans *a = KMeans_new( cfg->n_clusters, w->dims );
+    KMeans *b = KMeans_new( cfg->n_clusters, w->dims );
+    int *la = malloc( sizeof(int) * w->n_samples );
+    int *lb = malloc( sizeof(int) * w->n_samples );
+    KMeansStatus sa = KMEANS_NO_MEMORY, sb = KMEANS_NO_MEMORY;
+
+    if( a && b && la && lb ) {
+        a->algorithm = KMEANS_LLOYD;
+        a->init = KMEANS_INIT_RANDOM;
+        a->n_threads = cfg->n_threads;
+        KMeans_seed( a, cfg->seed );
+        KMeans_seed( b, cfg->seed );
+        sa = KMeans_cluster( a, w->samples, w->n_samples, la );
+        sb = KMeans_cluster_sharded( b, w->n_samples, n_shards, load_rows,
+                w, lb );
+    }
+    print_check( w, "sharded", "n_shards", n_shards, a, la, b, lb, sa, sb );
+
+    KMeans_free(a);
+    KMeans_free(b);
+    free(la);
+    free(lb);
+}		/* -----  end of function check_sharded  ----- */
+
+
+/* A model streamed fewer samples than it has clusters still has centroids
+ * the allocator filled in, so it mustn't predict until the stream has 
+ * given it one sample per cluster, and then must */
+static void
+check_partial_fit ( Workload *w, BenchConfig *cfg )
+{
+    KMeans *km = KMeans_new( cfg->n_clusters, w->dims );
+    int *labels = malloc( sizeof(int) * w->n_samples );
+    int i, k = cfg->n_clusters, ok = 0;
+
+    if( km && labels ) {
+        ok = KMeans_predict( km, w->samples, w->n_samples, labels, NULL ) &&
+            KMeans_classify( km, w->samples ) < 0 &&
+            KMeans_partial_fit( km, w->samples, k - 1 ) == k - 1 &&
+            KMeans_predict( km, w->samples, w->n_samples, labels, NULL ) &&
+            KMeans_partial_fit( km, &w->samples[(size_t) (k-1) * w->dims], 
+                    w->n_samples - (k-1) ) == k &&
+            !KMeans_predict( km, w->samples, w->n_samples, labels, NULL );
+        for( i=0; ok && i<w->n_samples; i++ ) {
+            ok = labels[i] >= 0 && labels[i] < k && 
+                labels[i] == KMeans_classify( km, 
+                        &w->samples[(size_t) i * w->dims] );
+        }
+    }
+    print_outcome( w->name, "partial_fit", "n_clusters", k, ok );
+
+    KMeans_free(km);
+    free(labels);
+}		/* -----  end of function check_partial_fit  ----- */
+
+
+/* A 2 cluster model swept up to 6 over a streamed image with 4 colours. 
+ * The sweep settles on its own k, and the segmentation written has to 
+ * be sized from that rather than from the k the model came in with */
+static void
+check_stream_sweep ( BenchConfig *cfg )
+{
+    static const unsigned char quads[4][3] = {
+        { 200, 30, 30 }, { 30, 200, 30 }, { 30, 30, 200 }, { 220, 220, 40 }
+    };
+    char input[] = "/tmp/kmeans_benchXXXXXX";
+    char output[sizeof(input) + 4];
+    StreamOptions opts = { 16, 1, 0, 5, 0, 6 };
+    KMeans *km = KMeans_new( 2, 3 );
+    FILE *f = NULL;
+    Rng rng;
+    int fd, x, y, c, width = 0, height = 0, ok = 0;
+
+    Rng_seed( &rng, cfg->seed );
+
+    fd = mkstemp( input );
+    if( fd >= 0 && !(f = fdopen( fd, "wb" )) ) {
+        close(fd);
+    }
+
+    if( km && f && !ppm_write_header( f, 64, 64 ) ) {
+        for( y=0; y<64; y++ ) {
+            for( x=0; x<64; x++ ) {
+                const unsigned char *q = quads[(y / 32) * 2 + x / 32];
+                for( c=0; c<3; c++ ) {
+                    fputc( q[c] + Rng_below( &rng, 16 ), f );
+                }
+            }
+        }
+    }
+
+    if( f && !fclose(f) && km ) {
+        snprintf( output, sizeof(output), "%s.ppm", input );
+        KMeans_seed( km, cfg->seed );
+        ok = !stream_segment( km, input, output, &opts, &width, &height ) &&
+            width == 64 && height == 64 &&
+            km->n_clusters >= 2 && km->n_clusters <= 6;
+        unlink(output);
+    }
+    if( fd >= 0 ) {
+        unlink(input);
+    }
+
+    print_outcome( "stream", "sweep", "n_clusters", (km)? km->n_clusters : 0,
+            ok );
+
+    KMeans_free(km);
+}		/* -----  end of function check_stream_sweep  ----- */
+
+
+static void
+run_checks ( Workload *w, BenchConfig *cfg )
+{
+    /* the pool spawns its threads whatever the cores, so there's something
+     * to check even on one */
+    int n_threads = (cfg->n_threads > 1)? cfg->n_threads : 4;
+
+    check_restarts( w, cfg, n_threads );
+    check_sharded( w, cfg, 1 );
+    check_sharded( w, cfg, n_threads );
+    check_partial_fit( w, cfg );
+}		/* -----  end of function run_checks  ----- */
+
+
+int
+main ( int argc, char *argv[] )
+{
+    BenchConfig cfg = { 200000, 3, 16, 8.0, parallel_num_cores(), 3, 1, 0 };
+    KMeansProfile counts;
+    Workload w;
+    int opt, i;
+
+    while( (opt = getopt( argc, argv, "n:d:k:s:t:r:S:pc" )) != -1 ) {
+        switch(opt) {
+            case 'n': cfg.n_samples = atoi(optarg); break;
+            case 'd': cfg.dims = atoi(optarg); break;
+            case 'k': cfg.n_clusters = atoi(optarg); break;
+            case 's': cfg.separation = atof(optarg); break;
+            case 't': cfg.n_threads = atoi(optarg); break;
+            case 'r': cfg.repeats = atoi(optarg); break;
+            case 'S': cfg.seed = strtoull( optarg, NULL, 10 ); break;
+            case 'p':
+                memset( &counts, 0, sizeof(counts) );
+                profile = &counts;
+                break;
+            case 'c': cfg.check = 1; break;
+            default:
+                fprintf( stderr, "USAGE: kmeans_bench [-n samples] [-d dims] "
+                        "[-k clusters] [-s separation] [-t threads] "
+                        "[-r repeats] [-S seed] [-p] [-c] [image...]\n" );
+                return EXIT_FAILURE;
+        }
+    }
+
+    if( cfg.n_samples < 1 || cfg.dims < 1 || cfg.n_clusters < 1 ||
+            cfg.n_clusters > cfg.n_samples || cfg.repeats < 1 ) {
+        fprintf( stderr, "ERROR: bad configuration\n" );
+        return EXIT_FAILURE;
+    }
+
+    printf( "{\n  \"config\": {\"n_samples\": %d, \"dims\": %d, "
+            "\"n_clusters\": %d, \"separation\": %g, \"n_threads\": %d, "
+            "\"repeats\": %d, \"seed\": %llu, \"isa\": \"%s\"},\n"
+            "  \"results\": [\n", cfg.n_samples, cfg.dims, cfg.n_clusters,
+            cfg.separation, cfg.n_threads, cfg.repeats,
+            (unsigned long long) cfg.seed, distance_isa() );
+
+    make_blobs( &w, &cfg );
+    if( cfg.check ) {
+        run_checks( &w, &cfg );
+        check_stream_sweep( &cfg );
+    } else {
+        run_workload( &w, &cfg );
+    }
+    free(w.samples);
+
+    /* the images in data/ are the second workload */
+#ifdef BENCH_IMAGES
+    if( IMG_Init( IMG_INIT_PNG | IMG_INIT_JPG | IMG_INIT_TIF ) < 0 ) {
+        fprintf( stderr, "ERROR: %s\n", IMG_GetError() );
+    }
+    for( i=optind; i<argc; i++ ) {
+        if( !load_image( &w, argv[i] ) ) {
+            if( cfg.check ) {
+                run_checks( &w, &cfg );
+            } else {
+                run_workload( &w, &cfg );
+            }
+            free(w.samples);
+        }
+    }
+    IMG_Quit();
+#else
+    for( i=optind; i<argc; i++ ) {
+        fprintf( stderr, "WARNING: built without image support, "
+                "skipping %s\n", argv[i] );
+    }
+#endif
+
+    printf( "\n  ]\n}\n" );
+    return (n_failed)? EXIT_FAILURE : EXIT_SUCCESS;
+}		/* -----  end of function main  ----- */
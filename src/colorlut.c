@@ -0,0 +1,123 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  colorlut.c
+ *
+ *    Description:  Compiles a trained RGB model into a quantised lookup
+ *                  table so pixels can be classified without computing any
+ *                  distances.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 11:20:55
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"colorlut.h"
+
+/* Is every point of the box lo..hi strictly closer to centroid a than to b?
+ * d(x,a)^2 - d(x,b)^2 = 2x.(b-a) + |a|^2 - |b|^2 is linear in x, so it's
+ * largest at one of the corners and we can pick that corner axis by axis.
+ * The margin keeps us clear of ties the distance kernels could round
+ * either way */
+static int
+box_closer ( const double *a, const double *b, const double *lo, 
+        const double *hi )
+{
+    double f = 0, scale = 1;
+    int j;
+
+    for( j=0; j<3; j++ ) {
+        double c = 2 * (b[j] - a[j]);
+        f += c * ((c > 0)? hi[j] : lo[j]) + a[j]*a[j] - b[j]*b[j];
+        scale += a[j]*a[j] + b[j]*b[j] + hi[j]*hi[j];
+    }
+
+    return f < -1e-9 * scale;
+}		/* -----  end of function box_closer  ----- */
+
+
+int
+ColorLut_init ( ColorLut *lut, KMeans *km, int bits )
+{
+    int k = km->n_clusters;
+    int n = 1 << bits;
+    int r, g, b, i, j;
+
+    if( !lut ) {
+        return -1;
+    }
+
+    lut->cells = NULL;
+    if( km->n_features != 3 || k < 1 || k >= COLOR_LUT_AMBIGUOUS || 
+            bits < 1 || bits > 8 ) {
+        return -1;
+    }
+
+    lut->bits = bits;
+    lut->shift = 8 - bits;
+    lut->kmeans = km;
+    lut->n_ambiguous = 0;
+    lut->cells = malloc( sizeof(uint16_t) * n * n * n );
+    if( !lut->cells ) {
+        return -1;
+    }
+
+    /* a cell covers the integer colours lo..hi on each channel */
+    int width = 1 << lut->shift;
+    double lo[3], hi[3], mid[3];
+
+    for( r=0; r<n; r++ ) {
+        for( g=0; g<n; g++ ) {
+            for( b=0; b<n; b++ ) {
+                lo[0] = r * width; lo[1] = g * width; lo[2] = b * width;
+                for( j=0; j<3; j++ ) {
+                    hi[j] = lo[j] + width - 1;
+                    mid[j] = 0.5 * (lo[j] + hi[j]);
+                }
+
+                /* the only candidate is whoever owns the middle */
+                int l = find_closest( km->centroids, mid, 3, k, NULL );
+                double *c = &km->centroids[l*3];
+
+                for( i=0; i<k; i++ ) {
+                    if( i != l && !box_closer( c, &km->centroids[i*3], lo, 
+                                hi ) ) {
+                        break;
+                    }
+                }
+
+                if( i < k ) {
+                    l = COLOR_LUT_AMBIGUOUS;
+                    lut->n_ambiguous++;
+                }
+                lut->cells[(r*n + g)*n + b] = l;
+            }
+        }
+    }
+
+    return 0;
+}		/* -----  end of function ColorLut_init  ----- */
+
+
+int
+ColorLut_classify_exact ( ColorLut *lut, int r, int g, int b )
+{
+    double sample[3] = { r, g, b };
+    return KMeans_classify( lut->kmeans, sample );
+}		/* -----  end of function ColorLut_classify_exact  ----- */
+
+
+void
+ColorLut_free ( ColorLut *lut )
+{
+    if(lut) {
+        free(lut->cells);
+        lut->cells = NULL;
+    }
+}		/* -----  end of function ColorLut_free  ----- */
@@ -0,0 +1,58 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  colorlut.h
+ *
+ *    Description:  Lookup table from 8-bit RGB colours to the label of the
+ *                  nearest centroid of a trained 3 feature model.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 11:20:55
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  COLORLUT_INC
+#define  COLORLUT_INC
+
+#include	<stdint.h>
+#include	"kmeans.h"
+
+/* a cell where more than one centroid can be the closest */
+#define COLOR_LUT_AMBIGUOUS 0xffff
+
+/* The colour cube is cut into 2^bits cells per channel. A cell stores the 
+ * label if every colour in it has the same nearest centroid, otherwise it's
+ * marked ambiguous and those colours go through KMeans_classify. Either way
+ * the label is the one KMeans_classify would give */
+typedef struct ColorLut {
+    int bits;
+    int shift;              /* 8 - bits, drops a channel to its cell */
+    uint16_t *cells;        /* 2^(3*bits) labels */
+    KMeans *kmeans;         /* the model, for the ambiguous cells */
+    int n_ambiguous;
+} ColorLut;
+
+int ColorLut_init ( ColorLut *lut, KMeans *kmeans, int bits );
+
+int ColorLut_classify_exact ( ColorLut *lut, int r, int g, int b );
+
+void ColorLut_free ( ColorLut *lut );
+
+/* inline so that an unambiguous colour costs one read */
+static inline int
+ColorLut_classify ( ColorLut *lut, int r, int g, int b )
+{
+    int l = lut->cells[((r >> lut->shift) << (2*lut->bits)) | 
+        ((g >> lut->shift) << lut->bits) | (b >> lut->shift)];
+
+    return (l != COLOR_LUT_AMBIGUOUS)? l : 
+        ColorLut_classify_exact( lut, r, g, b );
+}		/* -----  end of function ColorLut_classify  ----- */
+
+#endif   /* ----- #ifndef COLORLUT_INC  ----- */
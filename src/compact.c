@@ -0,0 +1,375 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  compact.c
+ *
+ *    Description:  The clustering core for samples stored as floats or as
+ *                  bytes. Centroids are floats, distances are worked out in
+ *                  single precision, and the sums behind each centroid are
+ *                  kept in double so they stay exact.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 14:05:37
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	"distance.h"
+#include	"monitor.h"
+#include	"parallel.h"
+#include	"slots.h"
+#include	"workspace.h"
+
+/* classify has to convert the sample to double. Most have few enough 
+ * features for the stack */
+#define COMPACT_STACK_FEATURES 16
+
+/* One query against the rows as they are. The training loops pack the 
+ * centroids once for the SIMD kernels in distance.c; for a single sample 
+ * the packing would cost as much as this. u8 is a constant in each 
+ * caller, so this gets specialised for both */
+static inline __attribute__((always_inline)) int
+closest_compact ( const float *points, const void *sample, int u8, int dims, 
+        int n_points, float *dist_pointer )
+{
+    float min = HUGE_VALF;
+    int i, j, closest = 0;
+
+    if( !points || !sample || dims < 1 || n_points < 1 ) {
+        return -1;
+    }
+
+    for( i=0; i<n_points; i++ ) {
+        float acc = 0;
+        for( j=0; j<dims; j++ ) {
+            float x = (u8)? ((const uint8_t *) sample)[j] : 
+                ((const float *) sample)[j];
+            float d = x - points[i*dims + j];
+            acc += d*d;
+        }
+        if( acc < min ) {
+            min = acc;
+            closest = i;
+        }
+    }
+
+    if( dist_pointer ) {
+        *dist_pointer = sqrtf(min);
+    }
+
+    return closest;
+}		/* -----  end of function closest_compact  ----- */
+
+
+int
+find_closest_f32 ( const float *points, const float *sample, int dims, 
+        int n_points, float *dist_pointer )
+{
+    return closest_compact( points, sample, 0, dims, n_points, dist_pointer );
+}		/* -----  end of function find_closest_f32  ----- */
+
+
+int
+find_closest_u8 ( const float *points, const uint8_t *sample, int dims, 
+        int n_points, float *dist_pointer )
+{
+    return closest_compact( points, sample, 1, dims, n_points, dist_pointer );
+}		/* -----  end of function find_closest_u8  ----- */
+
+
+void
+recompute_centroids_f32 ( float *centroids, const float *samples, int dims,
+        int n_centroids, int n_samples, const int *labels, const int *counts )
+{
+    /* a float sum would drift once there are a few million samples */
+    double *sums = workspace_calloc( (size_t) n_centroids * dims, 
+            sizeof(double) );
+    int i, j;
+
+    if( !sums ) {
+        return;
+    }
+
+    for( i=0; i<n_samples; i++ ) {
+        for( j=0; j<dims; j++ ) {
+            sums[labels[i]*dims + j] += samples[(size_t) i*dims + j];
+        }
+    }
+
+    for( i=0; i<n_centroids; i++ ) {
+        for( j=0; j<dims; j++ ) {
+            centroids[i*dims + j] = sums[i*dims + j] / 
+                ((counts[i])? counts[i] : 1);
+        }
+    }
+
+    workspace_free(sums);
+}		/* -----  end of function recompute_centroids_f32  ----- */
+
+
+void
+recompute_centroids_u8 ( float *centroids, const uint8_t *samples, int dims,
+        int n_centroids, int n_samples, const int *labels, const int *counts )
+{
+    /* integer sums of bytes are exact, whatever the number of samples */
+    uint64_t *sums = workspace_calloc( (size_t) n_centroids * dims, 
+            sizeof(uint64_t) );
+    int i, j;
+
+    if( !sums ) {
+        return;
+    }
+
+    for( i=0; i<n_samples; i++ ) {
+        for( j=0; j<dims; j++ ) {
+            sums[labels[i]*dims + j] += samples[(size_t) i*dims + j];
+        }
+    }
+
+    for( i=0; i<n_centroids; i++ ) {
+        for( j=0; j<dims; j++ ) {
+            centroids[i*dims + j] = (double) sums[i*dims + j] / 
+                ((counts[i])? counts[i] : 1);
+        }
+    }
+
+    workspace_free(sums);
+}		/* -----  end of function recompute_centroids_u8  ----- */
+
+
+/* state shared by the tasks of one iteration, like struct KMeansPass */
+struct CompactPass {
+    DistancePanelF panel;
+    KMeansSlots slots;
+    const void *samples;
+    int u8;
+    int dims;
+    int *labels;
+    int monitored;          /* gather the inertia as well */
+};
+
+static void
+compact_pass_slot ( void *ctx, int slot, int thread )
+{
+    struct CompactPass *p = ctx;
+    int i, start, end, n_changed = 0;
+
+    KMeansSlots_clear( &p->slots, slot );
+    KMeansSlots_range( &p->slots, slot, &start, &end );
+
+    if( p->u8 ) {
+        const uint8_t *samples = p->samples;
+        for( i=start; i<end; i++ ) {
+            const uint8_t *sample = &samples[(size_t) i * p->dims];
+            float d;
+            int l = distance_sq_nearest_u8( &p->panel, sample,
+                    (p->monitored)? &d : NULL );
+
+            if( p->monitored ) {
+                p->slots.inertia[slot] += d;
+            }
+            n_changed += (p->labels[i] != l);
+            p->labels[i] = l;
+            KMeansSlots_add_u8( &p->slots, slot, l, sample );
+        }
+    } else {
+        const float *samples = p->samples;
+        for( i=start; i<end; i++ ) {
+            const float *sample = &samples[(size_t) i * p->dims];
+            float d;
+            int l = distance_sq_nearest_f32( &p->panel, sample,
+                    (p->monitored)? &d : NULL );
+
+            if( p->monitored ) {
+                p->slots.inertia[slot] += d;
+            }
+            n_changed += (p->labels[i] != l);
+            p->labels[i] = l;
+            KMeansSlots_add_f32( &p->slots, slot, l, sample );
+        }
+    }
+
+    p->slots.changed[slot] = n_changed;
+    p->slots.evals[slot] = (long long) (end - start) * p->panel.n_points;
+}		/* -----  end of function compact_pass_slot  ----- */
+
+
+/* furthest any float centroid moved, like monitor_max_shift */
+static double
+compact_max_shift ( const float *old, const float *centroids, int dims,
+        int n_centroids )
+{
+    double max_shift = 0;
+    int i, j;
+
+    for( i=0; i<n_centroids; i++ ) {
+        double d = 0;
+        for( j=0; j<dims; j++ ) {
+            double e = (double) centroids[i*dims + j] - old[i*dims + j];
+            d += e * e;
+        }
+        if( d > max_shift ) {
+            max_shift = d;
+        }
+    }
+
+    return sqrt( max_shift );
+}		/* -----  end of function compact_max_shift  ----- */
+
+
+/* the same loop as cluster_kmeans_parallel, monitor and all, and like it 
+ * returns -1 if it couldn't get its memory. There's no model behind these,
+ * so a caller who wants to bound the training does it from the monitor's 
+ * callback */
+static int
+cluster_compact ( float *centroids, const void *samples, int u8, int dims, 
+        int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor )
+{
+    struct CompactPass p;
+    KMeansIterStats stats;
+    int *counts = workspace_alloc( sizeof(int) * n_centroids );
+    double *means = workspace_alloc( sizeof(double) * n_centroids * dims );
+    float *old = NULL;
+    int i, ok;
+
+    if( monitor && !monitor->callback ) {
+        monitor = NULL;
+    }
+    if( monitor ) {
+        old = workspace_alloc( sizeof(float) * n_centroids * dims );
+    }
+
+    p.samples = samples;
+    p.u8 = u8;
+    p.dims = dims;
+    p.labels = labels;
+    p.monitored = (monitor != NULL);
+
+    DistancePanelF_init( &p.panel, dims, n_centroids );
+    KMeansSlots_init( &p.slots, dims, n_centroids, n_samples );
+
+    ok = counts && means && p.panel.data && p.slots.sums && 
+        (!monitor || old);
+    if( ok ) {
+        memset( labels, 0, sizeof(int) * n_samples );
+        memset( &stats, 0, sizeof(stats) );
+
+        int reassigned = n_samples;
+        while( reassigned > 0 ) {
+            double t = 0;
+            if( monitor ) {
+                memcpy( old, centroids, sizeof(float) * n_centroids * dims );
+                t = monitor_clock();
+            }
+
+            DistancePanelF_load( &p.panel, centroids );
+            parallel_for( n_threads, p.slots.n_slots, compact_pass_slot, &p );
+
+            if( monitor ) {
+                stats.assign_seconds = monitor_clock() - t;
+                t = monitor_clock();
+            }
+
+            reassigned = KMeansSlots_reduce( &p.slots, means, counts );
+
+            for( i=0; i<n_centroids * dims; i++ ) {
+                centroids[i] = means[i];
+            }
+
+            if( monitor ) {
+                stats.update_seconds = monitor_clock() - t;
+                stats.iteration++;
+                stats.changed = reassigned;
+                stats.max_shift = compact_max_shift( old, centroids, dims,
+                        n_centroids );
+                if( monitor_report( monitor, &p.slots, &stats ) ) {
+                    break;
+                }
+            }
+        }
+    }
+
+    DistancePanelF_free( &p.panel );
+    KMeansSlots_free( &p.slots );
+    workspace_free(old);
+    workspace_free(counts);
+    workspace_free(means);
+    return (ok)? 0 : -1;
+}		/* -----  end of function cluster_compact  ----- */
+
+
+int
+cluster_kmeans_f32 ( float *centroids, const float *samples, int dims,
+        int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor )
+{
+    return cluster_compact( centroids, samples, 0, dims, n_centroids, n_samples, 
+            labels, n_threads, monitor );
+}		/* -----  end of function cluster_kmeans_f32  ----- */
+
+
+int
+cluster_kmeans_u8 ( float *centroids, const uint8_t *samples, int dims,
+        int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor )
+{
+    return cluster_compact( centroids, samples, 1, dims, n_centroids, n_samples, 
+            labels, n_threads, monitor );
+}		/* -----  end of function cluster_kmeans_u8  ----- */
+
+
+/* The model's centroids are double, so these widen the sample and give
+ * exactly the label KMeans_classify would. They're conveniences, and save
+ * no bandwidth over the double path */
+static int
+classify_compact ( KMeans *km, const void *sample, int u8 )
+{
+    double stack[COMPACT_STACK_FEATURES];
+    double *x = stack;
+    WorkspaceScope scope;
+    int j, l;
+
+    workspace_enter( km->workspace, &scope );
+    if( km->n_features > COMPACT_STACK_FEATURES ) {
+        x = workspace_alloc( sizeof(double) * km->n_features );
+        if( !x ) {
+            workspace_leave( &scope );
+            return -1;
+        }
+    }
+
+    for( j=0; j<km->n_features; j++ ) {
+        x[j] = (u8)? ((const uint8_t *) sample)[j] : 
+            ((const float *) sample)[j];
+    }
+
+    l = KMeans_classify( km, x );
+
+    if( x != stack ) {
+        workspace_free(x);
+    }
+    workspace_leave( &scope );
+
+    return l;
+}		/* -----  end of function classify_compact  ----- */
+
+
+int
+KMeans_classify_f32 ( KMeans *km, const float *sample )
+{
+    return classify_compact( km, sample, 0 );
+}		/* -----  end of function KMeans_classify_f32  ----- */
+
+
+int
+KMeans_classify_u8 ( KMeans *km, const uint8_t *sample )
+{
+    return classify_compact( km, sample, 1 );
+}		/* -----  end of function KMeans_classify_u8  ----- */
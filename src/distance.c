@@ -0,0 +1,577 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  distance.c
+ *
+ *    Description:  Vectorised squared euclidean distance kernels. The
+ *                  instruction set (SSE2, AVX2 or AVX-512) is picked at
+ *                  runtime the first time a kernel is used.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 11:02:17
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+/* a fused multiply-add rounds differently to d*d followed by +, and we want
+ * the same labels out of every instruction set */
+#pragma GCC optimize ("fp-contract=off")
+
+#include	"distance.h"
+#include	"workspace.h"
+#include	<math.h>
+#include	<pthread.h>
+#include	<stdlib.h>
+#include	<string.h>
+
+#ifdef KMEANS_USE_CBLAS
+#include	<cblas.h>
+#endif
+
+/* columns of the panel handed to distance_sq_all at a time by the block
+ * kernel, so a tile of centroids stays in cache across a tile of samples */
+#define DISTANCE_TILE_POINTS  512
+#define DISTANCE_TILE_SAMPLES 64
+
+/* widest vector we'll ever use is 8 doubles (or 16 floats), keep the panels
+ * aligned to it */
+#define DISTANCE_ALIGN   8
+#define DISTANCE_ALIGN_F 16
+
+/* Blocking of distance_sq_nearest_gemm. A block of GEMM_MC samples by
+ * GEMM_KC features stays in L2 while the tile kernel streams a group of
+ * points (GEMM_KC x nr) out of L1 past it, GEMM_MR samples at a time. Dot
+ * products are gathered for GEMM_NC points before looking for the nearest.
+ * A BLAS does its own blocking, and does it best on bigger products */
+#ifdef KMEANS_USE_CBLAS
+#define GEMM_MC 256
+#define GEMM_NC 1024
+#else
+#define GEMM_MC 64
+#define GEMM_NC 256
+#endif
+#define GEMM_KC 256
+#define GEMM_MR 4
+
+typedef double v2d __attribute__ ((vector_size (16)));
+typedef long   v2l __attribute__ ((vector_size (16)));
+typedef double v4d __attribute__ ((vector_size (32)));
+typedef long   v4l __attribute__ ((vector_size (32)));
+typedef double v8d __attribute__ ((vector_size (64)));
+typedef long   v8l __attribute__ ((vector_size (64)));
+typedef float  v4f __attribute__ ((vector_size (16)));
+typedef int    v4i __attribute__ ((vector_size (16)));
+typedef float  v8f __attribute__ ((vector_size (32)));
+typedef int    v8i __attribute__ ((vector_size (32)));
+typedef float  v16f __attribute__ ((vector_size (64)));
+typedef int    v16i __attribute__ ((vector_size (64)));
+
+#define KERNEL(name) sse2_##name
+#define VD v2d
+#define VL v2l
+#define W  2
+#define VF v4f
+#define VI v4i
+#define WF 4
+#include	"distance_kernels.h"
+#undef KERNEL
+#undef VD
+#undef VL
+#undef W
+#undef VF
+#undef VI
+#undef WF
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#pragma GCC push_options
+#pragma GCC target ("avx2")
+#define KERNEL(name) avx2_##name
+#define VD v4d
+#define VL v4l
+#define W  4
+#define VF v8f
+#define VI v8i
+#define WF 8
+#include	"distance_kernels.h"
+#undef KERNEL
+#undef VD
+#undef VL
+#undef W
+#undef VF
+#undef VI
+#undef WF
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target ("avx512f")
+#define KERNEL(name) avx512_##name
+#define VD v8d
+#define VL v8l
+#define W  8
+#define VF v16f
+#define VI v16i
+#define WF 16
+#include	"distance_kernels.h"
+#undef KERNEL
+#undef VD
+#undef VL
+#undef W
+#undef VF
+#undef VI
+#undef WF
+#pragma GCC pop_options
+
+#endif
+
+static struct {
+    const char *name;
+    int (*nearest_panel) ( const DistancePanel *, const double *, double * );
+    void (*all_panel) ( const DistancePanel *, const double *, int, int,
+            double * );
+    int (*nearest_rows) ( const double *, const double *, int, int, double * );
+    void (*all_rows) ( const double *, const double *, int, int, double * );
+    int (*nearest_f32) ( const DistancePanelF *, const float *, float * );
+    int (*nearest_u8) ( const DistancePanelF *, const uint8_t *, float * );
+    void (*dot_tile) ( const double *, int, int, const double *, int,
+            double *, int, int );
+    int dot_nr;             /* points per group of a DotPanel */
+} kernels;
+
+static pthread_once_t kernels_once = PTHREAD_ONCE_INIT;
+
+static void
+pick_kernels ( void )
+{
+    /* KMEANS_ISA lets us force a narrower kernel when comparing them */
+    const char *force = getenv( "KMEANS_ISA" );
+
+    kernels.name = "sse2";
+    kernels.nearest_panel = sse2_nearest_panel;
+    kernels.all_panel = sse2_all_panel;
+    kernels.nearest_rows = sse2_nearest_rows;
+    kernels.all_rows = sse2_all_rows;
+    kernels.nearest_f32 = sse2_nearest_panel_f32;
+    kernels.nearest_u8 = sse2_nearest_panel_u8;
+    kernels.dot_tile = sse2_dot_tile;
+    kernels.dot_nr = 2*2;
+
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+
+    if( force && !strcmp( force, "sse2" ) ) {
+        return;
+    }
+
+    if( __builtin_cpu_supports( "avx512f" ) &&
+            !(force && !strcmp( force, "avx2" )) ) {
+        kernels.name = "avx512";
+        kernels.nearest_panel = avx512_nearest_panel;
+        kernels.all_panel = avx512_all_panel;
+        kernels.nearest_rows = avx512_nearest_rows;
+        kernels.all_rows = avx512_all_rows;
+        kernels.nearest_f32 = avx512_nearest_panel_f32;
+        kernels.nearest_u8 = avx512_nearest_panel_u8;
+        kernels.dot_tile = avx512_dot_tile;
+        kernels.dot_nr = 2*8;
+    } else if( __builtin_cpu_supports( "avx2" ) ) {
+        kernels.name = "avx2";
+        kernels.nearest_panel = avx2_nearest_panel;
+        kernels.all_panel = avx2_all_panel;
+        kernels.nearest_rows = avx2_nearest_rows;
+        kernels.all_rows = avx2_all_rows;
+        kernels.nearest_f32 = avx2_nearest_panel_f32;
+        kernels.nearest_u8 = avx2_nearest_panel_u8;
+        kernels.dot_tile = avx2_dot_tile;
+        kernels.dot_nr = 2*4;
+    }
+#endif
+}		/* -----  end of function pick_kernels  ----- */
+
+
+const char *
+distance_isa ( void )
+{
+    pthread_once( &kernels_once, pick_kernels );
+    return kernels.name;
+}		/* -----  end of function distance_isa  ----- */
+
+
+int
+DistancePanel_init ( DistancePanel *p, int dims, int n_points )
+{
+    if( !p ) {
+        return -1;
+    }
+
+    p->data = NULL;
+    if( dims < 1 || n_points < 1 ) {
+        return -1;
+    }
+
+    p->dims = dims;
+    p->n_points = n_points;
+    p->stride = (n_points + DISTANCE_ALIGN-1) / DISTANCE_ALIGN * DISTANCE_ALIGN;
+
+    size_t size = sizeof(double) * dims * p->stride;
+    p->data = workspace_alloc( size );
+    if( !p->data ) {
+        return -1;
+    }
+
+    /* the padding never changes, so fill it in once */
+    size_t i;
+    for( i=0; i<(size_t) dims * p->stride; i++ ) {
+        p->data[i] = HUGE_VAL;
+    }
+
+    pthread_once( &kernels_once, pick_kernels );
+    return 0;
+}		/* -----  end of function DistancePanel_init  ----- */
+
+
+void
+DistancePanel_load ( DistancePanel *p, const double *points )
+{
+    int i, f;
+    for( i=0; i<p->n_points; i++ ) {
+        for( f=0; f<p->dims; f++ ) {
+            p->data[(size_t) f*p->stride + i] = points[(size_t) i*p->dims + f];
+        }
+    }
+}		/* -----  end of function DistancePanel_load  ----- */
+
+
+void
+DistancePanel_free ( DistancePanel *p )
+{
+    if(p) {
+        workspace_free(p->data);
+        p->data = NULL;
+    }
+}		/* -----  end of function DistancePanel_free  ----- */
+
+
+int
+distance_sq_nearest ( const DistancePanel *p, const double *sample,
+        double *sq_dist )
+{
+    return kernels.nearest_panel( p, sample, sq_dist );
+}		/* -----  end of function distance_sq_nearest  ----- */
+
+
+void
+distance_sq_all ( const DistancePanel *p, const double *sample, double *out )
+{
+    kernels.all_panel( p, sample, 0, p->n_points, out );
+}		/* -----  end of function distance_sq_all  ----- */
+
+
+/* Like distance_sq_all but only for points start..end, out[0] being point
+ * start. start has to be a multiple of DISTANCE_ALIGN (8) so the kernels can
+ * load whole vectors */
+void
+distance_sq_range ( const DistancePanel *p, const double *sample, int start,
+        int end, double *out )
+{
+    kernels.all_panel( p, sample, start, end, out );
+}		/* -----  end of function distance_sq_range  ----- */
+
+
+void
+distance_sq_block ( const DistancePanel *p, const double *samples,
+        int n_samples, double *out )
+{
+    int s0, j0, i;
+
+    /* out is n_samples x n_points. Tile both ways so that a block of the
+     * panel is reused by a block of samples while it is still in cache */
+    for( s0=0; s0<n_samples; s0+=DISTANCE_TILE_SAMPLES ) {
+        int s1 = s0 + DISTANCE_TILE_SAMPLES;
+        if( s1 > n_samples ) {
+            s1 = n_samples;
+        }
+
+        for( j0=0; j0<p->n_points; j0+=DISTANCE_TILE_POINTS ) {
+            int j1 = j0 + DISTANCE_TILE_POINTS;
+            if( j1 > p->n_points ) {
+                j1 = p->n_points;
+            }
+
+            for( i=s0; i<s1; i++ ) {
+                kernels.all_panel( p, &samples[(size_t) i*p->dims], j0, j1,
+                        &out[(size_t) i*p->n_points + j0] );
+            }
+        }
+    }
+}		/* -----  end of function distance_sq_block  ----- */
+
+
+int
+DotPanel_init ( DotPanel *p, int dims, int n_points )
+{
+    if( !p ) {
+        return -1;
+    }
+
+    p->data = p->norms = p->rows = NULL;
+    if( dims < 1 || n_points < 1 ) {
+        return -1;
+    }
+
+    pthread_once( &kernels_once, pick_kernels );
+
+    p->dims = dims;
+    p->n_points = n_points;
+    p->nr = kernels.dot_nr;
+    p->n_groups = (n_points + p->nr-1) / p->nr;
+
+    size_t n = (size_t) p->n_groups * p->nr;
+    size_t size = sizeof(double) * dims * n;
+
+    p->data = workspace_alloc( size );
+    p->norms = workspace_alloc( sizeof(double) * n );
+    if( !p->data || !p->norms ) {
+        DotPanel_free( p );
+        return -1;
+    }
+
+#ifdef KMEANS_USE_CBLAS
+    p->rows = workspace_alloc( sizeof(double) * dims * n_points );
+    if( !p->rows ) {
+        DotPanel_free( p );
+        return -1;
+    }
+#endif
+
+    /* the padding points sit at the origin with an infinite norm, so they 
+     * are never the nearest */
+    memset( p->data, 0, size );
+    for( ; n > (size_t) n_points; n-- ) {
+        p->norms[n-1] = HUGE_VAL;
+    }
+
+    return 0;
+}		/* -----  end of function DotPanel_init  ----- */
+
+
+void
+DotPanel_load ( DotPanel *p, const double *points )
+{
+    int j, f, nr = p->nr;
+
+    for( j=0; j<p->n_points; j++ ) {
+        const double *x = &points[(size_t) j*p->dims];
+        double *g = &p->data[(size_t) (j/nr) * p->dims * nr + j%nr];
+        double norm = 0;
+        for( f=0; f<p->dims; f++ ) {
+            g[(size_t) f*nr] = x[f];
+            norm += x[f] * x[f];
+        }
+        p->norms[j] = norm;
+    }
+
+    if( p->rows ) {
+        memcpy( p->rows, points, sizeof(double) * p->dims * p->n_points );
+    }
+}		/* -----  end of function DotPanel_load  ----- */
+
+
+void
+DotPanel_free ( DotPanel *p )
+{
+    if(p) {
+        workspace_free(p->data);
+        workspace_free(p->norms);
+        workspace_free(p->rows);
+        p->data = p->norms = p->rows = NULL;
+    }
+}		/* -----  end of function DotPanel_free  ----- */
+
+
+/* what one thread needs for distance_sq_nearest_gemm, workspace_free() it
+ * after */
+double *
+distance_gemm_scratch ( void )
+{
+    return workspace_alloc( sizeof(double) * (GEMM_MC*GEMM_NC + GEMM_MC) );
+}		/* -----  end of function distance_gemm_scratch  ----- */
+
+
+/* The nearest point to each sample, using |x-c|^2 = |x|^2 - 2x.c + |c|^2. 
+ * The x.c are a matrix product, worked out a cache sized tile at a time, 
+ * and each tile is searched for the nearest points while it's still in 
+ * cache. This is the same point distance_sq_nearest finds except where two 
+ * are within rounding of each other. sq_dist, if not NULL, gets the squared
+ * distances */
+void
+distance_sq_nearest_gemm ( const DotPanel *p, const double *samples,
+        int n_samples, int *labels, double *sq_dist, double *scratch )
+{
+    double *tile = scratch, *best = &scratch[GEMM_MC*GEMM_NC];
+    int dims = p->dims, n_cols = p->n_groups * p->nr;
+    int m0, j0, i, j;
+
+    for( m0=0; m0<n_samples; m0+=GEMM_MC ) {
+        int mc = (n_samples - m0 < GEMM_MC)? n_samples - m0 : GEMM_MC;
+        const double *x = &samples[(size_t) m0*dims];
+        int *l = &labels[m0];
+
+        for( i=0; i<mc; i++ ) {
+            best[i] = HUGE_VAL;
+            l[i] = 0;
+        }
+
+        for( j0=0; j0<n_cols; j0+=GEMM_NC ) {
+            int nc = (n_cols - j0 < GEMM_NC)? n_cols - j0 : GEMM_NC;
+
+#ifdef KMEANS_USE_CBLAS
+            /* the BLAS takes the points as they are, without padding */
+            if( nc > p->n_points - j0 ) {
+                nc = p->n_points - j0;
+            }
+            cblas_dgemm( CblasRowMajor, CblasNoTrans, CblasTrans, mc, nc,
+                    dims, 1.0, x, dims, &p->rows[(size_t) j0*dims], dims, 
+                    0.0, tile, GEMM_NC );
+#else
+            int k0, g, i0, nr = p->nr;
+            for( k0=0; k0<dims; k0+=GEMM_KC ) {
+                int kc = (dims - k0 < GEMM_KC)? dims - k0 : GEMM_KC;
+                for( g=j0/nr; g<(j0+nc)/nr; g++ ) {
+                    const double *c = &p->data[((size_t) g*dims + k0) * nr];
+                    for( i0=0; i0<mc; i0+=GEMM_MR ) {
+                        kernels.dot_tile( &x[(size_t) i0*dims + k0], dims,
+                                (mc - i0 < GEMM_MR)? mc - i0 : GEMM_MR, c, kc,
+                                &tile[(size_t) i0*GEMM_NC + g*nr - j0], 
+                                GEMM_NC, k0 == 0 );
+                    }
+                }
+            }
+#endif
+
+            /* |x|^2 is the same for every point, leave it out until the
+             * nearest is found */
+            const double *norms = &p->norms[j0];
+            for( i=0; i<mc; i++ ) {
+                const double *t = &tile[(size_t) i*GEMM_NC];
+                double b = best[i];
+                int bl = l[i];
+                for( j=0; j<nc; j++ ) {
+                    double d = norms[j] - 2*t[j];
+                    if( d < b ) {
+                        b = d;
+                        bl = j0 + j;
+                    }
+                }
+                best[i] = b;
+                l[i] = bl;
+            }
+        }
+
+        if( sq_dist ) {
+            for( i=0; i<mc; i++ ) {
+                const double *xi = &x[(size_t) i*dims];
+                double norm = 0;
+                for( j=0; j<dims; j++ ) {
+                    norm += xi[j] * xi[j];
+                }
+                /* rounding can take a sample on a point below zero */
+                sq_dist[m0+i] = (norm + best[i] > 0)? norm + best[i] : 0;
+            }
+        }
+    }
+}		/* -----  end of function distance_sq_nearest_gemm  ----- */
+
+
+int
+distance_sq_nearest_rows ( const double *points, const double *sample,
+        int dims, int n_points, double *sq_dist )
+{
+    pthread_once( &kernels_once, pick_kernels );
+    return kernels.nearest_rows( points, sample, dims, n_points, sq_dist );
+}		/* -----  end of function distance_sq_nearest_rows  ----- */
+
+
+void
+distance_sq_all_rows ( const double *points, const double *sample, int dims,
+        int n_points, double *out )
+{
+    pthread_once( &kernels_once, pick_kernels );
+    kernels.all_rows( points, sample, dims, n_points, out );
+}		/* -----  end of function distance_sq_all_rows  ----- */
+
+
+int
+DistancePanelF_init ( DistancePanelF *p, int dims, int n_points )
+{
+    if( !p ) {
+        return -1;
+    }
+
+    p->data = NULL;
+    if( dims < 1 || n_points < 1 ) {
+        return -1;
+    }
+
+    p->dims = dims;
+    p->n_points = n_points;
+    p->stride = (n_points + DISTANCE_ALIGN_F-1) / DISTANCE_ALIGN_F * 
+        DISTANCE_ALIGN_F;
+
+    size_t size = sizeof(float) * dims * p->stride;
+    p->data = workspace_alloc( size );
+    if( !p->data ) {
+        return -1;
+    }
+
+    size_t i;
+    for( i=0; i<(size_t) dims * p->stride; i++ ) {
+        p->data[i] = HUGE_VALF;
+    }
+
+    pthread_once( &kernels_once, pick_kernels );
+    return 0;
+}		/* -----  end of function DistancePanelF_init  ----- */
+
+
+void
+DistancePanelF_load ( DistancePanelF *p, const float *points )
+{
+    int i, f;
+    for( i=0; i<p->n_points; i++ ) {
+        for( f=0; f<p->dims; f++ ) {
+            p->data[(size_t) f*p->stride + i] = points[(size_t) i*p->dims + f];
+        }
+    }
+}		/* -----  end of function DistancePanelF_load  ----- */
+
+
+void
+DistancePanelF_free ( DistancePanelF *p )
+{
+    if(p) {
+        workspace_free(p->data);
+        p->data = NULL;
+    }
+}		/* -----  end of function DistancePanelF_free  ----- */
+
+
+int
+distance_sq_nearest_f32 ( const DistancePanelF *p, const float *sample,
+        float *sq_dist )
+{
+    return kernels.nearest_f32( p, sample, sq_dist );
+}		/* -----  end of function distance_sq_nearest_f32  ----- */
+
+
+int
+distance_sq_nearest_u8 ( const DistancePanelF *p, const uint8_t *sample,
+        float *sq_dist )
+{
+    return kernels.nearest_u8( p, sample, sq_dist );
+}		/* -----  end of function distance_sq_nearest_u8  ----- */
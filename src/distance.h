@@ -0,0 +1,108 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  distance.h
+ *
+ *    Description:  Vectorised squared euclidean distance kernels. The
+ *                  instruction set (SSE2, AVX2 or AVX-512) is picked at
+ *                  runtime the first time a kernel is used.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 11:02:17
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  DISTANCE_INC
+#define  DISTANCE_INC
+
+#include	<stdint.h>
+
+/* A set of points (usually the centroids) transposed so that feature f of
+ * point j lives at data[f*stride + j]. stride is padded out to a whole
+ * vector and the padding holds points at infinity, so the kernels can compare
+ * a sample against several points per instruction without a remainder loop */
+typedef struct DistancePanel {
+    int dims;
+    int n_points;
+    int stride;
+    double *data;
+} DistancePanel;
+
+/* The same in single precision, padded out to a whole vector of floats */
+typedef struct DistancePanelF {
+    int dims;
+    int n_points;
+    int stride;
+    float *data;
+} DistancePanelF;
+
+/* Points packed for distance_sq_nearest_gemm. They're cut into groups of nr
+ * (the width of the kernel's tile), each group stored feature major so the
+ * kernel reads a whole row of the group per feature. norms holds each
+ * point's squared norm, and the padding points at infinity */
+typedef struct DotPanel {
+    int dims;
+    int n_points;
+    int nr;
+    int n_groups;
+    double *data;           /* n_groups x dims x nr */
+    double *norms;          /* n_groups x nr */
+    double *rows;           /* the points as given, for a BLAS */
+} DotPanel;
+
+int DistancePanel_init ( DistancePanel *p, int dims, int n_points );
+
+void DistancePanel_load ( DistancePanel *p, const double *points );
+
+void DistancePanel_free ( DistancePanel *p );
+
+const char *distance_isa ( void );
+
+int distance_sq_nearest ( const DistancePanel *p, const double *sample,
+        double *sq_dist );
+
+void distance_sq_all ( const DistancePanel *p, const double *sample,
+        double *out );
+
+void distance_sq_range ( const DistancePanel *p, const double *sample,
+        int start, int end, double *out );
+
+void distance_sq_block ( const DistancePanel *p, const double *samples,
+        int n_samples, double *out );
+
+int DotPanel_init ( DotPanel *p, int dims, int n_points );
+
+void DotPanel_load ( DotPanel *p, const double *points );
+
+void DotPanel_free ( DotPanel *p );
+
+double *distance_gemm_scratch ( void );
+
+void distance_sq_nearest_gemm ( const DotPanel *p, const double *samples,
+        int n_samples, int *labels, double *sq_dist, double *scratch );
+
+int distance_sq_nearest_rows ( const double *points, const double *sample,
+        int dims, int n_points, double *sq_dist );
+
+void distance_sq_all_rows ( const double *points, const double *sample,
+        int dims, int n_points, double *out );
+
+int DistancePanelF_init ( DistancePanelF *p, int dims, int n_points );
+
+void DistancePanelF_load ( DistancePanelF *p, const float *points );
+
+void DistancePanelF_free ( DistancePanelF *p );
+
+int distance_sq_nearest_f32 ( const DistancePanelF *p, const float *sample,
+        float *sq_dist );
+
+int distance_sq_nearest_u8 ( const DistancePanelF *p, const uint8_t *sample,
+        float *sq_dist );
+
+#endif   /* ----- #ifndef DISTANCE_INC  ----- */
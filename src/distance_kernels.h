@@ -0,0 +1,364 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  distance_kernels.h
+ *
+ *    Description:  Squared distance kernels. This file is a template, it is
+ *                  included once per instruction set by distance.c with
+ *                  KERNEL(), VD, VL, W, VF, VI and WF defined. VD is a vector
+ *                  of W doubles and VL the matching vector of integers, VF
+ *                  a vector of WF floats and VI its integers.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 11:02:17
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+/* The arithmetic is always acc += d*d with the features visited in order, so
+ * every lane produces exactly the value euclidean_distance would before its
+ * sqrt, whatever the vector width. The dot products of dot_tile are likewise
+ * the same in every lane and every instruction set. */
+
+/* Load W consecutive points for feature f. Panels are stored feature major
+ * and padded so a whole vector can always be read. Row major points are
+ * picked out one at a time */
+#define LOAD_PANEL(data, stride, f, j)  (*(const VD *) &(data)[(size_t)(f)*(stride) + (j)])
+
+static inline __attribute__((always_inline)) VD
+KERNEL(load_rows) ( const double *points, int dims, int f, int j )
+{
+    double tmp[W];
+    VD v;
+    int l;
+    for( l=0; l<W; l++ ) {
+        tmp[l] = points[(size_t)(j+l)*dims + f];
+    }
+    memcpy( &v, tmp, sizeof(v) );
+    return v;
+}		/* -----  end of function load_rows  ----- */
+
+
+static inline __attribute__((always_inline)) int
+KERNEL(nearest_body) ( const double *data, int stride, int rows,
+        const double *sample, int dims, int n_points, double *sq_dist )
+{
+    VD best = (VD){0} + HUGE_VAL;
+    VL best_idx = (VL){0};
+    VL idx;
+    long iota[W];
+    int j, f, l;
+
+    for( l=0; l<W; l++ ) {
+        iota[l] = l;
+    }
+    memcpy( &idx, iota, sizeof(idx) );
+
+    /* panels are padded out to a whole vector, row major points are not */
+    int n_full = (rows)? n_points - n_points%W : n_points;
+    for( j=0; j<n_full; j+=W ) {
+        VD acc = (VD){0};
+        for( f=0; f<dims; f++ ) {
+            VD c = (rows)? KERNEL(load_rows)( data, dims, f, j ) :
+                LOAD_PANEL( data, stride, f, j );
+            VD d = sample[f] - c;
+            acc += d*d;
+        }
+
+        /* strict comparison, so each lane keeps the first of any ties */
+        VL m = (VL)( acc < best );
+        best = (VD)( ((VL) acc & m) | ((VL) best & ~m) );
+        best_idx = (idx & m) | (best_idx & ~m);
+        idx += W;
+    }
+
+    /* pick the smallest lane, preferring the lowest index on a tie */
+    double b[W];
+    long bi[W];
+    memcpy( b, &best, sizeof(b) );
+    memcpy( bi, &best_idx, sizeof(bi) );
+
+    double min = b[0];
+    long closest = bi[0];
+    for( l=1; l<W; l++ ) {
+        if( b[l] < min || (b[l] == min && bi[l] < closest) ) {
+            min = b[l];
+            closest = bi[l];
+        }
+    }
+
+    /* whatever is left over of the row major points */
+    for( j=n_full; j<n_points; j++ ) {
+        double acc = 0;
+        for( f=0; f<dims; f++ ) {
+            double d = sample[f] - data[(size_t) j*dims + f];
+            acc += d*d;
+        }
+        if( acc < min ) {
+            min = acc;
+            closest = j;
+        }
+    }
+
+    if( sq_dist ) {
+        *sq_dist = min;
+    }
+
+    return (int) closest;
+}		/* -----  end of function nearest_body  ----- */
+
+
+static inline __attribute__((always_inline)) void
+KERNEL(all_body) ( const double *data, int stride, int rows,
+        const double *sample, int dims, int start, int end, double *out )
+{
+    int j, f;
+    int n_full = (rows)? end - (end-start)%W : end;
+
+    for( j=start; j<n_full; j+=W ) {
+        VD acc = (VD){0};
+        for( f=0; f<dims; f++ ) {
+            VD c = (rows)? KERNEL(load_rows)( data, dims, f, j ) :
+                LOAD_PANEL( data, stride, f, j );
+            VD d = sample[f] - c;
+            acc += d*d;
+        }
+
+        /* the panel padding may run past the end of the caller's range */
+        if( j + W <= end ) {
+            memcpy( &out[j-start], &acc, sizeof(acc) );
+        } else {
+            double tmp[W];
+            memcpy( tmp, &acc, sizeof(acc) );
+            memcpy( &out[j-start], tmp, sizeof(double) * (end-j) );
+        }
+    }
+
+    for( j=n_full; j<end; j++ ) {
+        double acc = 0;
+        for( f=0; f<dims; f++ ) {
+            double d = sample[f] - data[(size_t) j*dims + f];
+            acc += d*d;
+        }
+        out[j-start] = acc;
+    }
+}		/* -----  end of function all_body  ----- */
+
+
+/* Our samples are mostly RGB, so the common small feature counts get their
+ * own copies of the kernel with the feature loop fully unrolled */
+static int
+KERNEL(nearest_panel) ( const DistancePanel *p, const double *sample,
+        double *sq_dist )
+{
+    switch( p->dims ) {
+        case 1:
+            return KERNEL(nearest_body)( p->data, p->stride, 0, sample, 1,
+                    p->n_points, sq_dist );
+        case 2:
+            return KERNEL(nearest_body)( p->data, p->stride, 0, sample, 2,
+                    p->n_points, sq_dist );
+        case 3:
+            return KERNEL(nearest_body)( p->data, p->stride, 0, sample, 3,
+                    p->n_points, sq_dist );
+        case 4:
+            return KERNEL(nearest_body)( p->data, p->stride, 0, sample, 4,
+                    p->n_points, sq_dist );
+        default:
+            return KERNEL(nearest_body)( p->data, p->stride, 0, sample,
+                    p->dims, p->n_points, sq_dist );
+    }
+}		/* -----  end of function nearest_panel  ----- */
+
+
+static void
+KERNEL(all_panel) ( const DistancePanel *p, const double *sample,
+        int start, int end, double *out )
+{
+    switch( p->dims ) {
+        case 3:
+            KERNEL(all_body)( p->data, p->stride, 0, sample, 3, start, end,
+                    out );
+            break;
+        default:
+            KERNEL(all_body)( p->data, p->stride, 0, sample, p->dims, start,
+                    end, out );
+            break;
+    }
+}		/* -----  end of function all_panel  ----- */
+
+
+static int
+KERNEL(nearest_rows) ( const double *points, const double *sample, int dims,
+        int n_points, double *sq_dist )
+{
+    switch( dims ) {
+        case 3:
+            return KERNEL(nearest_body)( points, 0, 1, sample, 3, n_points,
+                    sq_dist );
+        default:
+            return KERNEL(nearest_body)( points, 0, 1, sample, dims,
+                    n_points, sq_dist );
+    }
+}		/* -----  end of function nearest_rows  ----- */
+
+
+static void
+KERNEL(all_rows) ( const double *points, const double *sample, int dims,
+        int n_points, double *out )
+{
+    switch( dims ) {
+        case 3:
+            KERNEL(all_body)( points, 0, 1, sample, 3, 0, n_points, out );
+            break;
+        default:
+            KERNEL(all_body)( points, 0, 1, sample, dims, 0, n_points, out );
+            break;
+    }
+}		/* -----  end of function all_rows  ----- */
+
+
+/* A tile of dot products for distance_sq_nearest_gemm: up to 4 samples
+ * (rows of x, ldx apart) against one group of 2W packed points, over kc
+ * features. The products are stored in out (ldo apart) or, if first is 0,
+ * added to what's there. Missing rows just repeat the last one, nothing is
+ * written for them */
+static void
+KERNEL(dot_tile) ( const double *x, int ldx, int mr, const double *c, int kc,
+        double *out, int ldo, int first )
+{
+    const double *x0 = x;
+    const double *x1 = (mr > 1)? x0 + ldx : x0;
+    const double *x2 = (mr > 2)? x1 + ldx : x1;
+    const double *x3 = (mr > 3)? x2 + ldx : x2;
+    VD a00 = (VD){0}, a01 = (VD){0}, a10 = (VD){0}, a11 = (VD){0};
+    VD a20 = (VD){0}, a21 = (VD){0}, a30 = (VD){0}, a31 = (VD){0};
+    int f, r;
+
+    for( f=0; f<kc; f++ ) {
+        VD c0 = *(const VD *) &c[(size_t) f*2*W];
+        VD c1 = *(const VD *) &c[(size_t) f*2*W + W];
+        a00 += x0[f] * c0;
+        a01 += x0[f] * c1;
+        a10 += x1[f] * c0;
+        a11 += x1[f] * c1;
+        a20 += x2[f] * c0;
+        a21 += x2[f] * c1;
+        a30 += x3[f] * c0;
+        a31 += x3[f] * c1;
+    }
+
+    VD acc[4][2] = { { a00, a01 }, { a10, a11 }, { a20, a21 }, { a30, a31 } };
+    for( r=0; r<mr; r++ ) {
+        double *o = &out[(size_t) r*ldo];
+        if( !first ) {
+            VD o0, o1;
+            memcpy( &o0, o, sizeof(o0) );
+            memcpy( &o1, o + W, sizeof(o1) );
+            acc[r][0] += o0;
+            acc[r][1] += o1;
+        }
+        memcpy( o, &acc[r][0], sizeof(VD) );
+        memcpy( o + W, &acc[r][1], sizeof(VD) );
+    }
+}		/* -----  end of function dot_tile  ----- */
+
+
+/* Single precision panels, for samples stored as floats or as bytes. The
+ * sample is widened to float one feature at a time, u8 is a constant in
+ * every caller so only one of the loads survives */
+static inline __attribute__((always_inline)) int
+KERNEL(nearest_f32_body) ( const float *data, int stride, const void *sample,
+        int u8, int dims, int n_points, float *sq_dist )
+{
+    VF best = (VF){0} + HUGE_VALF;
+    VI best_idx = (VI){0};
+    VI idx;
+    int iota[WF];
+    int j, f, l;
+
+    for( l=0; l<WF; l++ ) {
+        iota[l] = l;
+    }
+    memcpy( &idx, iota, sizeof(idx) );
+
+    for( j=0; j<n_points; j+=WF ) {
+        VF acc = (VF){0};
+        for( f=0; f<dims; f++ ) {
+            float x = (u8)? ((const uint8_t *) sample)[f] : 
+                ((const float *) sample)[f];
+            VF d = x - *(const VF *) &data[(size_t) f*stride + j];
+            acc += d*d;
+        }
+
+        VI m = (VI)( acc < best );
+        best = (VF)( ((VI) acc & m) | ((VI) best & ~m) );
+        best_idx = (idx & m) | (best_idx & ~m);
+        idx += WF;
+    }
+
+    /* Fold the lanes in half until one is left, keeping the smaller
+     * distance (or on a tie the lower index) of each pair. It all stays in
+     * registers, the lanes of a float vector are too many to pick through
+     * one at a time like the double version does */
+    for( l=WF/2; l>0; l/=2 ) {
+        int perm[WF], k;
+        VI mask;
+        for( k=0; k<WF; k++ ) {
+            perm[k] = k ^ l;
+        }
+        memcpy( &mask, perm, sizeof(mask) );
+
+        VF other = __builtin_shuffle( best, mask );
+        VI other_idx = __builtin_shuffle( best_idx, mask );
+        VI m = (other < best) | ((other == best) & (other_idx < best_idx));
+        best = (VF)( ((VI) other & m) | ((VI) best & ~m) );
+        best_idx = (other_idx & m) | (best_idx & ~m);
+    }
+
+    float min = best[0];
+    int closest = best_idx[0];
+
+    if( sq_dist ) {
+        *sq_dist = min;
+    }
+
+    return closest;
+}		/* -----  end of function nearest_f32_body  ----- */
+
+
+static int
+KERNEL(nearest_panel_f32) ( const DistancePanelF *p, const float *sample,
+        float *sq_dist )
+{
+    switch( p->dims ) {
+        case 3:
+            return KERNEL(nearest_f32_body)( p->data, p->stride, sample, 0, 
+                    3, p->n_points, sq_dist );
+        default:
+            return KERNEL(nearest_f32_body)( p->data, p->stride, sample, 0, 
+                    p->dims, p->n_points, sq_dist );
+    }
+}		/* -----  end of function nearest_panel_f32  ----- */
+
+
+static int
+KERNEL(nearest_panel_u8) ( const DistancePanelF *p, const uint8_t *sample,
+        float *sq_dist )
+{
+    switch( p->dims ) {
+        case 3:
+            return KERNEL(nearest_f32_body)( p->data, p->stride, sample, 1, 
+                    3, p->n_points, sq_dist );
+        default:
+            return KERNEL(nearest_f32_body)( p->data, p->stride, sample, 1, 
+                    p->dims, p->n_points, sq_dist );
+    }
+}		/* -----  end of function nearest_panel_u8  ----- */
+
+#undef LOAD_PANEL
@@ -0,0 +1,191 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  gemm.c
+ *
+ *    Description:  Lloyd's algorithm for samples with many features, say
+ *                  embeddings of a few hundred dimensions clustered into
+ *                  thousands of centroids. Comparing samples one at a time
+ *                  streams every centroid through the cache for every
+ *                  sample; here the assignment is a blocked matrix product
+ *                  of samples and centroids (see distance_sq_nearest_gemm),
+ *                  done by a BLAS if we were built with KMEANS_USE_CBLAS.
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 13:37:45
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	"distance.h"
+#include	"parallel.h"
+#include	"slots.h"
+#include	"monitor.h"
+#include	"workspace.h"
+#include	"profile.h"
+
+/* samples handed to distance_sq_nearest_gemm at a time, so the labels and
+ * distances for them fit on the stack */
+#define GEMM_BATCH 256
+
+/* state shared by the tasks of one iteration */
+struct GemmPass {
+    DotPanel panel;         /* the centroids, packed for the tile kernel */
+    KMeansSlots slots;
+    double *samples;
+    double *weights;        /* NULL when every sample counts once */
+    int dims;
+    int *labels;
+    double **scratch;       /* one per thread */
+    int monitored;          /* keep the inertia for a KMeansMonitor */
+};
+
+/* Assign the samples of the slot a batch at a time, then fold them into the
+ * slot's share of the new centroids */
+static void
+gemm_pass_slot ( void *ctx, int slot, int thread )
+{
+    struct GemmPass *p = ctx;
+    int labels[GEMM_BATCH];
+    double d[GEMM_BATCH];
+    int i, b, start, end, n_changed = 0;
+
+    KMeansSlots_clear( &p->slots, slot );
+    KMeansSlots_range( &p->slots, slot, &start, &end );
+
+    for( b=start; b<end; b+=GEMM_BATCH ) {
+        int n = (end - b < GEMM_BATCH)? end - b : GEMM_BATCH;
+
+        distance_sq_nearest_gemm( &p->panel, &p->samples[(size_t) b*p->dims],
+                n, labels, (p->monitored)? d : NULL, p->scratch[thread] );
+
+        for( i=0; i<n; i++ ) {
+            double *sample = &p->samples[(size_t) (b+i) * p->dims];
+            double weight = (p->weights)? p->weights[b+i] : 1.0;
+
+            if( p->labels[b+i] != labels[i] ) {
+                p->labels[b+i] = labels[i];
+                n_changed++;
+            }
+
+            if( p->monitored ) {
+                p->slots.inertia[slot] += weight * d[i];
+            }
+
+            KMeansSlots_add( &p->slots, slot, labels[i], sample, weight );
+        }
+    }
+
+    p->slots.changed[slot] = n_changed;
+    p->slots.evals[slot] = (long long) (end - start) * p->panel.n_points;
+}		/* -----  end of function gemm_pass_slot  ----- */
+
+
+int
+cluster_kmeans_gemm ( double *centroids, double *samples, double *weights,
+        int dims, int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor )
+{
+    struct GemmPass p;
+    KMeansIterStats stats;
+    int *counts = workspace_alloc( sizeof(int) * n_centroids );
+    double *old = NULL;
+    int i, ok;
+
+    if( monitor && !monitor->callback ) {
+        monitor = NULL;
+    }
+    if( monitor ) {
+        old = workspace_alloc( sizeof(double) * n_centroids * dims );
+    }
+
+    if( n_threads < 1 ) {
+        n_threads = 1;
+    }
+    if( n_threads > PARALLEL_MAX_THREADS ) {
+        n_threads = PARALLEL_MAX_THREADS;
+    }
+
+    p.samples = samples;
+    p.weights = weights;
+    p.dims = dims;
+    p.labels = labels;
+    p.monitored = (monitor != NULL);
+
+    DotPanel_init( &p.panel, dims, n_centroids );
+    KMeansSlots_init( &p.slots, dims, n_centroids, n_samples );
+    p.slots.weighted = (weights != NULL);
+    p.scratch = workspace_calloc( n_threads, sizeof(double *) );
+
+    ok = counts && p.panel.data && p.slots.sums && p.scratch &&
+        (old || !monitor);
+    for( i=0; ok && i<n_threads; i++ ) {
+        p.scratch[i] = distance_gemm_scratch();
+        ok = (p.scratch[i] != NULL);
+    }
+
+    if( ok ) {
+        memset( labels, 0, sizeof(int) * n_samples );
+        memset( &stats, 0, sizeof(stats) );
+
+        int reassigned = n_samples;
+        while( reassigned > 0 ) {
+            ProfileMark mark;
+            double t = 0;
+            if( monitor ) {
+                memcpy( old, centroids, sizeof(double) * n_centroids * dims );
+                t = monitor_clock();
+            }
+
+            profile_begin( &mark );
+            DotPanel_load( &p.panel, centroids );
+            parallel_for( n_threads, p.slots.n_slots, gemm_pass_slot, &p );
+            profile_slots( &p.slots );
+            profile_end( &mark, KMEANS_PHASE_ASSIGN );
+
+            if( monitor ) {
+                stats.assign_seconds = monitor_clock() - t;
+                t = monitor_clock();
+            }
+
+            profile_begin( &mark );
+            reassigned = KMeansSlots_reduce( &p.slots, centroids, counts );
+            profile_end( &mark, KMEANS_PHASE_UPDATE );
+
+            if( monitor ) {
+                stats.update_seconds = monitor_clock() - t;
+                stats.iteration++;
+                stats.changed = reassigned;
+                stats.max_shift = monitor_max_shift( old, centroids, dims,
+                        n_centroids );
+                if( monitor_report( monitor, &p.slots, &stats ) ) {
+                    break;
+                }
+            }
+        }
+    }
+
+    if( p.scratch ) {
+        for( i=0; i<n_threads; i++ ) {
+            workspace_free(p.scratch[i]);
+        }
+    }
+    DotPanel_free( &p.panel );
+    KMeansSlots_free( &p.slots );
+    workspace_free(p.scratch);
+    workspace_free(counts);
+    workspace_free(old);
+
+    /* the plain engine needs much less memory */
+    if( !ok ) {
+        return cluster_kmeans_parallel( centroids, samples, weights, dims,
+                n_centroids, n_samples, labels, n_threads, monitor );
+    }
+    return 0;
+}		/* -----  end of function cluster_kmeans_gemm  ----- */
@@ -0,0 +1,643 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kdtree.c
+ *
+ *    Description:  Kanungo et al.'s filtering algorithm. A kd-tree is built
+ *                  once over the samples, with the sum and count of the
+ *                  samples under every node. Each iteration walks the tree
+ *                  with a shrinking list of candidate centroids and hands a
+ *                  whole node to a centroid as soon as only one is left, so
+ *                  the work goes with the nodes visited rather than n x k.
+ *                  Pays off for low dimensional data like colours.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 15:21:09
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	"parallel.h"
+#include	"slots.h"
+#include	"monitor.h"
+#include	"kdtree.h"
+#include	"workspace.h"
+#include	"profile.h"
+
+/* state shared by the tasks of one filtering iteration */
+struct FilterPass {
+    const KdTree *tree;
+    KMeansSlots slots;
+    double *samples;
+    double *weights;        /* NULL when every sample counts once */
+    double *centroids;
+    int dims;
+    int n_centroids;
+    int *labels;
+    int monitored;          /* keep the inertia for a KMeansMonitor */
+
+    int *tasks;             /* n_slots subtrees, one per reduction slot */
+    int *task_cand;         /* n_slots x k candidates left above each one */
+    int *task_m;            /* n_slots, how many */
+    int *scratch;           /* candidate lists, k x (depth+1) per thread */
+    int *owner;             /* n_nodes, every sample under the node has this
+                             * label, or -1 when we don't know they agree */
+};
+
+
+/* Nodes a subtree of n samples needs. Depends only on n, so the tree can be
+ * allocated in one go before it's built */
+static int
+kdtree_count ( int n )
+{
+    if( n <= KDTREE_LEAF_SIZE ) {
+        return 1;
+    }
+    return 1 + kdtree_count( n/2 ) + kdtree_count( n - n/2 );
+}		/* -----  end of function kdtree_count  ----- */
+
+
+/* Partially sort index[start..end) on feature f so the element at mid is
+ * where it would be if sorted, smaller ones before it and larger after */
+static void
+kdtree_select ( int *index, const double *samples, int dims, int f,
+        int start, int end, int mid )
+{
+    int lo = start, hi = end - 1;
+
+    while( lo < hi ) {
+        double pivot = samples[(size_t) index[(lo + hi) / 2] * dims + f];
+        int i = lo, j = hi;
+
+        while( i <= j ) {
+            while( samples[(size_t) index[i] * dims + f] < pivot ) {
+                i++;
+            }
+            while( samples[(size_t) index[j] * dims + f] > pivot ) {
+                j--;
+            }
+            if( i <= j ) {
+                int t = index[i];
+                index[i] = index[j];
+                index[j] = t;
+                i++;
+                j--;
+            }
+        }
+
+        if( mid <= j ) {
+            hi = j;
+        } else if( mid >= i ) {
+            lo = i;
+        } else {
+            break;
+        }
+    }
+}		/* -----  end of function kdtree_select  ----- */
+
+
+/* Build the subtree over index[start..end) into node, splitting at the
+ * median of the widest feature. Returns the next free node */
+static int
+kdtree_build_node ( KdTree *t, const double *samples, const double *weights,
+        int node, int start, int end, int depth )
+{
+    KdNode *n = &t->nodes[node];
+    int dims = t->dims;
+    double *lo = &t->lo[(size_t) node * dims];
+    double *hi = &t->hi[(size_t) node * dims];
+    double *sum = &t->sum[(size_t) node * dims];
+    int i, j, next = node + 1;
+
+    n->start = start;
+    n->end = end;
+    n->left = n->right = -1;
+
+    if( depth > t->depth ) {
+        t->depth = depth;
+    }
+
+    for( j=0; j<dims; j++ ) {
+        lo[j] = HUGE_VAL;
+        hi[j] = -HUGE_VAL;
+    }
+    for( i=start; i<end; i++ ) {
+        const double *x = &samples[(size_t) t->index[i] * dims];
+        for( j=0; j<dims; j++ ) {
+            if( x[j] < lo[j] ) {
+                lo[j] = x[j];
+            }
+            if( x[j] > hi[j] ) {
+                hi[j] = x[j];
+            }
+        }
+    }
+
+    if( end - start <= KDTREE_LEAF_SIZE ) {
+        memset( sum, 0, sizeof(double) * dims );
+        n->weight = 0;
+        t->sumsq[node] = 0;
+        for( i=start; i<end; i++ ) {
+            const double *x = &samples[(size_t) t->index[i] * dims];
+            double w = (weights)? weights[t->index[i]] : 1.0;
+            double sq = 0;
+            for( j=0; j<dims; j++ ) {
+                sum[j] += w * x[j];
+                sq += x[j] * x[j];
+            }
+            n->weight += w;
+            t->sumsq[node] += w * sq;
+        }
+        return next;
+    }
+
+    int f = 0;
+    for( j=1; j<dims; j++ ) {
+        if( hi[j] - lo[j] > hi[f] - lo[f] ) {
+            f = j;
+        }
+    }
+
+    int mid = start + (end - start) / 2;
+    kdtree_select( t->index, samples, dims, f, start, end, mid );
+
+    n->left = next;
+    next = kdtree_build_node( t, samples, weights, next, start, mid,
+            depth + 1 );
+    n->right = next;
+    next = kdtree_build_node( t, samples, weights, next, mid, end,
+            depth + 1 );
+
+    const double *ls = &t->sum[(size_t) n->left * dims];
+    const double *rs = &t->sum[(size_t) n->right * dims];
+    for( j=0; j<dims; j++ ) {
+        sum[j] = ls[j] + rs[j];
+    }
+    n->weight = t->nodes[n->left].weight + t->nodes[n->right].weight;
+    t->sumsq[node] = t->sumsq[n->left] + t->sumsq[n->right];
+
+    return next;
+}		/* -----  end of function kdtree_build_node  ----- */
+
+
+void
+kdtree_free ( KdTree *t )
+{
+    workspace_free(t->nodes);
+    workspace_free(t->lo);
+    workspace_free(t->hi);
+    workspace_free(t->sum);
+    workspace_free(t->sumsq);
+    workspace_free(t->index);
+    memset( t, 0, sizeof(*t) );
+}		/* -----  end of function kdtree_free  ----- */
+
+
+int
+kdtree_build ( KdTree *t, const double *samples, const double *weights,
+        int dims, int n_samples )
+{
+    int i;
+
+    memset( t, 0, sizeof(*t) );
+    t->dims = dims;
+    t->n_nodes = kdtree_count( n_samples );
+    t->nodes = workspace_alloc( sizeof(KdNode) * t->n_nodes );
+    t->lo = workspace_alloc( sizeof(double) * t->n_nodes * dims );
+    t->hi = workspace_alloc( sizeof(double) * t->n_nodes * dims );
+    t->sum = workspace_alloc( sizeof(double) * t->n_nodes * dims );
+    t->sumsq = workspace_alloc( sizeof(double) * t->n_nodes );
+    t->index = workspace_alloc( sizeof(int) * n_samples );
+
+    if( !t->nodes || !t->lo || !t->hi || !t->sum || !t->sumsq ||
+            !t->index ) {
+        kdtree_free(t);
+        return -1;
+    }
+
+    for( i=0; i<n_samples; i++ ) {
+        t->index[i] = i;
+    }
+    kdtree_build_node( t, samples, weights, 0, 0, n_samples, 0 );
+
+    return 0;
+}		/* -----  end of function kdtree_build  ----- */
+
+
+/* Cut the top of the tree into as many subtrees as there are reduction
+ * slots, always splitting the largest. Only the tree decides where the cuts
+ * go, so the slots and the centroids don't depend on the thread count */
+static void
+filter_split_tasks ( struct FilterPass *p )
+{
+    int n = 1, i;
+
+    p->tasks[0] = 0;
+    while( n < p->slots.n_slots ) {
+        int best = -1, size = 0;
+        for( i=0; i<n; i++ ) {
+            const KdNode *node = &p->tree->nodes[p->tasks[i]];
+            if( node->left >= 0 && node->end - node->start > size ) {
+                size = node->end - node->start;
+                best = i;
+            }
+        }
+        if( best < 0 ) {
+            break;
+        }
+
+        /* keep the subtrees in tree order */
+        memmove( &p->tasks[best+2], &p->tasks[best+1],
+                sizeof(int) * (n - best - 1) );
+        p->tasks[best+1] = p->tree->nodes[p->tasks[best]].right;
+        p->tasks[best] = p->tree->nodes[p->tasks[best]].left;
+        n++;
+    }
+
+    p->slots.n_slots = n;
+}		/* -----  end of function filter_split_tasks  ----- */
+
+
+/* Is every point in the box lo..hi strictly closer to centroid a than to b?
+ * The difference of the squared distances is linear in the point, so it's
+ * largest at the corner furthest towards b. The margin keeps us clear of
+ * ties the brute force search could round either way */
+static int
+filter_box_closer ( const double *a, const double *b, const double *lo,
+        const double *hi, int dims )
+{
+    double f = 0, scale = 1;
+    int j;
+
+    for( j=0; j<dims; j++ ) {
+        double c = 2 * (b[j] - a[j]);
+        double v = (c > 0)? hi[j] : lo[j];
+        f += c * v + a[j]*a[j] - b[j]*b[j];
+        scale += a[j]*a[j] + b[j]*b[j] + v*v;
+    }
+
+    return f < -1e-9 * scale;
+}		/* -----  end of function filter_box_closer  ----- */
+
+
+/* Drop the candidates which can't be closest to anything in the node. The
+ * one nearest the middle of the box stays, and so does anything it doesn't
+ * beat everywhere in the box. The candidates stay in ascending order so
+ * ties still go to the lower index. Returns how many are left in out */
+static int
+filter_prune ( struct FilterPass *p, int node, const int *cand, int m,
+        int *out, long long *evals )
+{
+    int dims = p->dims;
+    const double *lo = &p->tree->lo[(size_t) node * dims];
+    const double *hi = &p->tree->hi[(size_t) node * dims];
+    int i, j, best = 0, n_out = 0;
+    double best_d = HUGE_VAL;
+
+    if( m == 1 ) {
+        out[0] = cand[0];
+        return 1;
+    }
+
+    for( i=0; i<m; i++ ) {
+        const double *z = &p->centroids[cand[i]*dims];
+        double d = 0;
+        for( j=0; j<dims; j++ ) {
+            double x = z[j] - 0.5 * (lo[j] + hi[j]);
+            d += x*x;
+        }
+        if( d < best_d ) {
+            best_d = d;
+            best = cand[i];
+        }
+    }
+    *evals += m;
+
+    const double *zb = &p->centroids[best*dims];
+    for( i=0; i<m; i++ ) {
+        if( cand[i] == best || !filter_box_closer( zb,
+                    &p->centroids[cand[i]*dims], lo, hi, dims ) ) {
+            out[n_out++] = cand[i];
+        }
+    }
+    *evals += m - 1;
+
+    return n_out;
+}		/* -----  end of function filter_prune  ----- */
+
+
+/* Everything under node goes to centroid c. The labels only need touching
+ * when the node didn't already belong to c */
+static void
+filter_assign ( struct FilterPass *p, int slot, int node, int c )
+{
+    const KdNode *n = &p->tree->nodes[node];
+    KMeansSlots *s = &p->slots;
+    int dims = p->dims;
+    const double *sum = &p->tree->sum[(size_t) node * dims];
+    double *acc = &s->sums[((size_t) slot * s->n_centroids + c) * dims];
+    int i, j;
+
+    for( j=0; j<dims; j++ ) {
+        acc[j] += sum[j];
+    }
+    s->weights[(size_t) slot * s->n_centroids + c] += n->weight;
+    s->counts[(size_t) slot * s->n_centroids + c] += n->end - n->start;
+
+    if( p->monitored ) {
+        /* sum of w|x - z|^2 = sum w|x|^2 - 2 z.sum wx + |z|^2 sum w */
+        const double *z = &p->centroids[c*dims];
+        double zz = 0, zs = 0;
+        for( j=0; j<dims; j++ ) {
+            zz += z[j] * z[j];
+            zs += z[j] * sum[j];
+        }
+        s->inertia[slot] += p->tree->sumsq[node] - 2 * zs + zz * n->weight;
+    }
+
+    if( p->owner[node] != c ) {
+        for( i=n->start; i<n->end; i++ ) {
+            int x = p->tree->index[i];
+            if( p->labels[x] != c ) {
+                p->labels[x] = c;
+                s->changed[slot]++;
+            }
+        }
+        p->owner[node] = c;
+    }
+}		/* -----  end of function filter_assign  ----- */
+
+
+/* Several candidates made it to a leaf, so check its samples one by one */
+static inline __attribute__((always_inline)) void
+filter_leaf_body ( struct FilterPass *p, int slot, int node, const int *cand,
+        int m, int dims )
+{
+    const KdNode *n = &p->tree->nodes[node];
+    int i, j, l;
+
+    for( i=n->start; i<n->end; i++ ) {
+        int x = p->tree->index[i];
+        const double *sample = &p->samples[(size_t) x * dims];
+        double weight = (p->weights)? p->weights[x] : 1.0;
+        double best_d = HUGE_VAL;
+        int best = cand[0];
+
+        for( l=0; l<m; l++ ) {
+            const double *z = &p->centroids[cand[l]*dims];
+            double d = 0;
+            for( j=0; j<dims; j++ ) {
+                double e = sample[j] - z[j];
+                d += e*e;
+            }
+            best = (d < best_d)? cand[l] : best;
+            best_d = (d < best_d)? d : best_d;
+        }
+
+        if( p->labels[x] != best ) {
+            p->labels[x] = best;
+            p->slots.changed[slot]++;
+        }
+        if( p->monitored ) {
+            p->slots.inertia[slot] += weight * best_d;
+        }
+
+        KMeansSlots_add( &p->slots, slot, best, sample, weight );
+    }
+}		/* -----  end of function filter_leaf_body  ----- */
+
+
+/* colours get a copy with the feature loop unrolled */
+static void
+filter_leaf ( struct FilterPass *p, int slot, int node, const int *cand,
+        int m, long long *evals )
+{
+    const KdNode *n = &p->tree->nodes[node];
+
+    if( p->dims == 3 ) {
+        filter_leaf_body( p, slot, node, cand, m, 3 );
+    } else {
+        filter_leaf_body( p, slot, node, cand, m, p->dims );
+    }
+
+    *evals += (long long) m * (n->end - n->start);
+    p->owner[node] = -1;
+}		/* -----  end of function filter_leaf  ----- */
+
+
+static void
+filter_node ( struct FilterPass *p, int slot, int node, const int *cand,
+        int m, int *scratch, long long *evals )
+{
+    const KdNode *n = &p->tree->nodes[node];
+
+    m = filter_prune( p, node, cand, m, scratch, evals );
+
+    if( m == 1 ) {
+        filter_assign( p, slot, node, scratch[0] );
+    } else if( n->left < 0 ) {
+        filter_leaf( p, slot, node, scratch, m, evals );
+    } else {
+        /* the children's labels agree with ours until we know better */
+        if( p->owner[node] >= 0 ) {
+            p->owner[n->left] = p->owner[node];
+            p->owner[n->right] = p->owner[node];
+            p->owner[node] = -1;
+        }
+        filter_node( p, slot, n->left, scratch, m,
+                scratch + p->n_centroids, evals );
+        filter_node( p, slot, n->right, scratch, m,
+                scratch + p->n_centroids, evals );
+    }
+}		/* -----  end of function filter_node  ----- */
+
+
+static void
+filter_pass_slot ( void *ctx, int slot, int thread )
+{
+    struct FilterPass *p = ctx;
+    int k = p->n_centroids;
+    int *scratch = &p->scratch[(size_t) thread * k * (p->tree->depth + 1)];
+    long long n_evals = 0;
+
+    KMeansSlots_clear( &p->slots, slot );
+    filter_node( p, slot, p->tasks[slot], &p->task_cand[(size_t) slot * k],
+            p->task_m[slot], scratch, &n_evals );
+    p->slots.evals[slot] = n_evals;
+}		/* -----  end of function filter_pass_slot  ----- */
+
+
+/* Filter the candidates down through the nodes above the subtrees, leaving
+ * each subtree with the ones that survived the path to it */
+static void
+filter_top ( struct FilterPass *p, int node, const int *cand, int m,
+        int *scratch, long long *evals )
+{
+    int k = p->n_centroids;
+    int i;
+
+    for( i=0; i<p->slots.n_slots; i++ ) {
+        if( p->tasks[i] == node ) {
+            memcpy( &p->task_cand[(size_t) i * k], cand, sizeof(int) * m );
+            p->task_m[i] = m;
+            return;
+        }
+    }
+
+    m = filter_prune( p, node, cand, m, scratch, evals );
+    filter_top( p, p->tree->nodes[node].left, scratch, m, scratch + k, evals );
+    filter_top( p, p->tree->nodes[node].right, scratch, m, scratch + k,
+            evals );
+}		/* -----  end of function filter_top  ----- */
+
+
+/* Train with a tree that's already built, so several runs over the same
+ * samples can share one. The tree isn't changed. Returns -1 if not even 
+ * brute force could get its memory */
+int
+cluster_kmeans_filter_tree ( const KdTree *tree, double *centroids,
+        double *samples, double *weights, int dims, int n_centroids,
+        int n_samples, int *labels, int n_threads, KMeansMonitor *monitor )
+{
+    struct FilterPass p;
+    KMeansIterStats stats;
+    int i;
+
+    if( monitor && !monitor->callback ) {
+        monitor = NULL;
+    }
+
+    if( n_threads < 1 ) {
+        n_threads = 1;
+    }
+    if( n_threads > PARALLEL_MAX_THREADS ) {
+        n_threads = PARALLEL_MAX_THREADS;
+    }
+
+    memset( &p, 0, sizeof(p) );
+    p.samples = samples;
+    p.weights = weights;
+    p.centroids = centroids;
+    p.dims = dims;
+    p.n_centroids = n_centroids;
+    p.labels = labels;
+    p.monitored = (monitor != NULL);
+    p.tree = tree;
+
+    int *counts = workspace_alloc( sizeof(int) * n_centroids );
+    int *all = workspace_alloc( sizeof(int) * n_centroids );
+    double *old = workspace_alloc( sizeof(double) * n_centroids * dims );
+    KMeansSlots_init( &p.slots, dims, n_centroids, n_samples );
+    p.slots.weighted = (weights != NULL);
+
+    int n_slots = p.slots.n_slots;
+    size_t per_thread = (size_t) n_centroids * (tree->depth + 1);
+    p.tasks = workspace_alloc( sizeof(int) * n_slots );
+    p.task_cand = workspace_alloc( sizeof(int) * n_slots * n_centroids );
+    p.task_m = workspace_alloc( sizeof(int) * n_slots );
+    p.scratch = workspace_alloc( sizeof(int) * per_thread * n_threads );
+    p.owner = workspace_alloc( sizeof(int) * tree->n_nodes );
+
+    int ok = counts && all && old && p.slots.sums && p.tasks &&
+        p.task_cand && p.task_m && p.scratch && p.owner;
+
+    if( ok ) {
+        filter_split_tasks( &p );
+
+        /* the labels start out all 0, and so does every subtree */
+        memset( labels, 0, sizeof(int) * n_samples );
+        for( i=0; i<tree->n_nodes; i++ ) {
+            p.owner[i] = -1;
+        }
+        for( i=0; i<p.slots.n_slots; i++ ) {
+            p.owner[p.tasks[i]] = 0;
+        }
+        for( i=0; i<n_centroids; i++ ) {
+            all[i] = i;
+        }
+        memset( &stats, 0, sizeof(stats) );
+
+        int reassigned = n_samples;
+        while( reassigned > 0 ) {
+            double t = (monitor)? monitor_clock() : 0;
+            long long top_evals = 0;
+            ProfileMark mark;
+
+            if( monitor ) {
+                memcpy( old, centroids, sizeof(double) * n_centroids * dims );
+            }
+
+            profile_begin( &mark );
+            filter_top( &p, 0, all, n_centroids, p.scratch, &top_evals );
+            parallel_for( n_threads, p.slots.n_slots, filter_pass_slot, &p );
+            p.slots.evals[0] += top_evals;
+            profile_slots( &p.slots );
+            profile_end( &mark, KMEANS_PHASE_ASSIGN );
+
+            if( monitor ) {
+                stats.assign_seconds = monitor_clock() - t;
+                t = monitor_clock();
+            }
+
+            profile_begin( &mark );
+            reassigned = KMeansSlots_reduce( &p.slots, centroids, counts );
+            profile_end( &mark, KMEANS_PHASE_UPDATE );
+
+            if( monitor ) {
+                stats.update_seconds = monitor_clock() - t;
+                stats.iteration++;
+                stats.changed = reassigned;
+                stats.max_shift = monitor_max_shift( old, centroids, dims,
+                        n_centroids );
+                if( monitor_report( monitor, &p.slots, &stats ) ) {
+                    break;
+                }
+            }
+        }
+    }
+
+    KMeansSlots_free( &p.slots );
+    workspace_free(p.tasks);
+    workspace_free(p.task_cand);
+    workspace_free(p.task_m);
+    workspace_free(p.scratch);
+    workspace_free(p.owner);
+    workspace_free(counts);
+    workspace_free(all);
+    workspace_free(old);
+
+    /* brute force finds the same clusters without any of the above */
+    if( !ok ) {
+        return cluster_kmeans_parallel( centroids, samples, weights, dims,
+                n_centroids, n_samples, labels, n_threads, monitor );
+    }
+    return 0;
+}		/* -----  end of function cluster_kmeans_filter_tree  ----- */
+
+
+int
+cluster_kmeans_filter ( double *centroids, double *samples, double *weights,
+        int dims, int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor )
+{
+    KdTree tree;
+    int err;
+
+    /* the tree costs a few words per sample. If we couldn't have it, brute
+     * force finds the same clusters */
+    if( kdtree_build( &tree, samples, weights, dims, n_samples ) ) {
+        return cluster_kmeans_parallel( centroids, samples, weights, dims,
+                n_centroids, n_samples, labels, n_threads, monitor );
+    }
+
+    err = cluster_kmeans_filter_tree( &tree, centroids, samples, weights, 
+            dims, n_centroids, n_samples, labels, n_threads, monitor );
+    kdtree_free( &tree );
+    return err;
+}		/* -----  end of function cluster_kmeans_filter  ----- */
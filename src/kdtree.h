@@ -0,0 +1,56 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  kdtree.h
+ *
+ *    Description:  The kd-tree behind the filtering engine. Built once over
+ *                  the samples and only read while training, so runs over
+ *                  the same samples can share it. Not part of the public
+ *                  interface in kmeans.h.
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 16:48:10
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  KDTREE_INC
+#define  KDTREE_INC
+
+#include	"kmeans.h"
+
+/* nodes with more samples than this get split */
+#define KDTREE_LEAF_SIZE 16
+
+typedef struct KdNode {
+    int start, end;         /* the node's samples are index[start..end) */
+    int left, right;        /* children, -1 for a leaf */
+    double weight;          /* total weight of the samples */
+} KdNode;
+
+typedef struct KdTree {
+    int dims;
+    int n_nodes;
+    int depth;              /* of the deepest leaf, the root is 0 */
+    KdNode *nodes;
+    double *lo, *hi;        /* n_nodes x dims bounding boxes */
+    double *sum;            /* n_nodes x dims (weighted) sums of the samples */
+    double *sumsq;          /* n_nodes (weighted) sums of squared norms */
+    int *index;             /* samples in tree order */
+} KdTree;
+
+int kdtree_build ( KdTree *t, const double *samples, const double *weights,
+        int dims, int n_samples );
+
+void kdtree_free ( KdTree *t );
+
+int cluster_kmeans_filter_tree ( const KdTree *tree, double *centroids,
+        double *samples, double *weights, int dims, int n_centroids,
+        int n_samples, int *labels, int n_threads, KMeansMonitor *monitor );
+
+#endif   /* ----- #ifndef KDTREE_INC  ----- */
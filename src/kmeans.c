@@ -17,8 +17,32 @@
  */
 
 #include	"kmeans.h"
+#include	"distance.h"
+#include	"parallel.h"
+#include	"slots.h"
+#include	"monitor.h"
+#include	"kdtree.h"
+#include	"shard.h"
+#include	"workspace.h"
+#include	"profile.h"
+#include	<pthread.h>
 #include	<stdio.h>
 
+/* k-means|| settings used by KMeans_cluster. Five rounds picking about two 
+ * candidates per centroid each is what Bahmani et al. found works */
+#define KMPAR_OVERSAMPLE 2.0
+#define KMPAR_ROUNDS     5
+
+/* samples drawn when KMeans_sweep scores with a sampled silhouette */
+#define SWEEP_DRAWS      1000
+
+/* A restart is given up on once it has had RESTART_GRACE iterations and its
+ * inertia is still RESTART_MARGIN worse than the best of the earlier runs 
+ * had after as many. The inertia only goes down from there, but rarely by 
+ * that much so late */
+#define RESTART_GRACE    5
+#define RESTART_MARGIN   0.05
+
 void
 KMeans_init( KMeans *km, int n_clusters, int n_features ) {
     if(km) {
@@ -27,41 +51,1054 @@ KMeans_init( KMeans *km, int n_clusters, int n_features ) {
         km->n_clusters = n_clusters;
         km->n_features = n_features;
         km->centroids = malloc(sizeof(double)*n_clusters*n_features);
+        km->n_threads = 1;
+        km->n_init = 1;
+        km->algorithm = KMEANS_LLOYD;
+        km->init = KMEANS_INIT_RANDOM;
+        km->monitor.callback = NULL;
+        km->monitor.data = NULL;
+        km->workspace = NULL;
+        km->max_iter = 0;
+        km->tol = 0;
+        km->time_limit = 0;
+        km->decay = 0;
+        km->counts = NULL;
+        km->fitted = 0;
+
+        /* every model starts from the same seed, so a program which never 
+         * calls KMeans_seed still gets the same clusters every time */
+        Rng_seed( &km->rng, 0 );
+        km->profile = NULL;
     }
 }
 
+/* Everything random a model does, seeding, restarts, mini-batches and 
+ * sampled silhouettes, is drawn from its own stream. The same seed gives 
+ * the same results, whatever the number of threads */
 void
-KMeans_cluster( KMeans *km, double *samples, int n_samples ) {
+KMeans_seed( KMeans *km, uint64_t seed ) {
+    if(km) {
+        Rng_seed( &km->rng, seed );
+    }
+}
+
+KMeans *
+KMeans_new( int n_clusters, int n_features ) {
+    KMeans *km = malloc( sizeof(KMeans) );
+
+    if(km) {
+        KMeans_init( km, n_clusters, n_features );
+        if( !km->centroids ) {
+            free(km);
+            return NULL;
+        }
+    }
+
+    return km;
+}
+
+/* The stream for one call. Each call takes a long jump of the model's 
+ * stream, so however many draws it makes, the next call starts from the 
+ * same place. Within the call, Rng_split hands out a substream per task */
+static void
+kmeans_stream( KMeans *km, Rng *rng ) {
+    *rng = km->rng;
+    Rng_long_jump( &km->rng );
+}
+
+/* pick the starting centroids the way the model asked for */
+static void
+kmeans_seed( KMeans *km, double *samples, double *weights, int n_samples, 
+        Rng *rng ) {
+
+    ProfileMark mark;
+    profile_begin( &mark );
+
+    switch( km->init ) {
+        case KMEANS_INIT_KMPP:
+            kmpp_init_centroids_parallel( km->centroids, samples, weights, 
+                    km->n_features, km->n_clusters, n_samples, km->n_threads, 
+                    rng );
+            break;
+        case KMEANS_INIT_KMPAR:
+            kmpar_init_centroids( km->centroids, samples, weights, 
+                    km->n_features, km->n_clusters, n_samples, 
+                    KMPAR_OVERSAMPLE, KMPAR_ROUNDS, km->n_threads, rng );
+            break;
+        default:
+            if( weights ) {
+                weighted_init_centroids( km->centroids, samples, weights, 
+                        km->n_features, km->n_clusters, n_samples, rng );
+            } else {
+                lloyd_init_centroids( km->centroids, samples, 
+                        km->n_features, km->n_clusters, n_samples, rng );
+            }
+            break;
+    }
+
+    profile_end( &mark, KMEANS_PHASE_SEED );
+}
+
+/* When training has to stop short of convergence. Worked out once per 
+ * call, so that restarts and sweeps share the one deadline */
+struct Limits {
+    int max_iter;           /* 0 for no limit */
+    double shift;           /* no centroid moved further, 0 for no limit */
+    double deadline;        /* by monitor_clock(), HUGE_VAL for none */
+};
+
+/* stands in for the model's monitor while training, passing everything on
+ * and stopping the engine at the first limit it reaches */
+struct Watch {
+    const struct Limits *limits;
+    KMeansMonitor *user;
+    KMeansStatus status;
+};
+
+/* the spread of the samples, the root of the mean variance of a feature.
+ * Scales the model's tol so that it doesn't depend on the units */
+static double
+kmeans_spread( const double *samples, const double *weights, int dims, 
+        int n_samples ) {
+    double total = 0, spread = 0;
+    int i, j;
+
+    for( j=0; j<dims; j++ ) {
+        double sum = 0, sq = 0;
+        total = 0;
+        for( i=0; i<n_samples; i++ ) {
+            double w = (weights)? weights[i] : 1.0;
+            sum += w * samples[(size_t) i * dims + j];
+            total += w;
+        }
+        if( !(total > 0) ) {
+            return 0;
+        }
+        double mean = sum / total;
+        for( i=0; i<n_samples; i++ ) {
+            double w = (weights)? weights[i] : 1.0;
+            double d = samples[(size_t) i * dims + j] - mean;
+            sq += w * d * d;
+        }
+        spread += sq / total;
+    }
+
+    return sqrt( spread / dims );
+}
+
+static void
+kmeans_limits( KMeans *km, double *samples, double *weights, int n_samples,
+        struct Limits *limits ) {
+
+    limits->max_iter = km->max_iter;
+    limits->shift = (km->tol > 0)? km->tol * kmeans_spread( samples, 
+            weights, km->n_features, n_samples ) : 0;
+    limits->deadline = (km->time_limit > 0)? 
+        monitor_clock() + km->time_limit : HUGE_VAL;
+}
+
+static int
+watch_iteration( const KMeansIterStats *stats, void *data ) {
+    struct Watch *w = data;
+    const struct Limits *l = w->limits;
+
+    /* an iteration which changed nothing is the last one anyway */
+    if( w->user->callback && w->user->callback( stats, w->user->data ) ) {
+        w->status = KMEANS_STOPPED;
+    } else if( stats->changed == 0 ) {
+        w->status = KMEANS_CONVERGED;
+    } else if( l->max_iter > 0 && stats->iteration >= l->max_iter ) {
+        w->status = KMEANS_MAX_ITER;
+    } else if( l->shift > 0 && stats->max_shift <= l->shift ) {
+        w->status = KMEANS_TOLERANCE;
+    } else if( monitor_clock() >= l->deadline ) {
+        w->status = KMEANS_DEADLINE;
+    }
+
+    return w->status != KMEANS_CONVERGED;
+}
+
+/* The monitor to hand an engine. The engines only gather their stats for 
+ * one, so it's the model's own unless there's a limit to check or a 
+ * callback to tell, and then a watch in front of it */
+static KMeansMonitor *
+kmeans_watch( KMeans *km, const struct Limits *limits, struct Watch *w, 
+        KMeansMonitor *watch ) {
+
+    w->limits = limits;
+    w->user = &km->monitor;
+    w->status = KMEANS_CONVERGED;
+    watch->callback = watch_iteration;
+    watch->data = w;
+
+    if( km->monitor.callback || limits->max_iter > 0 || limits->shift > 0 ||
+            limits->deadline < HUGE_VAL ) {
+        return watch;
+    }
+    return &km->monitor;
+}
+
+/* Hand the seeded centroids to whichever engine the model asked for. tree 
+ * is a kd-tree over the samples for the filtering engine to share, or 
+ * NULL */
+static KMeansStatus
+kmeans_train( KMeans *km, double *samples, double *weights, int n_samples,
+        int *labels, const KdTree *tree, const struct Limits *limits ) {
+
+    struct Watch w;
+    KMeansMonitor watch;
+    KMeansMonitor *monitor = kmeans_watch( km, limits, &w, &watch );
+    int err;
+
+    if( tree ) {
+        err = cluster_kmeans_filter_tree( tree, km->centroids, samples, 
+                weights, km->n_features, km->n_clusters, n_samples, labels, 
+                km->n_threads, monitor );
+        return (err)? KMEANS_NO_MEMORY : w.status;
+    }
+
+    switch( km->algorithm ) {
+        case KMEANS_HAMERLY:
+            err = cluster_kmeans_hamerly( km->centroids, samples, weights, 
+                    km->n_features, km->n_clusters, n_samples, labels, 
+                    km->n_threads, monitor );
+            break;
+        case KMEANS_ELKAN:
+            err = cluster_kmeans_elkan( km->centroids, samples, weights, 
+                    km->n_features, km->n_clusters, n_samples, labels, 
+                    km->n_threads, monitor );
+            break;
+        case KMEANS_FILTER:
+            err = cluster_kmeans_filter( km->centroids, samples, weights, 
+                    km->n_features, km->n_clusters, n_samples, labels, 
+                    km->n_threads, monitor );
+            break;
+        case KMEANS_GEMM:
+            err = cluster_kmeans_gemm( km->centroids, samples, weights, 
+                    km->n_features, km->n_clusters, n_samples, labels, 
+                    km->n_threads, monitor );
+            break;
+        default:
+            err = cluster_kmeans_parallel( km->centroids, samples, weights, 
+                    km->n_features, km->n_clusters, n_samples, labels, 
+                    km->n_threads, monitor );
+            break;
+    }
+
+    return (err)? KMEANS_NO_MEMORY : w.status;
+}
+
+/* (weighted) sum of squared distances from each sample to its centroid */
+static double
+kmeans_inertia( const double *centroids, const double *samples, 
+        const double *weights, const int *labels, int dims, int n_samples ) {
+    double inertia = 0;
+    int i, j;
+
+    for( i=0; i<n_samples; i++ ) {
+        const double *x = &samples[(size_t) i * dims];
+        const double *c = &centroids[labels[i] * dims];
+        double d = 0;
+        for( j=0; j<dims; j++ ) {
+            d += (x[j] - c[j]) * (x[j] - c[j]);
+        }
+        inertia += ((weights)? weights[i] : 1.0) * d;
+    }
+
+    return inertia;
+}
+
+/* how far a restart has got, as the later runs see it */
+enum RestartState {
+    RESTART_GOING,
+    RESTART_DONE,           /* its last inertia stands from here on */
+    RESTART_DROPPED         /* it only counts for the iterations it had */
+};
+
+/* one of the n_init restarts */
+struct RestartRun {
+    KMeans model;
+    struct Restarts *rs;
+    int index;
+    int abandoned;
+    KMeansStatus status;
+    enum RestartState state;
+    double *inertia;        /* after each of its iterations */
+    int n_iter;
+    int size;
+};
+
+/* state shared by the restarts of one KMeans_cluster */
+struct Restarts {
+    double *samples;
+    double *weights;
+    int n_samples;
+    const KdTree *tree;     /* shared by every run, NULL unless filtering */
+    struct RestartRun *runs;
+    int **scratch;          /* labels of the run on each thread */
+    int *labels;            /* labels of the best run so far */
+    double best;            /* and its inertia */
+    int winner;
+    int stop;               /* the caller's monitor asked us to stop */
+    KMeansMonitor *user;    /* the caller's monitor */
+    const struct Limits *limits;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;    /* a run reported or finished */
+};
+
+/* keep a run's inertia for the runs after it. Called with the lock held */
+static void
+restart_record( struct RestartRun *r, double inertia ) {
+
+    if( r->n_iter == r->size ) {
+        int size = (r->size)? r->size * 2 : 16;
+        double *grown = realloc( r->inertia, sizeof(double) * size );
+        if( !grown ) {
+            r->state = RESTART_DROPPED;
+            return;
+        }
+        r->inertia = grown;
+        r->size = size;
+    }
+    r->inertia[r->n_iter++] = inertia;
+}
+
+/* The lowest inertia the runs before r had after iteration iters, waiting 
+ * for any which haven't got that far. Tasks are handed out in order, so 
+ * every earlier run is already going on some thread or done, and none of 
+ * them waits on a later one. Comparing against those alone makes the 
+ * decision the same on any number of threads. Called with the lock held */
+static double
+restart_bar( struct RestartRun *r, int iters ) {
+    struct Restarts *rs = r->rs;
+    double bar = HUGE_VAL;
+    int j;
+
+    for( j=0; j<r->index; j++ ) {
+        struct RestartRun *e = &rs->runs[j];
+        while( e->state == RESTART_GOING && e->n_iter < iters ) {
+            pthread_cond_wait( &rs->progress, &rs->lock );
+        }
+
+        double v = HUGE_VAL;
+        if( e->n_iter >= iters ) {
+            v = e->inertia[iters-1];
+        } else if( e->state == RESTART_DONE && e->n_iter > 0 ) {
+            v = e->inertia[e->n_iter-1];
+        }
+        if( v < bar ) {
+            bar = v;
+        }
+    }
+
+    return bar;
+}
+
+/* a run is over, wake anyone waiting to compare against it */
+static void
+restart_finish( struct RestartRun *r, enum RestartState state ) {
+    struct Restarts *rs = r->rs;
+
+    pthread_mutex_lock( &rs->lock );
+    if( r->state == RESTART_GOING ) {
+        r->state = state;
+    }
+    pthread_cond_broadcast( &rs->progress );
+    pthread_mutex_unlock( &rs->lock );
+}
+
+/* every restart reports here. Passes the stats on to the caller's monitor,
+ * one run at a time, and stops runs that have fallen clearly behind the 
+ * runs before them */
+static int
+restart_iteration( const KMeansIterStats *stats, void *data ) {
+    struct RestartRun *r = data;
+    struct Restarts *rs = r->rs;
+    int stop;
+
+    pthread_mutex_lock( &rs->lock );
+    if( rs->user->callback && !rs->stop ) {
+        KMeansIterStats s = *stats;
+        s.run = r->index;
+        rs->stop = rs->user->callback( &s, rs->user->data );
+    }
+    restart_record( r, stats->inertia );
+    pthread_cond_broadcast( &rs->progress );
+    if( stats->iteration >= RESTART_GRACE && r->state == RESTART_GOING &&
+            stats->inertia > restart_bar( r, stats->iteration ) * 
+            (1 + RESTART_MARGIN) ) {
+        r->abandoned = 1;
+    }
+    stop = rs->stop || r->abandoned;
+    pthread_mutex_unlock( &rs->lock );
+
+    return stop;
+}
+
+/* train one restart. Called from inside the pool, so the run itself goes 
+ * single threaded */
+static void
+restart_task( void *ctx, int task, int thread ) {
+    struct Restarts *rs = ctx;
+    struct RestartRun *r = &rs->runs[task];
+    KMeans *km = &r->model;
+    int dims = km->n_features, n = rs->n_samples;
+    int *labels = rs->scratch[thread];
+
+    /* out of time before we even started. The first run always goes, so 
+     * there's something to hand back */
+    if( task > 0 && monitor_clock() >= rs->limits->deadline ) {
+        r->abandoned = 1;
+        restart_finish( r, RESTART_DROPPED );
+        return;
+    }
+
+    /* the runs overlap, so their phases would count each other. Whether or
+     * not this one is inline, it isn't profiled */
+    ProfileScope profiling;
+    profile_enter( NULL, &profiling );
+    r->status = kmeans_train( km, rs->samples, rs->weights, n, labels, 
+            rs->tree, rs->limits );
+    profile_leave( &profiling );
+
+    /* a run that couldn't get the memory to train has only its seeds, and 
+     * no labels, so it doesn't get a say */
+    if( r->status == KMEANS_NO_MEMORY ) {
+        restart_finish( r, RESTART_DROPPED );
+        return;
+    }
+    restart_finish( r, (r->abandoned)? RESTART_DROPPED : RESTART_DONE );
+
+    double inertia = kmeans_inertia( km->centroids, rs->samples, rs->weights,
+            labels, dims, n );
+
+    /* ties go to the earlier run, whichever finishes first */
+    pthread_mutex_lock( &rs->lock );
+    if( !r->abandoned && (rs->winner < 0 || 
+                inertia < rs->best || 
+                (inertia == rs->best && task < rs->winner)) ) {
+        rs->best = inertia;
+        rs->winner = task;
+        memcpy( rs->labels, labels, sizeof(int) * n );
+    }
+    pthread_mutex_unlock( &rs->lock );
+}
+
+/* Seed and train n_init times, one restart per core, and keep the lowest 
+ * inertia. Returns why the winner stopped, or KMEANS_NO_MEMORY */
+static KMeansStatus
+kmeans_restarts( KMeans *km, double *samples, double *weights, 
+        int n_samples, int *labels, const struct Limits *limits, 
+        Rng *stream ) {
+
+    struct Restarts rs;
+    KdTree tree;
+    KMeansStatus status = KMEANS_NO_MEMORY;
+    int i, n_runs = km->n_init, n_scratch = km->n_threads, ok = 1;
+
+    if( n_scratch > n_runs ) {
+        n_scratch = n_runs;
+    }
+    if( n_scratch > PARALLEL_MAX_THREADS ) {
+        n_scratch = PARALLEL_MAX_THREADS;
+    }
+    if( n_scratch < 1 ) {
+        n_scratch = 1;
+    }
+
+    rs.samples = samples;
+    rs.weights = weights;
+    rs.n_samples = n_samples;
+    rs.tree = NULL;
+    rs.labels = labels;
+    rs.best = HUGE_VAL;
+    rs.winner = -1;
+    rs.stop = 0;
+    rs.user = &km->monitor;
+    rs.limits = limits;
+    rs.runs = calloc( n_runs, sizeof(struct RestartRun) );
+    rs.scratch = calloc( n_scratch, sizeof(int *) );
+    if( !rs.runs || !rs.scratch ) {
+        free(rs.runs);
+        free(rs.scratch);
+        return KMEANS_NO_MEMORY;
+    }
+
+    /* the runs train side by side, so they can't share the caller's 
+     * workspace. Everything in here comes from the heap */
+    WorkspaceScope scope;
+    workspace_enter( NULL, &scope );
+    pthread_mutex_init( &rs.lock, NULL );
+    pthread_cond_init( &rs.progress, NULL );
+
+    for( i=0; i<n_scratch && ok; i++ ) {
+        rs.scratch[i] = malloc( sizeof(int) * n_samples );
+        ok = (rs.scratch[i] != NULL);
+    }
+
+    if( km->algorithm == KMEANS_FILTER && 
+            !kdtree_build( &tree, samples, weights, km->n_features, 
+                n_samples ) ) {
+        rs.tree = &tree;
+    }
+
+    /* Seed one run after another, on every core. Each run draws from its 
+     * own substream, so the seeds don't depend on the thread count and the 
+     * first run is seeded as it would be without restarts */
+    for( i=0; i<n_runs && ok; i++ ) {
+        struct RestartRun *r = &rs.runs[i];
+        Rng rng;
+        KMeans_init( &r->model, km->n_clusters, km->n_features );
+        if( !r->model.centroids ) {
+            ok = 0;
+            break;
+        }
+        r->model.n_threads = km->n_threads;
+        r->model.algorithm = km->algorithm;
+        r->model.init = km->init;
+        r->model.monitor.callback = restart_iteration;
+        r->model.monitor.data = r;
+        r->rs = &rs;
+        r->index = i;
+        Rng_split( stream, &rng );
+        kmeans_seed( &r->model, samples, weights, n_samples, &rng );
+        r->model.n_threads = 1;
+    }
+
+    if( ok ) {
+        parallel_for( km->n_threads, n_runs, restart_task, &rs );
+    }
+
+    /* nothing is abandoned before a run has finished, and the first always 
+     * runs, so there's a winner unless no run could get its memory */
+    if( rs.winner >= 0 ) {
+        memcpy( km->centroids, rs.runs[rs.winner].model.centroids, 
+                sizeof(double) * km->n_clusters * km->n_features );
+        status = rs.runs[rs.winner].status;
+    }
+
+    for( i=0; i<n_runs; i++ ) {
+        free(rs.runs[i].model.centroids);
+        free(rs.runs[i].inertia);
+    }
+    for( i=0; i<n_scratch; i++ ) {
+        free(rs.scratch[i]);
+    }
+    if( rs.tree ) {
+        kdtree_free( &tree );
+    }
+    pthread_mutex_destroy( &rs.lock );
+    pthread_cond_destroy( &rs.progress );
+    free(rs.runs);
+    free(rs.scratch);
+    workspace_leave( &scope );
+
+    return (ok)? status : KMEANS_NO_MEMORY;
+}
+
+/* The model has new centroids. Whatever KMeans_partial_fit had counted 
+ * was for the old ones, so it starts over, from these if training got 
+ * far enough to give any */
+static void
+kmeans_refit( KMeans *km, int fitted ) {
+    free(km->counts);
+    km->counts = NULL;
+    if( fitted ) {
+        km->fitted = 1;
+    }
+}
+
+/* seed and train, n_init times over if the model asks for restarts */
+static KMeansStatus
+kmeans_fit( KMeans *km, double *samples, double *weights, int n_samples, 
+        int *labels ) {
+
+    struct Limits limits;
+    Rng rng;
+    kmeans_limits( km, samples, weights, n_samples, &limits );
+    kmeans_stream( km, &rng );
+
+    if( km->n_init > 1 ) {
+        Rng stream = rng;
+        KMeansStatus status = kmeans_restarts( km, samples, weights, 
+                n_samples, labels, &limits, &stream );
+        if( status != KMEANS_NO_MEMORY ) {
+            kmeans_refit( km, 1 );
+            return status;
+        }
+    }
+
+    kmeans_seed( km, samples, weights, n_samples, &rng );
+    KMeansStatus status = kmeans_train( km, samples, weights, n_samples, 
+            labels, NULL, &limits );
+    kmeans_refit( km, status != KMEANS_NO_MEMORY );
+    return status;
+}
+
+/* Train the model, and like scikit-learn tell the caller where all their 
+ * samples were clustered while we're at it. labels can be NULL if they 
+ * don't care. Otherwise it gets the last assignment, which once training 
+ * has converged is what KMeans_predict would give */
+KMeansStatus
+KMeans_cluster( KMeans *km, double *samples, int n_samples, int *labels ) {
     
-    /* not happy about the malloc here, but hey. Maybe get the user to pass a 
-     * labels array? So we won't just train the classifier, we'll tell you 
-     * where all your sample data was clustered? scikit-learn does this, so I 
-     * don't think it would be too horrible a hack */
-    int *labels = malloc( sizeof(int) * n_samples );
+    KMeansStatus status = KMEANS_NO_MEMORY;
+    WorkspaceScope scope;
+    ProfileScope profiling;
+    workspace_enter( km->workspace, &scope );
+    profile_enter( km->profile, &profiling );
+
+    /* the engines need somewhere to keep the labels either way */
+    int *own = (labels)? NULL : workspace_alloc( sizeof(int) * n_samples );
  
-    cluster_lloyd( km->centroids, samples, km->n_features, km->n_clusters,
-            n_samples, labels);
+    if( labels || own ) {
+        status = kmeans_fit( km, samples, NULL, n_samples, 
+                (labels)? labels : own );
+    }
+
+    workspace_free(own);
+    profile_leave( &profiling );
+    workspace_leave( &scope );
+    return status;
+}
+
+KMeansStatus
+KMeans_cluster_weighted( KMeans *km, double *samples, double *weights, 
+        int n_samples, int *labels ) {
+
+    KMeansStatus status = KMEANS_NO_MEMORY;
+    WorkspaceScope scope;
+    ProfileScope profiling;
+    workspace_enter( km->workspace, &scope );
+    profile_enter( km->profile, &profiling );
+
+    /* each sample stands in for weights[i] identical ones, e.g. a distinct 
+     * colour and the number of pixels which have it */
+    int *own = (labels)? NULL : workspace_alloc( sizeof(int) * n_samples );
+
+    if( labels || own ) {
+        status = kmeans_fit( km, samples, weights, n_samples, 
+                (labels)? labels : own );
+    }
+
+    workspace_free(own);
+    profile_leave( &profiling );
+    workspace_leave( &scope );
+    return status;
+}
+
+KMeansStatus
+KMeans_cluster_warm( KMeans *km, double *samples, double *weights, 
+        int n_samples, int *labels ) {
+
+    KMeansStatus status = KMEANS_NO_MEMORY;
+    struct Limits limits;
+    WorkspaceScope scope;
+    ProfileScope profiling;
+    workspace_enter( km->workspace, &scope );
+    profile_enter( km->profile, &profiling );
+
+    /* no seeding, carry on from whatever centroids the model has. Frames 
+     * from the same camera barely move them, so this settles in an 
+     * iteration or two where starting over takes dozens */
+    int *own = (labels)? NULL : workspace_alloc( sizeof(int) * n_samples );
+
+    if( labels || own ) {
+        kmeans_limits( km, samples, weights, n_samples, &limits );
+        status = kmeans_train( km, samples, weights, n_samples, 
+                (labels)? labels : own, NULL, &limits );
+        kmeans_refit( km, status != KMEANS_NO_MEMORY );
+    }
+
+    workspace_free(own);
+    profile_leave( &profiling );
+    workspace_leave( &scope );
+    return status;
+}
+
+/* Lloyd's algorithm over n_shards worker processes, each of which loads 
+ * and keeps its own part of the samples, see shard.c. Seeded with random 
+ * samples, drawn the way kmeans_seed would draw them, so that from the 
+ * same seed it gives exactly what KMeans_cluster does with KMEANS_LLOYD 
+ * and KMEANS_INIT_RANDOM. That's the only engine and seeding it has */
+KMeansStatus
+KMeans_cluster_sharded( KMeans *km, int n_samples, int n_shards, 
+        KMeansShardLoader load, void *data, int *labels ) {
+
+    KMeansStatus status = KMEANS_FAILED;
+    struct Limits limits;
+    struct Watch w;
+    KMeansMonitor watch, *monitor;
+    Shards sh;
+    Rng rng;
+    int i, ok = 1;
+
+    limits.max_iter = km->max_iter;
+    limits.shift = 0;
+    limits.deadline = (km->time_limit > 0)? 
+        monitor_clock() + km->time_limit : HUGE_VAL;
 
-    /* free the hack! */
+    WorkspaceScope scope;
+    ProfileScope profiling;
+    workspace_enter( km->workspace, &scope );
+    profile_enter( km->profile, &profiling );
+
+    if( shards_start( &sh, km->n_features, km->n_clusters, n_samples, 
+                n_shards, load, data ) ) {
+        profile_leave( &profiling );
+        workspace_leave( &scope );
+        return KMEANS_FAILED;
+    }
+
+    ProfileMark mark;
+    profile_begin( &mark );
+    kmeans_stream( km, &rng );
+    for( i=0; ok && i<km->n_clusters; i++ ) {
+        ok = !shards_row( &sh, Rng_below( &rng, n_samples ), 
+                &km->centroids[i * km->n_features] );
+    }
+    profile_end( &mark, KMEANS_PHASE_SEED );
+
+    if( ok ) {
+        if( km->tol > 0 ) {
+            limits.shift = km->tol * shards_spread( &sh );
+        }
+        monitor = kmeans_watch( km, &limits, &w, &watch );
+        if( !cluster_kmeans_sharded( &sh, km->centroids, labels, monitor ) ) {
+            status = w.status;
+        }
+    }
+    kmeans_refit( km, status != KMEANS_FAILED );
+
+    shards_stop( &sh );
+    profile_leave( &profiling );
+    workspace_leave( &scope );
+    return status;
+}
+
+/* one k of a sweep */
+struct SweepRun {
+    KMeans model;
+    Rng rng;                /* for the sampled silhouette */
+    KMeansSweepResult result;
+};
+
+/* state shared by the runs of a sweep */
+struct Sweep {
+    double *samples;
+    double *weights;
+    int n_samples;
+    KMeansScore score;
+    const KdTree *tree;     /* shared by every run, NULL unless filtering */
+    struct Limits limits;   /* the model's, for every run */
+    struct SweepRun *runs;
+    int n_runs;
+};
+
+/* train and score one k. Called from inside the pool, so the run itself
+ * goes single threaded */
+static void
+sweep_task( void *ctx, int task, int thread ) {
+    struct Sweep *sw = ctx;
+
+    /* the biggest k take longest, hand them out first */
+    struct SweepRun *r = &sw->runs[sw->n_runs - 1 - task];
+    KMeans *km = &r->model;
+    int dims = km->n_features, k = km->n_clusters, n = sw->n_samples;
+    int *labels = malloc( sizeof(int) * n );
+    double t = monitor_clock();
+
+    r->result.n_clusters = k;
+    r->result.inertia = NAN;
+    r->result.silhouette = NAN;
+    r->result.ci = 0;
+    if( !labels ) {
+        return;
+    }
+
+    /* like the restarts, the runs overlap and aren't profiled */
+    ProfileScope profiling;
+    profile_enter( NULL, &profiling );
+
+    if( kmeans_train( km, sw->samples, sw->weights, n, labels, sw->tree, 
+                &sw->limits ) == KMEANS_NO_MEMORY ) {
+        profile_leave( &profiling );
+        free(labels);
+        return;
+    }
+
+    r->result.inertia = kmeans_inertia( km->centroids, sw->samples, 
+            sw->weights, labels, dims, n );
+
+    switch( sw->score ) {
+        case KMEANS_SCORE_EXACT:
+            r->result.silhouette = silhouette_exact( sw->samples, 
+                    sw->weights, labels, dims, k, n, 1 );
+            break;
+        case KMEANS_SCORE_SAMPLED:
+            r->result.silhouette = silhouette_sampled( sw->samples, 
+                    sw->weights, labels, dims, k, n, SWEEP_DRAWS, 1, 
+                    &r->rng, &r->result.ci );
+            break;
+        default:
+            r->result.silhouette = silhouette_margin( km->centroids, 
+                    sw->samples, sw->weights, n, dims, k, 1 );
+            break;
+    }
+
+    profile_leave( &profiling );
+    r->result.seconds = monitor_clock() - t;
     free(labels);
 }
 
+int
+KMeans_sweep( KMeans *km, double *samples, double *weights, int n_samples,
+        int k_min, int k_max, KMeansScore score, KMeansSweepResult *results ) {
+
+    struct Sweep sw;
+    KdTree tree;
+    int i, best = -1;
+
+    if( k_min < 1 ) {
+        k_min = 1;
+    }
+    if( k_max > n_samples ) {
+        k_max = n_samples;
+    }
+    if( k_max < k_min ) {
+        return -1;
+    }
+
+    sw.samples = samples;
+    sw.weights = weights;
+    sw.n_samples = n_samples;
+    sw.score = score;
+    kmeans_limits( km, samples, weights, n_samples, &sw.limits );
+    sw.n_runs = k_max - k_min + 1;
+    sw.runs = calloc( sw.n_runs, sizeof(struct SweepRun) );
+    sw.tree = NULL;
+    if( !sw.runs ) {
+        return -1;
+    }
+
+    /* one model per k and all training at once, so like the restarts this
+     * stays on the heap */
+    WorkspaceScope scope;
+    ProfileScope profiling;
+    workspace_enter( NULL, &scope );
+    profile_enter( km->profile, &profiling );
+
+    /* every run reads the same samples, so one tree does for all of them.
+     * Without it each run builds its own */
+    if( km->algorithm == KMEANS_FILTER && 
+            !kdtree_build( &tree, samples, weights, km->n_features, 
+                n_samples ) ) {
+        sw.tree = &tree;
+    }
+
+    /* Seed one k after another, on every core, which is quick next to the 
+     * training which then runs one k per core. Each k has a substream of 
+     * its own for the seeding and then the sampled silhouette */
+    Rng stream;
+    kmeans_stream( km, &stream );
+
+    int ok = 1;
+    for( i=0; i<sw.n_runs; i++ ) {
+        KMeans *m = &sw.runs[i].model;
+        KMeans_init( m, k_min + i, km->n_features );
+        if( !m->centroids ) {
+            ok = 0;
+            break;
+        }
+        m->n_threads = km->n_threads;
+        m->algorithm = km->algorithm;
+        m->init = km->init;
+        Rng_split( &stream, &sw.runs[i].rng );
+        kmeans_seed( m, samples, weights, n_samples, &sw.runs[i].rng );
+        m->n_threads = 1;
+    }
+
+    if( ok ) {
+        parallel_for( km->n_threads, sw.n_runs, sweep_task, &sw );
+
+        /* the best silhouette wins, the smaller k on a tie */
+        for( i=0; i<sw.n_runs; i++ ) {
+            double s = sw.runs[i].result.silhouette;
+            if( !isnan(s) && (best < 0 || 
+                        s > sw.runs[best].result.silhouette) ) {
+                best = i;
+            }
+            if( results ) {
+                results[i] = sw.runs[i].result;
+            }
+        }
+    }
+
+    /* hand the winner's centroids over to the caller's model */
+    if( best >= 0 ) {
+        free(km->centroids);
+        km->centroids = sw.runs[best].model.centroids;
+        km->n_clusters = sw.runs[best].model.n_clusters;
+        sw.runs[best].model.centroids = NULL;
+        kmeans_refit( km, 1 );
+    }
+
+    for( i=0; i<sw.n_runs; i++ ) {
+        free(sw.runs[i].model.centroids);
+    }
+    free(sw.runs);
+    if( sw.tree ) {
+        kdtree_free( &tree );
+    }
+    profile_leave( &profiling );
+    workspace_leave( &scope );
+
+    return (best >= 0)? k_min + best : -1;
+}
+
+int
+KMeans_elbow( const KMeansSweepResult *results, int n_results ) {
+
+    /* The elbow is where adding a cluster stops paying for itself, so take
+     * the k whose own drop in inertia most outweighs the next one's */
+    if( n_results < 3 ) {
+        return 0;
+    }
+
+    double floor = 1e-12 * results[0].inertia;
+    int i, best = 1;
+    double best_ratio = -HUGE_VAL;
+
+    for( i=1; i<n_results-1; i++ ) {
+        double before = results[i-1].inertia - results[i].inertia;
+        double after = results[i].inertia - results[i+1].inertia;
+        double ratio = before / ((after > floor)? after : floor);
+        if( ratio > best_ratio ) {
+            best_ratio = ratio;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+/* Mini-batch training (see cluster_minibatch), seeded the way the model 
+ * asks. Runs up to max_iter batches and stops early once no centroid moves
+ * further than tol in a batch; that tol is in the units of the samples. 
+ * The model's own max_iter, tol (relative to the spread, as for 
+ * KMeans_cluster), time_limit and monitor apply on top, counting batches 
+ * as iterations. Returns how many batches it ran */
+int
+KMeans_cluster_minibatch( KMeans *km, double *samples, int n_samples, 
+        int batch_size, int max_iter, double tol, int full_pass ) {
+
+    struct Limits limits;
+    struct Watch w;
+    KMeansMonitor watch;
+
+    /* the seeding and the batches all come from the model's stream, same 
+     * as the other training modes */
+    Rng rng;
+    kmeans_stream( km, &rng );
+
+    WorkspaceScope scope;
+    ProfileScope profiling;
+    workspace_enter( km->workspace, &scope );
+    profile_enter( km->profile, &profiling );
+
+    kmeans_limits( km, samples, NULL, n_samples, &limits );
+    kmeans_seed( km, samples, NULL, n_samples, &rng );
+
+    int iter = cluster_minibatch( km->centroids, samples, km->n_features, 
+            km->n_clusters, n_samples, batch_size, max_iter, tol, 
+            km->n_threads, &rng, kmeans_watch( km, &limits, &w, &watch ) );
+    kmeans_refit( km, 1 );
+
+    /* optionally finish with one full sweep: label every sample and move the
+     * centroids to the true means of their clusters */
+    if( full_pass ) {
+        int *labels = workspace_alloc( sizeof(int) * n_samples );
+        int *counts = workspace_alloc( sizeof(int) * km->n_clusters );
+
+        if( labels && counts ) {
+            memset( labels, 0, sizeof(int) * n_samples );
+            memset( counts, 0, sizeof(int) * km->n_clusters );
+            counts[0] = n_samples;
+
+            reassign_clusters( km->centroids, samples, km->n_features, 
+                    km->n_clusters, n_samples, labels, counts );
+            recompute_centroids( km->centroids, samples, km->n_features, 
+                    km->n_clusters, n_samples, labels, counts );
+        }
+
+        workspace_free(counts);
+        workspace_free(labels);
+    }
+
+    profile_leave( &profiling );
+    workspace_leave( &scope );
+    return iter;
+}
+
+/* Train on a stream a chunk at a time (see cluster_online). The model keeps
+ * the running centroids and counts between calls, so memory doesn't grow
+ * however long the stream runs. A model which was trained or loaded first 
+ * carries on from its centroids; training it again starts the counts over.
+ * Returns how many centroids have had a sample. Once that's n_clusters the
+ * model is fitted, and until then KMeans_predict and KMeans_classify 
+ * refuse it. -1 if the chunk is bad, or the counts couldn't be allocated 
+ * on the first call */
+int
+KMeans_partial_fit( KMeans *km, const double *samples, int n_samples ) {
+    int i;
+
+    if( !km || !km->centroids || n_samples < 0 || (n_samples && !samples) ||
+            !(km->decay >= 0 && km->decay < 1) ) {
+        return -1;
+    }
+
+    /* a trained model's centroids count as one sample each, so the stream
+     * moves them rather than replacing them */
+    if( !km->counts ) {
+        km->counts = calloc( km->n_clusters, sizeof(double) );
+        if( !km->counts ) {
+            return -1;
+        }
+        for( i=0; km->fitted && i<km->n_clusters; i++ ) {
+            km->counts[i] = 1;
+        }
+    }
+
+    int seeded = cluster_online( km->centroids, km->counts, samples,
+            km->n_features, km->n_clusters, n_samples, km->decay );
+    if( seeded == km->n_clusters ) {
+        km->fitted = 1;
+    }
+    return seeded;
+}
+
 int
 KMeans_classify( KMeans *km, double *sample ) {
     
+    /* until the model is fitted some of its centroids are whatever the 
+     * allocator left there, so there's no assignment to give */
+    if( !km->fitted ) {
+        return -1;
+    }
+
     /* return the assignment for this sample */
     return find_closest( km->centroids, sample, km->n_features, km->n_clusters, 
             NULL );
 }
 
+/* for models from KMeans_new or KMeans_load. One set up with KMeans_init 
+ * only needs its centroids freed, and its counts if it was streamed to */
 void
 KMeans_free( KMeans *km ) {
-    /* always guard against freeing memory that has not been allocated */
     if(km) {
-        if(km->centroids) {
-            free(km->centroids);
-        }
         free(km->centroids);
+        free(km->counts);
+        free(km);
     }
 }
 
@@ -91,24 +1128,22 @@ silhouette ( double *points, double *sample, double *distances,
 }		/* -----  end of function silhouette  ----- */
 
 
+/* Both of these are the margin score, see silhouette_margin */
 double
 average_silhouette ( double *points, double *samples, int n_samples, 
         int dims, int n_points )
 {
-    double *distances;
-    distances = malloc( sizeof(double) * n_points );
+    return silhouette_margin( points, samples, NULL, n_samples, dims, 
+            n_points, 1 );
+}		/* -----  end of function average_silhouette  ----- */
 
-    double tot = 0;
-    int i;
-    for(i=0; i<n_samples; i++) {
-        tot += silhouette( points, &samples[i*dims], distances, dims, 
-                    n_points );
-    }
-
-    free(distances);
-
-    return tot/n_samples;
-}		/* -----  end of function silhouette  ----- */
+double
+average_silhouette_weighted ( double *points, double *samples, 
+        double *weights, int n_samples, int dims, int n_points )
+{
+    return silhouette_margin( points, samples, weights, n_samples, dims, 
+            n_points, 1 );
+}		/* -----  end of function average_silhouette_weighted  ----- */
 
 double
 euclidean_distance ( double *a, double *b, int dims )
@@ -137,29 +1172,15 @@ find_closest ( double *points, double *sample, int dims, int n_points,
         return -1;
     }
 
-    /* We do a little configuration here. If the calling function did not pass 
-     * a dist_pointer value, then we'll use our dummy_dist value to store the 
-     * minimum distance. So we can either report on distance to the closest
-     * point or not depending on what the calling function wants */
-    double dummy_dist;
-    double *distance = (dist_pointer)? dist_pointer : &dummy_dist;
-
-    /* initialize with the assumption that the first point is the closest. */ 
-    int closest = 0;
-    *distance = euclidean_distance( points, sample, dims );
+    /* only the ordering matters while we search, so compare squared
+     * distances and take the root of the winner alone */
+    double sq;
+    int closest = distance_sq_nearest_rows( points, sample, dims, n_points, 
+            &sq );
+    profile_distances( n_points );
 
-    /* now check all other points */ 
-    int i;
-    for( i=1; i<n_points; i++ ) {
-
-        double d = euclidean_distance( &points[i*dims], sample, dims );
-        
-        /* if we find a point that is closer, update our minimum distance and 
-         * the id of the closest point */
-        if ( d < *distance ) {
-            *distance = d;
-            closest = i;
-        }
+    if( dist_pointer ) {
+        *dist_pointer = sqrt(sq);
     }
 
     return closest;
@@ -176,67 +1197,96 @@ compute_distances ( double *points, double *sample, double *distances,
     }
 
     /* get all the distances */
+    distance_sq_all_rows( points, sample, dims, n_points, distances );
+    profile_distances( n_points );
+
     int i;
     for( i=0; i<n_points; i++ ) {
-        distances[i] = euclidean_distance( &points[dims*i], sample, dims );
+        distances[i] = sqrt( distances[i] );
     }
 }		/* -----  end of function compute_distances  ----- */
 
 
 void
 lloyd_init_centroids ( double *centroids, double *samples, int dims, 
-        int n_centroids, int n_samples )
+        int n_centroids, int n_samples, Rng *rng )
 {
     /* error checking stuff */
     if( !centroids || !samples || dims < 1 || 
-            n_centroids < 1 || n_samples < 1 ) {
+            n_centroids < 1 || n_samples < 1 || !rng ) {
         return;
     }
 
+    ProfileMark mark;
+    profile_begin( &mark );
+
     int i;
     for( i=0; i<n_centroids; i++ ) {
-        int s = rand()%n_samples;
+        int s = Rng_below( rng, n_samples );
         memcpy( &centroids[i*dims], &samples[s*dims], sizeof(double) * dims ); 
     }
+
+    profile_end( &mark, KMEANS_PHASE_SEED );
 }		/* -----  end of function lloyd_init_centroids  ----- */
 
 
 void
-kmpp_init_centroids ( double *centroids, double *samples, int dims, 
-        int n_centroids, int n_samples )
+weighted_init_centroids ( double *centroids, double *samples, double *weights,
+        int dims, int n_centroids, int n_samples, Rng *rng )
 {
-    /* start by choosing a random initial point */
-    int s = rand()%n_samples;
-    memcpy ( centroids, &samples[s*dims], sizeof(double) * dims );
+    /* error checking stuff */
+    if( !centroids || !samples || !weights || dims < 1 || 
+            n_centroids < 1 || n_samples < 1 || !rng ) {
+        return;
+    }
 
+    /* like lloyd_init_centroids, but a sample with weight w is w times as 
+     * likely to be picked. Search a running total of the weights */
+    double *cumulative = workspace_alloc( sizeof(double) * n_samples );
+    if( !cumulative ) {
+        lloyd_init_centroids( centroids, samples, dims, n_centroids, 
+                n_samples, rng );
+        return;
+    }
+
+    ProfileMark mark;
+    profile_begin( &mark );
+
+    double tot = 0;
     int i;
-    for( i=1; i<n_centroids; i++ ) {
-        double dist = 0;
-        
-        /* compute cumulative square distance between each sample point and its
-         * closest centroid of those we've selected thus far */
-        int j;
-        for( j=0; j<n_samples; j++ ) {
-            double d = 0;
-            find_closest( centroids, &samples[j*dims], dims, i, &d );
-            dist += d*d;
-        }
+    for( i=0; i<n_samples; i++ ) {
+        tot += weights[i];
+        cumulative[i] = tot;
+    }
 
-        /* choose a new centroid from the set of sample points with a 
-         * probability that is proportaional to their square distance from
-         * the nearest cluster. We preferably want to choose points that
-         * are far away from any other cluster */
-        double p = rand()%(int)dist;
-        for( j=0; j<n_samples; j++ ) {
-            double d = 0;
-            find_closest( centroids, &samples[j*dims], dims, i, &d );
-            p -= (d*d);
-            if( p<= 0 ) {
-                break;
+    for( i=0; i<n_centroids; i++ ) {
+        double r = Rng_uniform( rng ) * tot;
+        int lo = 0, hi = n_samples - 1;
+        while( lo < hi ) {
+            int mid = (lo + hi) / 2;
+            if( cumulative[mid] > r ) {
+                hi = mid;
+            } else {
+                lo = mid + 1;
             }
         }
-        memcpy( &centroids[i*dims], &samples[j*dims], sizeof(double) * dims);
+        memcpy( &centroids[i*dims], &samples[lo*dims], sizeof(double) * dims ); 
     }
+
+    profile_end( &mark, KMEANS_PHASE_SEED );
+    workspace_free(cumulative);
+}		/* -----  end of function weighted_init_centroids  ----- */
+
+
+void
+kmpp_init_centroids ( double *centroids, double *samples, int dims, 
+        int n_centroids, int n_samples, Rng *rng )
+{
+    ProfileMark mark;
+    profile_begin( &mark );
+    kmpp_init_centroids_parallel( centroids, samples, NULL, dims, 
+            n_centroids, n_samples, 1, rng );
+    profile_end( &mark, KMEANS_PHASE_SEED );
 }		/* -----  end of function kmpp_init_centroids  ----- */
 
 
@@ -256,6 +1306,9 @@ void
 recompute_centroids ( double *centroids, double *samples, int dims,
         int n_centroids, int n_samples, int *labels, int *counts )
 {
+    ProfileMark mark;
+    profile_begin( &mark );
+
     memset( centroids, 0, sizeof(double)*dims*n_centroids );
 
     /* sum of all samples belonging to each cluster */
@@ -272,15 +1325,29 @@ recompute_centroids ( double *centroids, double *samples, int dims,
             centroids[i*dims + j] /= ((counts[i])? counts[i] : 1);
         }
     }
+
+    profile_end( &mark, KMEANS_PHASE_UPDATE );
 }		/* -----  end of function recompute_centroids  ----- */
 
 int
 reassign_clusters ( double *centroids, double *samples, int dims,
         int n_centroids, int n_samples, int *labels, int *counts )
 {
+    /* without the memory for a panel, the centroids are compared as they 
+     * are. Slower, but returning early would read as having converged */
+    DistancePanel panel;
+    int packed = !DistancePanel_init( &panel, dims, n_centroids );
+    if( packed ) {
+        DistancePanel_load( &panel, centroids );
+    }
+
+    ProfileMark mark;
+    profile_begin( &mark );
+
     int i, n_changed = 0;
     for( i=0; i<n_samples; i++ ) {
-        int l = find_closest( centroids, &samples[i*dims], dims,
+        int l = (packed)? distance_sq_nearest( &panel, &samples[i*dims], NULL ) :
+            distance_sq_nearest_rows( centroids, &samples[i*dims], dims, 
                     n_centroids, NULL );
             
         if( labels[i] != l ) {
@@ -291,46 +1358,170 @@ reassign_clusters ( double *centroids, double *samples, int dims,
             n_changed++;
         }
     }
+
+    profile_distances( (long long) n_samples * n_centroids );
+    profile_end( &mark, KMEANS_PHASE_ASSIGN );
+    if( packed ) {
+        DistancePanel_free( &panel );
+    }
     
     return n_changed;
 }		/* -----  end of function reassign_clusters  ----- */
 
-void
-cluster_kmeans ( double *centroids, double *samples, int dims, int n_centroids, 
-        int n_samples, int *labels  )
+/* state shared by the tasks of one parallel k-means iteration */
+struct KMeansPass {
+    DistancePanel panel;    /* the centroids, laid out for the kernels */
+    KMeansSlots slots;
+    double *samples;
+    double *weights;        /* NULL when every sample counts once */
+    int dims;
+    int *labels;
+    int monitored;          /* keep the inertia for a KMeansMonitor */
+};
+
+/* Assign every sample in the slot to its closest centroid and accumulate the
+ * slot's share of the new centroids in the same sweep */
+static void
+kmeans_pass_slot ( void *ctx, int slot, int thread )
 {
+    struct KMeansPass *p = ctx;
+    int i, start, end, n_changed = 0;
+
+    KMeansSlots_clear( &p->slots, slot );
+    KMeansSlots_range( &p->slots, slot, &start, &end );
+
+    for( i=start; i<end; i++ ) {
+        double *sample = &p->samples[(size_t) i * p->dims];
+        double weight = (p->weights)? p->weights[i] : 1.0;
+        double d;
+        int l = distance_sq_nearest( &p->panel, sample, 
+                (p->monitored)? &d : NULL );
+
+        if( p->labels[i] != l ) {
+            p->labels[i] = l;
+            n_changed++;
+        }
+
+        if( p->monitored ) {
+            p->slots.inertia[slot] += weight * d;
+        }
+
+        KMeansSlots_add( &p->slots, slot, l, sample, weight );
+    }
+
+    p->slots.changed[slot] = n_changed;
+    p->slots.evals[slot] = (long long) (end - start) * p->panel.n_points;
+}		/* -----  end of function kmeans_pass_slot  ----- */
+
+
+int
+cluster_kmeans_parallel ( double *centroids, double *samples, double *weights,
+        int dims, int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor )
+{
+    struct KMeansPass p;
+    KMeansIterStats stats;
+    int *counts = workspace_alloc( sizeof(int) * n_centroids );
+    double *old = NULL;
+
+    /* a monitor without a callback is the same as none. With one, we need
+     * the old centroids to say how far they moved */
+    if( monitor && !monitor->callback ) {
+        monitor = NULL;
+    }
+    if( monitor ) {
+        old = workspace_alloc( sizeof(double) * n_centroids * dims );
+    }
+
+    p.samples = samples;
+    p.weights = weights;
+    p.dims = dims;
+    p.labels = labels;
+    p.monitored = (monitor != NULL);
+
+    DistancePanel_init( &p.panel, dims, n_centroids );
+    KMeansSlots_init( &p.slots, dims, n_centroids, n_samples );
+    p.slots.weighted = (weights != NULL);
+
+    if( !counts || !p.panel.data || !p.slots.sums || (monitor && !old) ) {
+        DistancePanel_free(&p.panel);
+        KMeansSlots_free(&p.slots);
+        workspace_free(old);
+        workspace_free(counts);
+        return -1;
+    }
 
-    int *counts = malloc( sizeof(int)*n_centroids );
     memset( labels, 0, sizeof(int) * n_samples );
-    memset( counts, 0, sizeof(int) * n_centroids );
-    counts[0] = n_samples;
+    memset( &stats, 0, sizeof(stats) );
 
     int reassigned = n_samples;
     while( reassigned > 0 ) {
-        reassigned = reassign_clusters( centroids, samples, dims, n_centroids,
-               n_samples, labels, counts ) == 0; 
+        ProfileMark mark;
+        double t = 0;
+        if( monitor ) {
+            memcpy( old, centroids, sizeof(double) * n_centroids * dims );
+            t = monitor_clock();
+        }
+
+        profile_begin( &mark );
+        DistancePanel_load( &p.panel, centroids );
+        parallel_for( n_threads, p.slots.n_slots, kmeans_pass_slot, &p );
+        profile_slots( &p.slots );
+        profile_end( &mark, KMEANS_PHASE_ASSIGN );
+
+        if( monitor ) {
+            stats.assign_seconds = monitor_clock() - t;
+            t = monitor_clock();
+        }
 
-        recompute_centroids( centroids, samples, dims, n_centroids, n_samples,
-                labels, counts );
+        profile_begin( &mark );
+        reassigned = KMeansSlots_reduce( &p.slots, centroids, counts );
+        profile_end( &mark, KMEANS_PHASE_UPDATE );
+
+        if( monitor ) {
+            stats.update_seconds = monitor_clock() - t;
+            stats.iteration++;
+            stats.changed = reassigned;
+            stats.max_shift = monitor_max_shift( old, centroids, dims, 
+                    n_centroids );
+            if( monitor_report( monitor, &p.slots, &stats ) ) {
+                break;
+            }
+        }
     }
 
-    free(counts);
+    DistancePanel_free(&p.panel);
+    KMeansSlots_free(&p.slots);
+    workspace_free(old);
+    workspace_free(counts);
+    return 0;
+}		/* -----  end of function cluster_kmeans_parallel  ----- */
+
+
+void
+cluster_kmeans ( double *centroids, double *samples, int dims, int n_centroids, 
+        int n_samples, int *labels  )
+{
+    cluster_kmeans_parallel( centroids, samples, NULL, dims, n_centroids, 
+            n_samples, labels, 1, NULL );
 }		/* -----  end of function cluster_kmeans  ----- */
 
 
 void
 cluster_lloyd ( double *centroids, double *samples, int dims,
-        int n_centroids, int n_samples, int *labels  )
+        int n_centroids, int n_samples, int *labels, Rng *rng )
 {
-    lloyd_init_centroids( centroids, samples, dims, n_centroids, n_samples );
+    lloyd_init_centroids( centroids, samples, dims, n_centroids, n_samples, 
+            rng );
     cluster_kmeans( centroids, samples, dims, n_centroids, n_samples, labels );
 }		/* -----  end of function cluster_lloyd  ----- */
 
 
 void
 cluster_kmpp ( double *centroids, double *samples, int dims,
-        int n_centroids, int n_samples, int *labels  )
+        int n_centroids, int n_samples, int *labels, Rng *rng )
 {
-    kmpp_init_centroids( centroids, samples, dims, n_centroids, n_samples );
+    kmpp_init_centroids( centroids, samples, dims, n_centroids, n_samples, 
+            rng );
     cluster_kmeans( centroids, samples, dims, n_centroids, n_samples, labels );
 }		/* -----  end of function cluster_kmpp  ----- */
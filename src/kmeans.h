@@ -20,34 +20,255 @@
 #define  KMEANS_INC
 
 #include	<math.h>
+#include	<stdint.h>
+#include	<stdio.h>
 #include	<stdlib.h>
 #include	<string.h>
+#include	"rng.h"
+
+/* The engine KMeans_cluster trains with. They all find the same clusters, 
+ * Hamerly and Elkan just skip distances which the triangle inequality says 
+ * can't change a label. Elkan skips more but keeps n_samples x n_clusters 
+ * bounds, Hamerly keeps two per sample. Filter walks a kd-tree over the 
+ * samples and labels whole boxes of them at once, which is best when there 
+ * are only a handful of features. GEMM is Lloyd with the distances worked 
+ * out as a blocked matrix product, for hundreds of features and thousands 
+ * of clusters; it can pick differently between centroids which are within
+ * rounding of each other */
+typedef enum KMeansAlgorithm {
+    KMEANS_LLOYD,
+    KMEANS_HAMERLY,
+    KMEANS_ELKAN,
+    KMEANS_FILTER,
+    KMEANS_GEMM
+} KMeansAlgorithm;
+
+/* How KMeans_cluster picks its starting centroids. Random samples, 
+ * k-means++, or k-means|| which oversamples candidates in a few parallel 
+ * rounds and then boils them down with k-means++ */
+typedef enum KMeansInit {
+    KMEANS_INIT_RANDOM,
+    KMEANS_INIT_KMPP,
+    KMEANS_INIT_KMPAR
+} KMeansInit;
+
+/* How KMeans_silhouette scores a model. The margin score is how much 
+ * closer each sample is to its centroid than to the next one, which is 
+ * cheap but isn't the silhouette. Exact compares every sample with every 
+ * other, n^2 distances. Sampled scores a few random samples exactly and 
+ * gives a 95% confidence interval for the mean */
+typedef enum KMeansScore {
+    KMEANS_SCORE_MARGIN,
+    KMEANS_SCORE_SAMPLED,
+    KMEANS_SCORE_EXACT
+} KMeansScore;
+
+/* How one k of a KMeans_sweep went */
+typedef struct KMeansSweepResult {
+    int n_clusters;
+    double inertia;         /* (weighted) sum of squared distances */
+    double silhouette;      /* or whichever score the sweep was asked for */
+    double ci;              /* 95% interval of a sampled silhouette, else 0 */
+    double seconds;         /* training and scoring */
+} KMeansSweepResult;
+
+/* What one iteration of training did. Handed to a KMeansMonitor's callback
+ * at the end of every iteration */
+typedef struct KMeansIterStats {
+    int iteration;          /* counting from 1 */
+    int changed;            /* samples whose label changed */
+    double inertia;         /* (weighted) sum of squared distances from each
+                             * sample to the centroid it was assigned to */
+    double max_shift;       /* furthest any centroid moved in the update */
+    double assign_seconds;
+    double update_seconds;
+    long long distance_evals;   /* sample to centroid distances computed */
+    int run;                /* which of the n_init restarts, from 0 */
+} KMeansIterStats;
+
+/* Why KMeans_cluster stopped training. However the engines go about it,
+ * each iteration leaves the centroids at least as good as the last, so 
+ * whatever the model holds when it stops is the best it found. The limits 
+ * are checked at the end of an iteration, which means a call can overrun 
+ * its time_limit by an iteration, and by the seeding */
+typedef enum KMeansStatus {
+    KMEANS_CONVERGED,       /* an iteration changed no labels */
+    KMEANS_TOLERANCE,       /* no centroid moved more than tol allows */
+    KMEANS_MAX_ITER,
+    KMEANS_DEADLINE,        /* ran out of time_limit */
+    KMEANS_STOPPED,         /* the monitor's callback asked us to */
+    KMEANS_NO_MEMORY,
+    KMEANS_FAILED           /* a shard wouldn't load or its worker died */
+} KMeansStatus;
+
+/* Return non-zero to stop training after this iteration */
+typedef int (*KMeansCallback) ( const KMeansIterStats *stats, void *data );
+
+/* Leave callback NULL and the engines don't gather any of the above. With 
+ * n_init restarts the callback hears from all of them, one at a time */
+typedef struct KMeansMonitor {
+    KMeansCallback callback;
+    void *data;             /* passed back to the callback untouched */
+} KMeansMonitor;
+
+/* The parts of a call a KMeansProfile breaks its time down into */
+typedef enum KMeansPhase {
+    KMEANS_PHASE_SEED,
+    KMEANS_PHASE_ASSIGN,    /* labelling the samples */
+    KMEANS_PHASE_UPDATE,    /* moving the centroids */
+    KMEANS_PHASE_SILHOUETTE,
+    KMEANS_N_PHASES
+} KMeansPhase;
+
+/* What a phase cost, summed over every time it ran. The counters are for 
+ * every thread of the process, so a phase run on all cores counts all of 
+ * them, and they stay 0 unless the profile's counters is set */
+typedef struct KMeansPhaseCounts {
+    long long calls;
+    double seconds;
+    long long cycles;
+    long long instructions;
+    long long llc_misses;   /* last level cache */
+    long long branch_misses;
+} KMeansPhaseCounts;
+
+/* Opt-in profiling, see profile.c. Zero one and point a model's profile at
+ * it, and every call on the model adds to it. The hardware counters come 
+ * from perf_event_open, and where Linux won't allow that, only the times 
+ * are kept. n_init restarts and the k of a sweep train side by side in the
+ * thread pool, so only their seeding is profiled */
+typedef struct KMeansProfile {
+    int counters;           /* the hardware counters were read */
+    KMeansPhaseCounts phases[KMEANS_N_PHASES];
+    long long distance_evals;   /* by the assignment passes */
+} KMeansProfile;
+
+/* Where the workers of KMeans_cluster_sharded get their samples. Fill 
+ * samples with rows [start, end) of the whole set, n_features doubles 
+ * each, and return 0, or non-zero if they couldn't be read. Each worker 
+ * calls it in its own process, so no process holds more than its shard */
+typedef int (*KMeansShardLoader) ( double *samples, int start, int end, 
+        void *data );
+
+/* Scratch memory for training and prediction. Give a model one and the 
+ * temporary buffers come out of it rather than the heap. It grows to fit 
+ * the first call, so repeating a call doesn't allocate at all. n_init 
+ * restarts and KMeans_sweep train several models at once and still use 
+ * the heap for them */
+typedef struct KMeansWorkspace KMeansWorkspace;
 
 /* A K-means model. Can be trained and then used for classification */
 typedef struct KMeans {
     int n_clusters;
     int n_features;
     double *centroids;
+    int n_threads;          /* worker threads used while training */
+    int n_init;             /* restarts from different seeds, the lowest 
+                             * inertia is kept */
+    KMeansAlgorithm algorithm;
+    KMeansInit init;
+    KMeansMonitor monitor;  /* told about every training iteration */
+    KMeansWorkspace *workspace; /* scratch memory, NULL to use the heap */
+    int max_iter;           /* iterations a run may take, 0 for no limit */
+    double tol;             /* stop once no centroid moves further than tol 
+                             * times the spread of the samples (the root of 
+                             * their mean variance per feature), 0 for never */
+    double time_limit;      /* seconds a call may train for, 0 for no limit */
+    double decay;           /* how fast KMeans_partial_fit forgets old 
+                             * samples, in [0, 1). 0 keeps the plain mean */
+    double *counts;         /* samples each centroid has taken in from
+                             * KMeans_partial_fit, NULL until it's called */
+    int fitted;             /* the centroids were trained, loaded or all 
+                             * streamed a sample, so they can be predicted 
+                             * with and a stream carries on from them */
+    Rng rng;                /* where every random draw comes from, see 
+                             * KMeans_seed */
+    KMeansProfile *profile; /* where the time goes, NULL for no profiling */
 } KMeans;
 
 KMeans *KMeans_new ( int n_clusters, int n_features );
 
 void KMeans_init ( KMeans *kmeans, int n_clusters, int n_features );
 
-void KMeans_cluster ( KMeans *kmeans, double *samples, int n_samples );
+void KMeans_seed ( KMeans *kmeans, uint64_t seed );
+
+KMeansStatus KMeans_cluster ( KMeans *kmeans, double *samples, 
+        int n_samples, int *labels );
+
+KMeansStatus KMeans_cluster_weighted ( KMeans *kmeans, double *samples, 
+        double *weights, int n_samples, int *labels );
+
+KMeansStatus KMeans_cluster_warm ( KMeans *kmeans, double *samples, 
+        double *weights, int n_samples, int *labels );
+
+KMeansStatus KMeans_cluster_sharded ( KMeans *kmeans, int n_samples, 
+        int n_shards, KMeansShardLoader load, void *data, int *labels );
+
+int KMeans_sweep ( KMeans *kmeans, double *samples, double *weights, 
+        int n_samples, int k_min, int k_max, KMeansScore score, 
+        KMeansSweepResult *results );
+
+int KMeans_elbow ( const KMeansSweepResult *results, int n_results );
+
+int KMeans_cluster_minibatch ( KMeans *kmeans, double *samples, int n_samples,
+        int batch_size, int max_iter, double tol, int full_pass );
+
+int KMeans_partial_fit ( KMeans *kmeans, const double *samples, 
+        int n_samples );
 
 int KMeans_classify ( KMeans *kmeans, double *sample );
 
+int KMeans_predict ( KMeans *kmeans, const double *samples, int n_samples, 
+        int *labels, double *distances );
+
+/* Conveniences for callers holding float or byte samples. The sample is 
+ * widened and compared against the model's double centroids, so the label
+ * is exactly KMeans_classify's, but nothing is saved over converting it 
+ * yourself. For throughput, train with cluster_kmeans_f32/_u8 below */
+int KMeans_classify_f32 ( KMeans *kmeans, const float *sample );
+
+int KMeans_classify_u8 ( KMeans *kmeans, const uint8_t *sample );
+
+double KMeans_silhouette ( KMeans *kmeans, double *samples, double *weights,
+        int n_samples, KMeansScore mode, int n_draws, double *ci );
+
 void KMeans_free ( KMeans *kmeans );
 
+KMeansWorkspace *KMeans_workspace_new ( int n_samples, int n_features, 
+        int n_clusters );
+
+void KMeans_workspace_free ( KMeansWorkspace *workspace );
+
+int KMeans_write ( KMeans *kmeans, FILE *f );
+
+KMeans *KMeans_read ( FILE *f );
+
+int KMeans_save ( KMeans *kmeans, const char *filename );
+
+KMeans *KMeans_load ( const char *filename );
+
 double euclidean_distance ( double *a, double *b, int len );
 
+double average_silhouette_weighted ( double *points, double *samples, 
+        double *weights, int n_samples, int dims, int n_points );
+
 double silhouette ( double *points, double *sample, double *distances, 
         int dims, int n_points );
 
 double average_silhouette ( double *points, double *samples, int n_samples, 
         int dims, int n_points );
 
+double silhouette_margin ( double *points, double *samples, 
+        double *weights, int n_samples, int dims, int n_points, 
+        int n_threads );
+
+double silhouette_exact ( double *samples, double *weights, int *labels, 
+        int dims, int n_clusters, int n_samples, int n_threads );
+
+double silhouette_sampled ( double *samples, double *weights, int *labels, 
+        int dims, int n_clusters, int n_samples, int n_draws, int n_threads, 
+        Rng *rng, double *ci );
+
 int find_closest ( double *points, double *sample, int dims, int n_points, 
         double *dist_pointer );
 
@@ -55,10 +276,22 @@ void compute_distances ( double *points, double *sample, double *distances,
         int dims, int n_points );
 
 void lloyd_init_centroids ( double *centroids, double *samples, int dims, 
-        int n_centroids, int n_samples );
+        int n_centroids, int n_samples, Rng *rng );
+
+void weighted_init_centroids ( double *centroids, double *samples, 
+        double *weights, int dims, int n_centroids, int n_samples, 
+        Rng *rng );
 
 void kmpp_init_centroids ( double *centroids, double *samples, int dims, 
-        int n_centroids, int n_samples );
+        int n_centroids, int n_samples, Rng *rng );
+
+void kmpp_init_centroids_parallel ( double *centroids, double *samples, 
+        double *weights, int dims, int n_centroids, int n_samples, 
+        int n_threads, Rng *rng );
+
+void kmpar_init_centroids ( double *centroids, double *samples, 
+        double *weights, int dims, int n_centroids, int n_samples, 
+        double oversample, int rounds, int n_threads, Rng *rng );
 
 void count_cluster_members ( int *labels, int *counts, int n_centroids, 
         int n_samples );
@@ -72,10 +305,70 @@ int reassign_clusters ( double *centroids, double *samples, int dims,
 void cluster_kmeans ( double *centroids, double *samples, int dims,
         int n_centroids, int n_samples, int *labels );
 
+/* The engines return 0, or -1 if they couldn't get the memory to train, 
+ * in which case the centroids are left as they were */
+int cluster_kmeans_parallel ( double *centroids, double *samples, 
+        double *weights, int dims, int n_centroids, int n_samples, int *labels,
+        int n_threads, KMeansMonitor *monitor );
+
+int cluster_kmeans_hamerly ( double *centroids, double *samples, 
+        double *weights, int dims, int n_centroids, int n_samples, int *labels,
+        int n_threads, KMeansMonitor *monitor );
+
+int cluster_kmeans_elkan ( double *centroids, double *samples, 
+        double *weights, int dims, int n_centroids, int n_samples, int *labels,
+        int n_threads, KMeansMonitor *monitor );
+
+int cluster_kmeans_filter ( double *centroids, double *samples, 
+        double *weights, int dims, int n_centroids, int n_samples, int *labels,
+        int n_threads, KMeansMonitor *monitor );
+
+int cluster_kmeans_gemm ( double *centroids, double *samples, 
+        double *weights, int dims, int n_centroids, int n_samples, int *labels,
+        int n_threads, KMeansMonitor *monitor );
+
+int cluster_minibatch ( double *centroids, double *samples, int dims,
+        int n_centroids, int n_samples, int batch_size, int max_iter,
+        double tol, int n_threads, Rng *rng, KMeansMonitor *monitor );
+
+int cluster_online ( double *centroids, double *counts, 
+        const double *samples, int dims, int n_centroids, int n_samples, 
+        double decay );
+
 void cluster_lloyd ( double *centroids, double *samples, int dims,
-        int n_centroids, int n_samples, int *labels );
+        int n_centroids, int n_samples, int *labels, Rng *rng );
 
 void cluster_kmpp ( double *centroids, double *samples, int dims,
-        int n_centroids, int n_samples, int *labels );
+        int n_centroids, int n_samples, int *labels, Rng *rng );
+
+/* Compact storage. Samples are floats or bytes and the centroids floats, 
+ * which is a quarter (or an eighth) of the memory traffic of the double
+ * versions above. Centroids are still summed exactly. There's no model 
+ * behind the training loops, so they run until nothing changes unless 
+ * their monitor's callback stops them. find_closest_f32/_u8 answer a 
+ * single query with a plain loop over the rows; packing a panel for the 
+ * SIMD kernels would cost as much as the search, which is why only the 
+ * training loops, comparing every sample against the one panel, use them */
+int find_closest_f32 ( const float *points, const float *sample, int dims, 
+        int n_points, float *dist_pointer );
+
+int find_closest_u8 ( const float *points, const uint8_t *sample, int dims, 
+        int n_points, float *dist_pointer );
+
+void recompute_centroids_f32 ( float *centroids, const float *samples, 
+        int dims, int n_centroids, int n_samples, const int *labels, 
+        const int *counts );
+
+void recompute_centroids_u8 ( float *centroids, const uint8_t *samples, 
+        int dims, int n_centroids, int n_samples, const int *labels, 
+        const int *counts );
+
+int cluster_kmeans_f32 ( float *centroids, const float *samples, int dims,
+        int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor );
+
+int cluster_kmeans_u8 ( float *centroids, const uint8_t *samples, int dims,
+        int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor );
 
 #endif   /* ----- #ifndef KMEANS_INC  ----- */
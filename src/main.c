@@ -1,13 +1,27 @@
 #include "kmeans.h"
+#include "palette.h"
+#include "stream.h"
+#include "parallel.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 #include <math.h>
 #include <time.h>
+#include <dirent.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <SDL2/SDL_image.h>
 #include <SDL2/SDL.h>
 
 #define N_CLUSTERS 2
 #define N_FEATURES 3
+/* 64 cells a channel, a 512KB table */
+#define LUT_BITS 6
+
+/* samples drawn to estimate the silhouette in verbose mode */
+#define SILHOUETTE_DRAWS 1000
 
 const char* DISPLAY_NAMES[] = {
 	"Original",
@@ -19,10 +33,48 @@ typedef enum {
 	SHOW_THRESHOLD
 } DisplayMode;
 
+/* what Segmenter_threshold paints into the threshold surface. Either each
+ * pixel's centroid colour or its label as a grey level */
+typedef enum {
+	OUTPUT_QUANTIZED,
+	OUTPUT_LABELS
+} OutputMode;
+
 struct Segmenter {
     KMeans cluster;
 	SDL_Surface* image;
 	SDL_Surface* threshold;
+	OutputMode output;
+	int verbose;
+	int warm;	/* the centroids are already set, don't seed them */
+	int k_max;	/* try every k from cluster.n_clusters up to this */
+	Palette palette;	/* kept from image to image, like the workspace */
+};
+
+/* one image of a headless run */
+struct BatchJob {
+	char* input;
+	char* output;
+	int w, h;
+	double seconds;
+	int ok;
+};
+
+struct Batch {
+	struct BatchJob* jobs;
+	int n_jobs;
+	int cap_jobs;
+	const char* outdir;
+	OutputMode output;
+	int image_threads;
+	int sample_step;
+	int k_min, k_max;	/* clusters per image, best of a sweep */
+	const char* model;	/* saved model to warm start from, or NULL */
+	KMeans* warm;		/* the model every image starts from */
+	int first;			/* job the first task of a run handles */
+	int learning;		/* jobs are run one at a time until one gives the model */
+	struct Segmenter* segmenters[PARALLEL_MAX_THREADS];	/* one per thread of the pool */
+	uint64_t seed;		/* image i is clustered from seed + i */
 };
 
 struct Display {
@@ -55,25 +107,114 @@ void ImageProcessor_show( struct ImageProcessor* ip );
 void ImageProcessor_destroy( struct ImageProcessor* ip );
 
 struct Segmenter* Segmenter_create( void );
+int Segmenter_load( struct Segmenter* s, const char* filename );
 void Segmenter_threshold( struct Segmenter* s );
+int Segmenter_stream( struct Segmenter* s, const char* input, const char* output, int sample_step, int* w, int* h );
+void Segmenter_reset( struct Segmenter* s );
 void Segmenter_destroy( struct Segmenter* ed );
 
 struct Display* Display_create( void );
 void Display_destroy( struct Display *d );
 
+double now( void );
+int is_image( const char* filename );
+int is_ppm( const char* filename );
+void Batch_add( struct Batch* b, const char* input );
+void Batch_add_path( struct Batch* b, const char* path );
+struct Segmenter* Batch_segmenter( struct Batch* b, int thread );
+void Batch_run( struct Batch* b, int n_jobs );
+void Batch_destroy( struct Batch* b );
+
+#define USAGE "USAGE: kmeans <image>\n" \
+	"       kmeans -H [-l] [-j jobs] [-o outdir] [-s step] [-k k|min-max] [-m model] [-S seed] <image|directory>..."
+
 int main( int argc, char *argv[] ) {
-	
-	if( argc < 2 ) {
-		die(NULL, "USAGE: kmeans <image>");
+	int opt, headless = 0, n_jobs = parallel_num_cores();
+	struct Batch batch = { NULL, 0, 0, ".", OUTPUT_QUANTIZED, 1, 1, N_CLUSTERS, N_CLUSTERS, NULL, NULL, 0 };
+
+	while( (opt = getopt(argc, argv, "Hlj:o:s:k:m:S:")) != -1 ) {
+		switch(opt) {
+		case 'H':
+			headless = 1;
+			break;
+		case 'l':
+			batch.output = OUTPUT_LABELS;
+			break;
+		case 'j':
+			n_jobs = atoi(optarg);
+			break;
+		case 'o':
+			batch.outdir = optarg;
+			break;
+		case 's':
+			batch.sample_step = atoi(optarg);
+			break;
+		case 'k':
+			/* either a number of clusters, or a range to choose from */
+			if( sscanf(optarg, "%d-%d", &batch.k_min, &batch.k_max) == 1 ) {
+				batch.k_max = batch.k_min;
+			}
+			if( batch.k_min < 1 || batch.k_max < batch.k_min ) {
+				die(NULL, USAGE);
+			}
+			break;
+		case 'm':
+			batch.model = optarg;
+			break;
+		case 'S':
+			batch.seed = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			die(NULL, USAGE);
+		}
+	}
+
+	if( optind >= argc ) {
+		die(NULL, USAGE);
+	}
+
+	/* no window, no event loop. Segment everything we were given and
+	 * write the results to disk */
+	if( headless ) {
+		if( IMG_Init(IMG_INIT_TIF | IMG_INIT_PNG | IMG_INIT_JPG) < 0 ) {
+			die( NULL, IMG_GetError() );
+		}
+
+		if( mkdir(batch.outdir, 0755) && errno != EEXIST ) {
+			die( NULL, strerror(errno) );
+		}
+
+		/* a model that doesn't exist yet is trained on the first image */
+		if( batch.model ) {
+			batch.warm = KMeans_load( batch.model );
+			if( !batch.warm && errno != ENOENT ) {
+				die( NULL, strerror(errno) );
+			}
+			if( batch.warm && batch.warm->n_features != N_FEATURES ) {
+				die( NULL, "model does not have 3 features" );
+			}
+		}
+
+		for( ; optind<argc; optind++ ) {
+			Batch_add_path( &batch, argv[optind] );
+		}
+
+		Batch_run( &batch, (n_jobs > 0)? n_jobs : 1 );
+		int failed = 0, i;
+		for( i=0; i<batch.n_jobs; i++ ) {
+			failed += !batch.jobs[i].ok;
+		}
+		Batch_destroy( &batch );
+
+		IMG_Quit();
+		return (failed)? EXIT_FAILURE : EXIT_SUCCESS;
 	}
 
 	initialize_sdl();
 
-	char* filename = argv[1];
+	char* filename = argv[optind];
 	struct ImageProcessor* ip = ImageProcessor_create( );
     
-    srand(time(NULL));
-	
     ImageProcessor_load(ip, filename);
 	ImageProcessor_detect(ip);
 	ImageProcessor_update_title ( ip );
@@ -206,24 +347,12 @@ void ImageProcessor_update_title ( struct ImageProcessor* ip ) {
 }
 
 void ImageProcessor_load( struct ImageProcessor* ip, char* filename ) {
-	ip->segmenter->image = IMG_Load(filename);
-	if(!ip->segmenter->image) {
-		die(ip, IMG_GetError());
+	if( Segmenter_load(ip->segmenter, filename) ) {
+		die(ip, SDL_GetError());
 	}
+	ip->segmenter->verbose = 1;
 	
 	SDL_Surface* image = ip->segmenter->image;
-	ip->segmenter->threshold = SDL_CreateRGBSurface( 0,
-												 image->w,
-												 image->h,
-												 32,
-												 image->format->Rmask,
-												 image->format->Gmask,
-												 image->format->Bmask,
-												 image->format->Amask	); 
-	if(!ip->segmenter->threshold) {
-		die(ip, SDL_GetError());
-	}
-
 	if( SDL_CreateWindowAndRenderer(image->w, image->h, 0,
 						&ip->display->window, &ip->display->renderer) < 0 ) {
 		die(ip, SDL_GetError());
@@ -278,20 +407,53 @@ struct Segmenter* Segmenter_create( void ) {
 	if(s) {
 		s->threshold = NULL;
 		s->image = NULL;
+		s->output = OUTPUT_QUANTIZED;
+		s->verbose = 0;
+		s->warm = 0;
+		s->k_max = 0;
 		KMeans_init(&s->cluster, N_CLUSTERS, N_FEATURES);
+		s->cluster.n_threads = parallel_num_cores();
+
+		/* a batch segments image after image on each thread, so after 
+		 * the first the training needn't allocate anything. If either 
+		 * of these fails we just do without */
+		s->cluster.workspace = KMeans_workspace_new(0, N_FEATURES, N_CLUSTERS);
+		Palette_init(&s->palette);
 	}
 
 	return s;
 }
 
+int Segmenter_load( struct Segmenter* s, const char* filename ) {
+	s->image = IMG_Load(filename);
+	if(!s->image) {
+		return -1;
+	}
+	
+	SDL_Surface* image = s->image;
+	s->threshold = SDL_CreateRGBSurface( 0,
+										image->w,
+										image->h,
+										32,
+										image->format->Rmask,
+										image->format->Gmask,
+										image->format->Bmask,
+										image->format->Amask	); 
+	if(!s->threshold) {
+		return -1;
+	}
+
+	return 0;
+}
+
 void Segmenter_threshold( struct Segmenter* s ) {
     int i, x, y;
 	Uint32 pixel, r,g,b,a;
-	double* features;
-
-	features = malloc( sizeof(double) * s->image->w * s->image->h * N_FEATURES );
+	Palette* palette = &s->palette;
 
-	if(!features) {
+	/* most photos have far fewer distinct colours than pixels, so we
+	 * cluster each colour once, weighted by how many pixels have it */
+	if( !palette->hist && Palette_init(palette) ) {
 		printf("Unable to allocate memory for computing features!\n");
 		return;
 	}
@@ -299,53 +461,114 @@ void Segmenter_threshold( struct Segmenter* s ) {
 	/* clear the edge image */
 	SDL_FillRect(s->threshold, NULL, 0x000000);
 
-	/* compute the gradient for each point on the image */
+	/* count the colours in the image */
 	for( i=0; i<s->image->h*s->image->w; i++ ) {
         pixel = get_pixel(s->image, i%s->image->w, i/s->image->w);
         explode( s->image->format, pixel, &r, &g, &b, &a);
-        features[i*N_FEATURES] = (float)r;
-        features[i*N_FEATURES+1] = (float)g;
-        features[i*N_FEATURES+2] = (float)b;
+        Palette_add( palette, r, g, b );
 	}
 
-    KMeans_cluster( &s->cluster, features, s->image->w*s->image->h );
+	/* a failed build leaves hist dirty, so start the next one afresh */
+	if( Palette_build(palette) < 0 ) {
+		printf("Unable to allocate memory for computing features!\n");
+		Palette_free(palette);
+		return;
+	}
 
-    for( i=0; i<s->cluster.n_clusters; i++ ) {
-        printf("%d ", to_greyscale(s->image->format, 
-                    s->cluster.centroids[i*s->cluster.n_features],
-                    s->cluster.centroids[i*s->cluster.n_features + 1],
-                    s->cluster.centroids[i*s->cluster.n_features + 2],
-                    0
-                )
-            );
+	/* training labels every colour on the way, so keep those labels and
+	 * the pixels can be looked up rather than classified */
+	int* labels = palette->labels;
+
+    if( s->warm ) {
+        KMeans_cluster_warm( &s->cluster, palette->colors, palette->weights, 
+                palette->n_colors, labels );
+    } else if( s->k_max > s->cluster.n_clusters ) {
+        /* the sweep doesn't keep the labels of every k it tries */
+        KMeans_sweep( &s->cluster, palette->colors, palette->weights, 
+                palette->n_colors, s->cluster.n_clusters, s->k_max, 
+                KMEANS_SCORE_SAMPLED, NULL );
+        KMeans_predict( &s->cluster, palette->colors, palette->n_colors, 
+                labels, NULL );
+    } else {
+        KMeans_cluster_weighted( &s->cluster, palette->colors, 
+                palette->weights, palette->n_colors, labels );
     }
 
-    printf("%f\n", average_silhouette( s->cluster.centroids, features, 
-                s->image->w*s->image->h, s->cluster.n_features, 
-                s->cluster.n_clusters ) );
+	/* a model that never got the memory to train has no labels to give */
+	if( !s->cluster.fitted ) {
+		printf("Unable to allocate memory for clustering!\n");
+		Palette_clear(palette);
+		return;
+	}
+
+    if( s->verbose ) {
+        for( i=0; i<s->cluster.n_clusters; i++ ) {
+            printf("%d ", to_greyscale(s->image->format, 
+                        s->cluster.centroids[i*s->cluster.n_features],
+                        s->cluster.centroids[i*s->cluster.n_features + 1],
+                        s->cluster.centroids[i*s->cluster.n_features + 2],
+                        0
+                    )
+                );
+        }
+
+        double ci, score = KMeans_silhouette( &s->cluster, palette->colors, 
+                palette->weights, palette->n_colors, KMEANS_SCORE_SAMPLED, 
+                SILHOUETTE_DRAWS, &ci );
+        printf("%f +- %f\n", score, ci);
+    }
+
+	Palette_label( palette, labels );
 
 	/* compute the gradient for each point on the image */
 	for( y=0; y<s->image->h; y++ ) {
 		for( x=0; x<s->image->w; x++ ) {
-            
             pixel = get_pixel(s->image, x, y);
             explode( s->image->format, pixel, &r, &g, &b, &a);
 
-            features[0] = (float)r;
-            features[1] = (float)g;
-            features[2] = (float)b;
- 
-            int label = KMeans_classify( &s->cluster, features );
+            int label = Palette_lookup( palette, r, g, b );
 
-            r = s->cluster.centroids[label*N_FEATURES];
-            g = s->cluster.centroids[label*N_FEATURES+1];
-            b = s->cluster.centroids[label*N_FEATURES+2];
+            if( s->output == OUTPUT_LABELS ) {
+                r = g = b = label * 255 / 
+                    ((s->cluster.n_clusters > 1)? s->cluster.n_clusters-1 : 1);
+            } else {
+                r = s->cluster.centroids[label*N_FEATURES];
+                g = s->cluster.centroids[label*N_FEATURES+1];
+                b = s->cluster.centroids[label*N_FEATURES+2];
+            }
             pixel = compress( s->threshold->format, r, g, b, 255 );
             set_pixel( s->threshold, x, y, pixel );
 		}
 	}
 
-    free(features);
+    Palette_clear(palette);
+}
+
+/* Segment a PPM without loading it. The image is mapped rather than read,
+ * and only a tile of rows of the output is held at a time */
+int Segmenter_stream( struct Segmenter* s, const char* input, const char* output, int sample_step, int* w, int* h ) {
+	StreamOptions opts;
+
+	opts.tile_rows = STREAM_TILE_ROWS;
+	opts.sample_step = sample_step;
+	opts.labels = (s->output == OUTPUT_LABELS);
+	opts.lut_bits = LUT_BITS;
+	opts.warm = s->warm;
+	opts.k_max = s->k_max;
+
+	return stream_segment( &s->cluster, input, output, &opts, w, h );
+}
+
+/* ready a segmenter for another image. The model, its workspace and the 
+ * palette stay */
+void Segmenter_reset( struct Segmenter* s ) {
+	SDL_FreeSurface(s->image);
+	SDL_FreeSurface(s->threshold);
+	s->image = NULL;
+	s->threshold = NULL;
+	s->output = OUTPUT_QUANTIZED;
+	s->warm = 0;
+	s->k_max = 0;
 }
 
 void Segmenter_destroy( struct Segmenter* s ) {
@@ -354,6 +577,9 @@ void Segmenter_destroy( struct Segmenter* s ) {
 		 * that for us */
 		SDL_FreeSurface(s->image);
 		SDL_FreeSurface(s->threshold);
+		free(s->cluster.centroids);
+		KMeans_workspace_free(s->cluster.workspace);
+		Palette_free(&s->palette);
 		free(s);
 	}
 }
@@ -382,3 +608,277 @@ void Display_destroy( struct Display *d ) {
 		free(d);
 	}
 }
+
+double now( void ) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+int is_image( const char* filename ) {
+	const char* ext[] = { ".png", ".jpg", ".jpeg", ".tif", ".tiff", ".bmp", 
+		".ppm", ".pnm" };
+	const char* dot = strrchr(filename, '.');
+	int i;
+
+	for( i=0; dot && i<sizeof(ext)/sizeof(ext[0]); i++ ) {
+		if( !strcasecmp(dot, ext[i]) ) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/* these are streamed rather than loaded, see Segmenter_stream */
+int is_ppm( const char* filename ) {
+	const char* dot = strrchr(filename, '.');
+	return dot && (!strcasecmp(dot, ".ppm") || !strcasecmp(dot, ".pnm"));
+}
+
+void Batch_add( struct Batch* b, const char* input ) {
+	if( b->n_jobs == b->cap_jobs ) {
+		b->cap_jobs = (b->cap_jobs)? b->cap_jobs * 2 : 16;
+		b->jobs = realloc(b->jobs, sizeof(struct BatchJob) * b->cap_jobs);
+		if(!b->jobs) {
+			die(NULL, "Memory error");
+		}
+	}
+
+	/* results go in outdir, named after the input with the extension
+	 * swapped for _kmeans.png, or _kmeans.ppm for streamed images */
+	const char* base = strrchr(input, '/');
+	base = (base)? base+1 : input;
+	const char* dot = strrchr(base, '.');
+	int len = (dot)? (int)(dot - base) : (int) strlen(base);
+
+	struct BatchJob* job = &b->jobs[b->n_jobs++];
+	job->input = strdup(input);
+	job->output = malloc(strlen(b->outdir) + len + 16);
+	if( !job->input || !job->output ) {
+		die(NULL, "Memory error");
+	}
+	sprintf(job->output, "%s/%.*s_kmeans.%s", b->outdir, len, base,
+			(is_ppm(input))? "ppm" : "png");
+	job->w = job->h = 0;
+	job->seconds = 0;
+	job->ok = 0;
+}
+
+static int compare_names( const void* a, const void* b ) {
+	return strcmp(*(char* const*) a, *(char* const*) b);
+}
+
+void Batch_add_path( struct Batch* b, const char* path ) {
+	struct stat st;
+	if( stat(path, &st) ) {
+		printf("ERROR: %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	if( !S_ISDIR(st.st_mode) ) {
+		Batch_add(b, path);
+		return;
+	}
+
+	/* take every image in the directory, in name order so that runs are
+	 * easy to compare */
+	DIR* dir = opendir(path);
+	if(!dir) {
+		printf("ERROR: %s: %s\n", path, strerror(errno));
+		return;
+	}
+
+	char** names = NULL;
+	int n = 0, cap = 0, i;
+	struct dirent* e;
+	while( (e = readdir(dir)) ) {
+		if( !is_image(e->d_name) ) {
+			continue;
+		}
+		if( n == cap ) {
+			cap = (cap)? cap * 2 : 16;
+			names = realloc(names, sizeof(char*) * cap);
+			if(!names) {
+				die(NULL, "Memory error");
+			}
+		}
+		names[n] = malloc(strlen(path) + strlen(e->d_name) + 2);
+		if(!names[n]) {
+			die(NULL, "Memory error");
+		}
+		sprintf(names[n++], "%s/%s", path, e->d_name);
+	}
+	closedir(dir);
+
+	qsort(names, n, sizeof(char*), compare_names);
+	for( i=0; i<n; i++ ) {
+		Batch_add(b, names[i]);
+		free(names[i]);
+	}
+	free(names);
+}
+
+/* the segmenter for a thread of the pool. Only the first image the thread 
+ * does allocates its memory, the rest reuse it */
+struct Segmenter* Batch_segmenter( struct Batch* b, int thread ) {
+	struct Segmenter* s = b->segmenters[thread];
+
+	if(s) {
+		Segmenter_reset(s);
+	} else {
+		s = b->segmenters[thread] = Segmenter_create();
+	}
+
+	return s;
+}
+
+static void Batch_task( void* ctx, int task, int thread ) {
+	struct Batch* b = ctx;
+	struct BatchJob* job = &b->jobs[b->first + task];
+	struct Segmenter* s = Batch_segmenter(b, thread);
+	double start = now();
+
+	if(!s) {
+		printf("ERROR: %s: Memory error\n", job->input);
+		return;
+	}
+
+	s->output = b->output;
+
+	if( b->warm ) {
+		KMeans* m = b->warm;
+		KMeansWorkspace* ws = s->cluster.workspace;
+		free(s->cluster.centroids);
+		KMeans_init(&s->cluster, m->n_clusters, m->n_features);
+		s->cluster.workspace = ws;
+		if( !s->cluster.centroids ) {
+			printf("ERROR: %s: Memory error\n", job->input);
+			return;
+		}
+		memcpy(s->cluster.centroids, m->centroids,
+				sizeof(double) * m->n_clusters * m->n_features);
+		s->cluster.algorithm = m->algorithm;
+		s->cluster.init = m->init;
+		s->warm = 1;
+	} else if( !s->cluster.centroids || b->k_min != s->cluster.n_clusters || b->k_max > b->k_min ) {
+		KMeansWorkspace* ws = s->cluster.workspace;
+		free(s->cluster.centroids);
+		KMeans_init(&s->cluster, b->k_min, N_FEATURES);
+		s->cluster.workspace = ws;
+		if( !s->cluster.centroids ) {
+			printf("ERROR: %s: Memory error\n", job->input);
+			return;
+		}
+		s->k_max = b->k_max;
+	}
+	s->cluster.n_threads = b->image_threads;
+
+	/* seeded by the image, not the thread that happens to get it, so a
+	 * batch comes out the same however many jobs it's split over */
+	KMeans_seed(&s->cluster, b->seed + b->first + task);
+
+	if( is_ppm(job->input) ) {
+		/* never loaded, so there's no surface to save */
+		if( Segmenter_stream(s, job->input, job->output, b->sample_step, &job->w, &job->h) ) {
+			printf("ERROR: %s: %s\n", job->input, strerror(errno));
+			return;
+		}
+		job->ok = 1;
+	} else {
+		if( Segmenter_load(s, job->input) ) {
+			printf("ERROR: %s: %s\n", job->input, SDL_GetError());
+			return;
+		}
+
+		Segmenter_threshold(s);
+
+		if( IMG_SavePNG(s->threshold, job->output) ) {
+			printf("ERROR: %s: %s\n", job->output, IMG_GetError());
+		} else {
+			job->ok = 1;
+		}
+
+		job->w = s->image->w;
+		job->h = s->image->h;
+	}
+
+	/* the first image of a run without a model becomes the model. Only
+	 * done while the jobs run one at a time, and the model is complete
+	 * before the others get to see it */
+	if( job->ok && b->learning ) {
+		KMeans* m = KMeans_new(s->cluster.n_clusters, s->cluster.n_features);
+		if( m ) {
+			memcpy(m->centroids, s->cluster.centroids,
+					sizeof(double) * s->cluster.n_clusters * s->cluster.n_features);
+			m->algorithm = s->cluster.algorithm;
+			m->init = s->cluster.init;
+			if( KMeans_save(m, b->model) ) {
+				printf("ERROR: %s: %s\n", b->model, strerror(errno));
+			}
+		}
+		b->warm = m;
+		b->learning = 0;
+	}
+
+	job->seconds = now() - start;
+
+	printf("%s -> %s %dx%d %.3fs %.2f MP/s\n", job->input, job->output,
+			job->w, job->h, job->seconds,
+			job->w * (double) job->h / 1e6 / job->seconds);
+}
+
+void Batch_run( struct Batch* b, int n_jobs ) {
+	double start = now(), pixels = 0;
+	int i, done = 0;
+
+	/* the images are shared out over the thread pool, and clustering
+	 * started from inside the pool runs inline. Only a lone image gets
+	 * to spread its clustering over every core */
+	b->image_threads = (n_jobs > 1 && b->n_jobs > 1)? 1 : parallel_num_cores();
+
+	/* with no model to start from, the first image has to be done before
+	 * any of the others can begin. Give it every core, and if it fails
+	 * try the next one until one gives us the model */
+	b->first = 0;
+	if( b->model && !b->warm ) {
+		int threads = b->image_threads;
+		b->image_threads = parallel_num_cores();
+		b->learning = 1;
+		while( b->learning && b->first < b->n_jobs ) {
+			Batch_task( b, 0, 0 );
+			b->first++;
+		}
+		b->learning = 0;
+		b->image_threads = threads;
+	}
+
+	parallel_for( n_jobs, b->n_jobs - b->first, Batch_task, b );
+
+	double seconds = now() - start;
+	for( i=0; i<b->n_jobs; i++ ) {
+		if( b->jobs[i].ok ) {
+			pixels += b->jobs[i].w * (double) b->jobs[i].h;
+			done++;
+		}
+	}
+
+	printf("%d/%d images, %.3fs, %.2f images/s, %.2f MP/s\n", done,
+			b->n_jobs, seconds, done / seconds, pixels / 1e6 / seconds);
+}
+
+void Batch_destroy( struct Batch* b ) {
+	int i;
+	for( i=0; i<b->n_jobs; i++ ) {
+		free(b->jobs[i].input);
+		free(b->jobs[i].output);
+	}
+	free(b->jobs);
+	b->jobs = NULL;
+	b->n_jobs = 0;
+	KMeans_free(b->warm);
+	b->warm = NULL;
+	for( i=0; i<PARALLEL_MAX_THREADS; i++ ) {
+		Segmenter_destroy(b->segmenters[i]);
+		b->segmenters[i] = NULL;
+	}
+}
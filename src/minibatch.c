@@ -0,0 +1,182 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  minibatch.c
+ *
+ *    Description:  Mini-batch k-means (Sculley, 2010). Each iteration only
+ *                  looks at a small random batch of the samples and nudges
+ *                  the centroids towards it with a per-centroid learning
+ *                  rate, so very large inputs never need a full sweep.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 15:40:12
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	"distance.h"
+#include	"monitor.h"
+#include	"parallel.h"
+#include	"workspace.h"
+#include	"profile.h"
+
+/* batch samples handed to each task while labelling a batch */
+#define MINIBATCH_TASK_SAMPLES 256
+
+struct BatchPass {
+    DistancePanel panel;
+    double *samples;
+    int dims;
+    int batch_size;
+    int *batch;             /* indices of the samples in this batch */
+    int *labels;            /* closest centroid of each batch sample */
+    double *dist;           /* and how far, only when monitored */
+};
+
+static void
+minibatch_label_task ( void *ctx, int task, int thread )
+{
+    struct BatchPass *p = ctx;
+    int start = task * MINIBATCH_TASK_SAMPLES;
+    int end = start + MINIBATCH_TASK_SAMPLES;
+    int i;
+
+    if( end > p->batch_size ) {
+        end = p->batch_size;
+    }
+
+    for( i=start; i<end; i++ ) {
+        p->labels[i] = distance_sq_nearest( &p->panel,
+                &p->samples[(size_t) p->batch[i] * p->dims], 
+                (p->dist)? &p->dist[i] : NULL );
+    }
+}		/* -----  end of function minibatch_label_task  ----- */
+
+
+/* Up to max_iter batches, stopping early once no centroid moves more than
+ * tol in one. A monitor hears about every batch, as the batch: the inertia
+ * is the batch's, and every sample in it moved a centroid */
+int
+cluster_minibatch ( double *centroids, double *samples, int dims,
+        int n_centroids, int n_samples, int batch_size, int max_iter,
+        double tol, int n_threads, Rng *rng, KMeansMonitor *monitor )
+{
+    struct BatchPass p;
+    KMeansIterStats stats;
+    int iter, i, j;
+
+    if( monitor && !monitor->callback ) {
+        monitor = NULL;
+    }
+
+    if( !centroids || !samples || dims < 1 || n_centroids < 1 ||
+            n_samples < 1 || batch_size < 1 || !rng ) {
+        return 0;
+    }
+
+    p.samples = samples;
+    p.dims = dims;
+    p.batch_size = batch_size;
+    p.batch = workspace_alloc( sizeof(int) * batch_size );
+    p.labels = workspace_alloc( sizeof(int) * batch_size );
+    p.dist = (monitor)? workspace_alloc( sizeof(double) * batch_size ) : NULL;
+
+    /* v[j] is how many samples have been folded into centroid j so far. The
+     * learning rate for centroid j is 1/v[j] */
+    int *v = workspace_calloc( n_centroids, sizeof(int) );
+    double *old = workspace_alloc( sizeof(double) * n_centroids * dims );
+
+    DistancePanel_init( &p.panel, dims, n_centroids );
+
+    int n_tasks = (batch_size + MINIBATCH_TASK_SAMPLES-1) /
+        MINIBATCH_TASK_SAMPLES;
+
+    iter = 0;
+    memset( &stats, 0, sizeof(stats) );
+    if( p.batch && p.labels && v && old && p.panel.data && 
+            (!monitor || p.dist) ) {
+        for( iter=0; iter<max_iter; iter++ ) {
+            double t = (monitor)? monitor_clock() : 0;
+
+            for( i=0; i<batch_size; i++ ) {
+                p.batch[i] = Rng_below( rng, n_samples );
+            }
+
+            /* labelling the batch is the expensive part and doesn't depend on
+             * the order, so it's done in parallel against a snapshot of the
+             * centroids. The updates below have to be made in order */
+            ProfileMark mark;
+            profile_begin( &mark );
+            DistancePanel_load( &p.panel, centroids );
+            parallel_for( n_threads, n_tasks, minibatch_label_task, &p );
+            profile_distances( (long long) batch_size * p.panel.n_points );
+            profile_end( &mark, KMEANS_PHASE_ASSIGN );
+
+            if( monitor ) {
+                stats.assign_seconds = monitor_clock() - t;
+                t = monitor_clock();
+            }
+
+            profile_begin( &mark );
+            memcpy( old, centroids, sizeof(double) * n_centroids * dims );
+
+            for( i=0; i<batch_size; i++ ) {
+                int l = p.labels[i];
+                double *c = &centroids[l*dims];
+                double *x = &samples[(size_t) p.batch[i] * dims];
+                double eta = 1.0 / ++v[l];
+
+                for( j=0; j<dims; j++ ) {
+                    c[j] = (1.0 - eta) * c[j] + eta * x[j];
+                }
+            }
+            profile_end( &mark, KMEANS_PHASE_UPDATE );
+
+            /* stop once no centroid moves more than tol in an iteration */
+            double max_shift = 0;
+            for( i=0; i<n_centroids; i++ ) {
+                double d = euclidean_distance( &old[i*dims],
+                        &centroids[i*dims], dims );
+                if( d > max_shift ) {
+                    max_shift = d;
+                }
+            }
+
+            if( monitor ) {
+                stats.update_seconds = monitor_clock() - t;
+                stats.iteration = iter + 1;
+                stats.changed = batch_size;
+                stats.max_shift = max_shift;
+                stats.distance_evals = (long long) batch_size * n_centroids;
+                stats.inertia = 0;
+                for( i=0; i<batch_size; i++ ) {
+                    stats.inertia += p.dist[i];
+                }
+                if( monitor->callback( &stats, monitor->data ) ) {
+                    iter++;
+                    break;
+                }
+            }
+
+            if( max_shift <= tol ) {
+                iter++;
+                break;
+            }
+        }
+    }
+
+    DistancePanel_free( &p.panel );
+    workspace_free(p.batch);
+    workspace_free(p.labels);
+    workspace_free(p.dist);
+    workspace_free(v);
+    workspace_free(old);
+
+    return iter;
+}		/* -----  end of function cluster_minibatch  ----- */
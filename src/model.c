@@ -0,0 +1,174 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  model.c
+ *
+ *    Description:  Saving and loading trained models. The format is a small
+ *                  header followed by the centroids, everything little
+ *                  endian so a model can move between machines:
+ *
+ *                    "KMNS"     magic
+ *                    uint32     format version
+ *                    uint32     n_clusters
+ *                    uint32     n_features
+ *                    uint32     algorithm
+ *                    uint32     init
+ *                    float64    n_clusters x n_features centroids
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 14:05:33
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	<errno.h>
+#include	<limits.h>
+
+#define MODEL_MAGIC   "KMNS"
+#define MODEL_VERSION 1
+
+static void
+put_u32 ( unsigned char *b, uint32_t v )
+{
+    int i;
+    for( i=0; i<4; i++ ) {
+        b[i] = (unsigned char) (v >> (8*i));
+    }
+}		/* -----  end of function put_u32  ----- */
+
+
+static uint32_t
+get_u32 ( const unsigned char *b )
+{
+    uint32_t v = 0;
+    int i;
+    for( i=0; i<4; i++ ) {
+        v |= (uint32_t) b[i] << (8*i);
+    }
+    return v;
+}		/* -----  end of function get_u32  ----- */
+
+
+int
+KMeans_write ( KMeans *km, FILE *f )
+{
+    unsigned char header[24], b[8];
+    int i, j, n = km->n_clusters * km->n_features;
+
+    memcpy( header, MODEL_MAGIC, 4 );
+    put_u32( &header[4], MODEL_VERSION );
+    put_u32( &header[8], km->n_clusters );
+    put_u32( &header[12], km->n_features );
+    put_u32( &header[16], km->algorithm );
+    put_u32( &header[20], km->init );
+
+    if( fwrite( header, sizeof(header), 1, f ) != 1 ) {
+        return -1;
+    }
+
+    /* doubles go out as their IEEE 754 bits, low byte first */
+    for( i=0; i<n; i++ ) {
+        uint64_t bits;
+        memcpy( &bits, &km->centroids[i], sizeof(bits) );
+        for( j=0; j<8; j++ ) {
+            b[j] = (unsigned char) (bits >> (8*j));
+        }
+        if( fwrite( b, sizeof(b), 1, f ) != 1 ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}		/* -----  end of function KMeans_write  ----- */
+
+
+KMeans *
+KMeans_read ( FILE *f )
+{
+    unsigned char header[24], b[8];
+    int i, j;
+
+    if( fread( header, sizeof(header), 1, f ) != 1 ||
+            memcmp( header, MODEL_MAGIC, 4 ) ||
+            get_u32( &header[4] ) != MODEL_VERSION ) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    uint32_t k = get_u32( &header[8] );
+    uint32_t dims = get_u32( &header[12] );
+    uint32_t algorithm = get_u32( &header[16] );
+    uint32_t init = get_u32( &header[20] );
+
+    if( k < 1 || dims < 1 || (uint64_t) k * dims > INT_MAX / sizeof(double) ||
+            algorithm > KMEANS_GEMM || init > KMEANS_INIT_KMPAR ) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    KMeans *km = KMeans_new( k, dims );
+    if( !km ) {
+        return NULL;
+    }
+    km->algorithm = algorithm;
+    km->init = init;
+
+    for( i=0; i<(int) (k * dims); i++ ) {
+        uint64_t bits = 0;
+        if( fread( b, sizeof(b), 1, f ) != 1 ) {
+            KMeans_free( km );
+            errno = EINVAL;
+            return NULL;
+        }
+        for( j=0; j<8; j++ ) {
+            bits |= (uint64_t) b[j] << (8*j);
+        }
+        memcpy( &km->centroids[i], &bits, sizeof(bits) );
+    }
+    km->fitted = 1;
+
+    return km;
+}		/* -----  end of function KMeans_read  ----- */
+
+
+int
+KMeans_save ( KMeans *km, const char *filename )
+{
+    FILE *f = fopen( filename, "wb" );
+    if( !f ) {
+        return -1;
+    }
+
+    int err = KMeans_write( km, f );
+
+    /* a full disk may only show up when the buffer is flushed */
+    if( fclose(f) ) {
+        err = -1;
+    }
+
+    return err;
+}		/* -----  end of function KMeans_save  ----- */
+
+
+KMeans *
+KMeans_load ( const char *filename )
+{
+    FILE *f = fopen( filename, "rb" );
+    if( !f ) {
+        return NULL;
+    }
+
+    KMeans *km = KMeans_read( f );
+
+    int err = errno;
+    fclose(f);
+    errno = err;
+
+    return km;
+}		/* -----  end of function KMeans_load  ----- */
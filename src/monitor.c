@@ -0,0 +1,66 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  monitor.c
+ *
+ *    Description:  Per-iteration statistics for the training engines. None
+ *                  of this is called unless a callback is attached.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 10:12:40
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"monitor.h"
+#include	<time.h>
+
+double
+monitor_clock ( void )
+{
+    struct timespec t;
+    clock_gettime( CLOCK_MONOTONIC, &t );
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}		/* -----  end of function monitor_clock  ----- */
+
+
+double
+monitor_max_shift ( const double *old, const double *centroids, int dims, 
+        int n_centroids )
+{
+    double max_shift = 0;
+    int i;
+
+    for( i=0; i<n_centroids; i++ ) {
+        double d = euclidean_distance( (double *) &old[i*dims], 
+                (double *) &centroids[i*dims], dims );
+        if( d > max_shift ) {
+            max_shift = d;
+        }
+    }
+
+    return max_shift;
+}		/* -----  end of function monitor_max_shift  ----- */
+
+
+int
+monitor_report ( KMeansMonitor *m, KMeansSlots *s, KMeansIterStats *stats )
+{
+    int k;
+
+    /* add up the slots in order, like the centroids, so the inertia doesn't 
+     * depend on the number of threads either */
+    stats->inertia = 0;
+    stats->distance_evals = 0;
+    for( k=0; k<s->n_slots; k++ ) {
+        stats->inertia += s->inertia[k];
+        stats->distance_evals += s->evals[k];
+    }
+
+    return m->callback( stats, m->data );
+}		/* -----  end of function monitor_report  ----- */
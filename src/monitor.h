@@ -0,0 +1,35 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  monitor.h
+ *
+ *    Description:  Helpers the training engines use to fill in a
+ *                  KMeansIterStats when a KMeansMonitor is attached. Not
+ *                  part of the public interface in kmeans.h.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 10:12:40
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  MONITOR_INC
+#define  MONITOR_INC
+
+#include	"kmeans.h"
+#include	"slots.h"
+
+double monitor_clock ( void );
+
+double monitor_max_shift ( const double *old, const double *centroids, 
+        int dims, int n_centroids );
+
+int monitor_report ( KMeansMonitor *m, KMeansSlots *s, 
+        KMeansIterStats *stats );
+
+#endif   /* ----- #ifndef MONITOR_INC  ----- */
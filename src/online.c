@@ -0,0 +1,69 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  online.c
+ *
+ *    Description:  Sequential k-means (MacQueen, 1967) for samples which
+ *                  arrive as a stream. The first n_centroids samples become
+ *                  the centroids, and every one after that moves its
+ *                  nearest centroid towards it by the reciprocal of how
+ *                  many samples that centroid has taken in. Nothing about
+ *                  the samples is kept, only the centroids and their counts.
+ *
+ *        Version:  1.0
+ *        Created:  22/10/26 10:12:38
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	"distance.h"
+
+/* Fold n_samples samples into the centroids one at a time, in order. A zero
+ * count marks a centroid which hasn't been given its first sample yet; they
+ * are filled in from the front, so only the ones before the first zero are
+ * in play. With a decay each count is scaled by 1 - decay before a sample
+ * joins it, which forgets old samples exponentially and keeps the learning
+ * rate from falling below decay, so the centroids can follow a drifting
+ * stream. Returns how many centroids have had a sample */
+int
+cluster_online ( double *centroids, double *counts, const double *samples,
+        int dims, int n_centroids, int n_samples, double decay )
+{
+    int seeded = 0, i, j;
+
+    while( seeded < n_centroids && counts[seeded] > 0 ) {
+        seeded++;
+    }
+
+    for( i=0; i<n_samples; i++ ) {
+        const double *x = &samples[(size_t) i * dims];
+
+        if( seeded < n_centroids ) {
+            memcpy( &centroids[(size_t) seeded * dims], x,
+                    sizeof(double) * dims );
+            counts[seeded++] = 1;
+            continue;
+        }
+
+        /* the centroids change after every sample, so they're compared as
+         * they are rather than packed into a panel */
+        int l = distance_sq_nearest_rows( centroids, x, dims, n_centroids,
+                NULL );
+        double *c = &centroids[(size_t) l * dims];
+
+        counts[l] = counts[l] * (1.0 - decay) + 1.0;
+        double eta = 1.0 / counts[l];
+
+        for( j=0; j<dims; j++ ) {
+            c[j] += eta * (x[j] - c[j]);
+        }
+    }
+
+    return seeded;
+}		/* -----  end of function cluster_online  ----- */
@@ -0,0 +1,137 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  palette.c
+ *
+ *    Description:  Collapses 8-bit RGB pixels into the distinct colours of
+ *                  an image and how many pixels have each one, so the
+ *                  clustering only ever sees one sample per colour.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 16:32:09
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"palette.h"
+#include	<stdlib.h>
+
+#define PALETTE_SIZE (1 << 24)
+
+int
+Palette_init ( Palette *p )
+{
+    if( !p ) {
+        return -1;
+    }
+
+    /* 64MB, but calloc hands back untouched zero pages, so we only really 
+     * pay for the parts of the colour cube the image uses */
+    p->hist = calloc( PALETTE_SIZE, sizeof(uint32_t) );
+    p->n_colors = 0;
+    p->capacity = 0;
+    p->colors = NULL;
+    p->weights = NULL;
+    p->labels = NULL;
+
+    return (p->hist)? 0 : -1;
+}		/* -----  end of function Palette_init  ----- */
+
+
+void
+Palette_add ( Palette *p, int r, int g, int b )
+{
+    p->hist[(r << 16) | (g << 8) | b]++;
+}		/* -----  end of function Palette_add  ----- */
+
+
+int
+Palette_build ( Palette *p )
+{
+    int i, n = 0;
+
+    for( i=0; i<PALETTE_SIZE; i++ ) {
+        n += (p->hist[i] != 0);
+    }
+
+    /* only grow, so that a palette used for frame after frame stops 
+     * allocating once it has seen the most colourful one */
+    if( n > p->capacity ) {
+        free(p->colors);
+        free(p->weights);
+        free(p->labels);
+        p->colors = malloc( sizeof(double) * n * PALETTE_FEATURES );
+        p->weights = malloc( sizeof(double) * n );
+        p->labels = malloc( sizeof(int) * n );
+        p->capacity = n;
+        if( !p->colors || !p->weights || !p->labels ) {
+            p->n_colors = p->capacity = 0;
+            return -1;
+        }
+    }
+
+    p->n_colors = 0;
+    for( i=0; i<PALETTE_SIZE; i++ ) {
+        if( p->hist[i] ) {
+            double *c = &p->colors[p->n_colors * PALETTE_FEATURES];
+            c[0] = (i >> 16) & 0xff;
+            c[1] = (i >> 8) & 0xff;
+            c[2] = i & 0xff;
+            p->weights[p->n_colors++] = p->hist[i];
+        }
+    }
+
+    return p->n_colors;
+}		/* -----  end of function Palette_build  ----- */
+
+
+/* labels[i] is the cluster of colors[i]. The counts have already gone into
+ * weights, so hist is free to hold the labels instead */
+void
+Palette_label ( Palette *p, const int *labels )
+{
+    int i, n = 0;
+
+    for( i=0; i<PALETTE_SIZE; i++ ) {
+        if( p->hist[i] ) {
+            p->hist[i] = labels[n++];
+        }
+    }
+}		/* -----  end of function Palette_label  ----- */
+
+
+/* Empty a built palette for the next image. Only the colours it found are 
+ * cleared, which beats zeroing all of hist when there are few of them */
+void
+Palette_clear ( Palette *p )
+{
+    int i;
+
+    for( i=0; i<p->n_colors; i++ ) {
+        const double *c = &p->colors[i * PALETTE_FEATURES];
+        p->hist[((int) c[0] << 16) | ((int) c[1] << 8) | (int) c[2]] = 0;
+    }
+    p->n_colors = 0;
+}		/* -----  end of function Palette_clear  ----- */
+
+
+void
+Palette_free ( Palette *p )
+{
+    if(p) {
+        free(p->hist);
+        free(p->colors);
+        free(p->weights);
+        free(p->labels);
+        p->hist = NULL;
+        p->colors = NULL;
+        p->weights = NULL;
+        p->labels = NULL;
+        p->n_colors = p->capacity = 0;
+    }
+}		/* -----  end of function Palette_free  ----- */
@@ -0,0 +1,60 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  palette.h
+ *
+ *    Description:  Collapses 8-bit RGB pixels into the distinct colours of
+ *                  an image and how many pixels have each one, so the
+ *                  clustering only ever sees one sample per colour.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 16:32:09
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  PALETTE_INC
+#define  PALETTE_INC
+
+#include	<stdint.h>
+
+#define PALETTE_FEATURES 3
+
+/* hist has one counter per possible 24-bit colour. Once built, colors holds 
+ * n_colors RGB triples ready for the clustering, weights their pixel counts 
+ * and labels room for the clustering's labels. Palette_label then turns hist
+ * into a map from colour to label */
+typedef struct Palette {
+    uint32_t *hist;
+    int n_colors;
+    int capacity;           /* colours there's room for without a realloc */
+    double *colors;
+    double *weights;
+    int *labels;
+} Palette;
+
+int Palette_init ( Palette *p );
+
+void Palette_add ( Palette *p, int r, int g, int b );
+
+int Palette_build ( Palette *p );
+
+void Palette_label ( Palette *p, const int *labels );
+
+void Palette_clear ( Palette *p );
+
+void Palette_free ( Palette *p );
+
+/* the label of a colour in the image, once Palette_label has been called */
+static inline int
+Palette_lookup ( const Palette *p, int r, int g, int b )
+{
+    return p->hist[(r << 16) | (g << 8) | b];
+}		/* -----  end of function Palette_lookup  ----- */
+
+#endif   /* ----- #ifndef PALETTE_INC  ----- */
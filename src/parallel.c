@@ -0,0 +1,185 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  parallel.c
+ *
+ *    Description:  A small persistent pool of worker threads used to spread
+ *                  the clustering loops across cores.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 09:12:40
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"parallel.h"
+#include	<pthread.h>
+#include	<stdint.h>
+#include	<unistd.h>
+
+/* There is one pool for the whole process. Workers are only spawned the first
+ * time somebody asks for that many threads and then sleep on a condition
+ * variable between jobs, so we don't pay for thread creation every iteration.
+ * Only one job runs on the pool at a time. */
+static struct {
+    pthread_mutex_t busy;       /* held by whoever is running a job */
+    pthread_mutex_t lock;       /* protects everything below */
+    pthread_cond_t  wake;
+    pthread_cond_t  done;
+
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    unsigned long born[PARALLEL_MAX_THREADS];
+    int n_workers;
+
+    unsigned long generation;
+    int n_helpers;
+    int n_running;
+
+    ParallelTask fn;
+    void *ctx;
+    int n_tasks;
+    int next_task;
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+};
+
+/* set on any thread currently executing tasks for the pool. A nested call to
+ * parallel_for from inside a task just runs inline rather than deadlocking */
+static __thread int in_pool = 0;
+
+static void
+run_tasks ( int thread )
+{
+    for(;;) {
+        int t = __sync_fetch_and_add( &pool.next_task, 1 );
+        if( t >= pool.n_tasks ) {
+            break;
+        }
+        pool.fn( pool.ctx, t, thread );
+    }
+}		/* -----  end of function run_tasks  ----- */
+
+
+static void *
+worker_main ( void *arg )
+{
+    int id = (int)(intptr_t) arg;
+
+    in_pool = 1;
+
+    pthread_mutex_lock( &pool.lock );
+    unsigned long seen = pool.born[id];
+    for(;;) {
+        while( pool.generation == seen ) {
+            pthread_cond_wait( &pool.wake, &pool.lock );
+        }
+        seen = pool.generation;
+
+        /* not every worker is needed for every job */
+        if( id > pool.n_helpers ) {
+            continue;
+        }
+
+        pthread_mutex_unlock( &pool.lock );
+        run_tasks( id );
+        pthread_mutex_lock( &pool.lock );
+
+        if( --pool.n_running == 0 ) {
+            pthread_cond_signal( &pool.done );
+        }
+    }
+
+    return NULL;
+}		/* -----  end of function worker_main  ----- */
+
+
+int
+parallel_num_cores ( void )
+{
+    long n = sysconf( _SC_NPROCESSORS_ONLN );
+    if( n < 1 ) {
+        return 1;
+    }
+    return (n > PARALLEL_MAX_THREADS)? PARALLEL_MAX_THREADS : (int) n;
+}		/* -----  end of function parallel_num_cores  ----- */
+
+
+/* Workers spawned so far. Read without the lock; it only ever grows */
+int
+parallel_num_workers ( void )
+{
+    return __atomic_load_n( &pool.n_workers, __ATOMIC_RELAXED );
+}		/* -----  end of function parallel_num_workers  ----- */
+
+
+void
+parallel_for ( int n_threads, int n_tasks, ParallelTask fn, void *ctx )
+{
+    int t;
+
+    if( !fn || n_tasks < 1 ) {
+        return;
+    }
+
+    if( n_threads > n_tasks ) {
+        n_threads = n_tasks;
+    }
+    if( n_threads > PARALLEL_MAX_THREADS ) {
+        n_threads = PARALLEL_MAX_THREADS;
+    }
+
+    /* run inline if we only want one thread, if we're already inside a task
+     * or if some other thread has the pool right now */
+    if( n_threads <= 1 || in_pool || pthread_mutex_trylock( &pool.busy ) ) {
+        for( t=0; t<n_tasks; t++ ) {
+            fn( ctx, t, 0 );
+        }
+        return;
+    }
+
+    /* worker ids start at 1. The calling thread is always thread 0 */
+    pthread_mutex_lock( &pool.lock );
+    while( pool.n_workers < n_threads - 1 ) {
+        int id = pool.n_workers + 1;
+        pool.born[id] = pool.generation;
+        if( pthread_create( &pool.threads[id], NULL, worker_main,
+                    (void *)(intptr_t) id ) ) {
+            break;
+        }
+        pthread_detach( pool.threads[id] );
+        __atomic_store_n( &pool.n_workers, id, __ATOMIC_RELAXED );
+    }
+    if( n_threads - 1 > pool.n_workers ) {
+        n_threads = pool.n_workers + 1;
+    }
+
+    pool.fn = fn;
+    pool.ctx = ctx;
+    pool.n_tasks = n_tasks;
+    pool.next_task = 0;
+    pool.n_helpers = n_threads - 1;
+    pool.n_running = n_threads - 1;
+    pool.generation++;
+    pthread_cond_broadcast( &pool.wake );
+    pthread_mutex_unlock( &pool.lock );
+
+    in_pool = 1;
+    run_tasks( 0 );
+    in_pool = 0;
+
+    pthread_mutex_lock( &pool.lock );
+    while( pool.n_running > 0 ) {
+        pthread_cond_wait( &pool.done, &pool.lock );
+    }
+    pthread_mutex_unlock( &pool.lock );
+
+    pthread_mutex_unlock( &pool.busy );
+}		/* -----  end of function parallel_for  ----- */
@@ -0,0 +1,36 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  parallel.h
+ *
+ *    Description:  A small persistent pool of worker threads used to spread
+ *                  the clustering loops across cores.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 09:12:40
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  PARALLEL_INC
+#define  PARALLEL_INC
+
+#define PARALLEL_MAX_THREADS 256
+
+/* A unit of work handed out by parallel_for. task is the index of the task to
+ * run and thread is the id of the calling thread, in [0, n_threads), so that
+ * tasks can accumulate into per-thread scratch space without locking */
+typedef void (*ParallelTask) ( void *ctx, int task, int thread );
+
+int parallel_num_cores ( void );
+
+int parallel_num_workers ( void );
+
+void parallel_for ( int n_threads, int n_tasks, ParallelTask fn, void *ctx );
+
+#endif   /* ----- #ifndef PARALLEL_INC  ----- */
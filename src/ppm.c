@@ -0,0 +1,157 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  ppm.c
+ *
+ *    Description:  Memory mapped binary PPM (P6) images.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 12:34:08
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"ppm.h"
+#include	<ctype.h>
+#include	<errno.h>
+#include	<fcntl.h>
+#include	<stdint.h>
+#include	<sys/mman.h>
+#include	<sys/stat.h>
+#include	<unistd.h>
+
+/* Read one number from the header, skipping whitespace and # comments. 
+ * Returns the offset just past it, or 0 if there isn't one */
+static size_t
+header_field ( const unsigned char *p, size_t size, size_t i, long *value )
+{
+    while( i < size && (isspace( p[i] ) || p[i] == '#') ) {
+        if( p[i] == '#' ) {
+            while( i < size && p[i] != '\n' ) {
+                i++;
+            }
+        } else {
+            i++;
+        }
+    }
+
+    if( i >= size || !isdigit( p[i] ) ) {
+        return 0;
+    }
+
+    *value = 0;
+    while( i < size && isdigit( p[i] ) && *value < INT32_MAX ) {
+        *value = *value * 10 + (p[i++] - '0');
+    }
+
+    return i;
+}		/* -----  end of function header_field  ----- */
+
+
+int
+PpmImage_open ( PpmImage *img, const char *filename )
+{
+    struct stat st;
+    long w = 0, h = 0, maxval = 0;
+    size_t i;
+
+    img->map = NULL;
+    img->pixels = NULL;
+
+    int fd = open( filename, O_RDONLY );
+    if( fd < 0 ) {
+        return -1;
+    }
+
+    if( fstat( fd, &st ) ) {
+        close(fd);
+        return -1;
+    }
+
+    if( st.st_size < 3 ) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+
+    img->map_size = st.st_size;
+    img->map = mmap( NULL, img->map_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+    close(fd);
+    if( img->map == MAP_FAILED ) {
+        img->map = NULL;
+        return -1;
+    }
+
+    /* we read through it front to back, let the kernel read ahead */
+    madvise( img->map, img->map_size, MADV_SEQUENTIAL );
+
+    const unsigned char *p = img->map;
+    i = 0;
+    if( p[0] == 'P' && p[1] == '6' ) {
+        i = header_field( p, img->map_size, 2, &w );
+    }
+    if( i ) {
+        i = header_field( p, img->map_size, i, &h );
+    }
+    if( i ) {
+        i = header_field( p, img->map_size, i, &maxval );
+    }
+
+    /* exactly one whitespace character separates the header from the 
+     * pixels */
+    if( !i || w < 1 || h < 1 || w > INT32_MAX / 3 || h > INT32_MAX || 
+            maxval != 255 || i >= img->map_size || !isspace( p[i] ) || 
+            (img->map_size - i - 1) / 3 / w < (size_t) h ) {
+        PpmImage_close(img);
+        errno = EINVAL;
+        return -1;
+    }
+
+    img->width = w;
+    img->height = h;
+    img->pixels = &p[i+1];
+
+    return 0;
+}		/* -----  end of function PpmImage_open  ----- */
+
+
+/* Tell the kernel we're done with some rows, so a pass over the image 
+ * doesn't leave the whole file resident */
+void
+PpmImage_release ( PpmImage *img, int first_row, int end_row )
+{
+    size_t page = sysconf( _SC_PAGESIZE );
+    size_t row = (size_t) img->width * 3;
+    size_t start = (img->pixels - (unsigned char *) img->map) + row * first_row;
+    size_t end = (img->pixels - (unsigned char *) img->map) + row * end_row;
+
+    /* only whole pages inside the rows can go */
+    start = (start + page-1) / page * page;
+    end = end / page * page;
+    if( end > start ) {
+        madvise( (char *) img->map + start, end - start, MADV_DONTNEED );
+    }
+}		/* -----  end of function PpmImage_release  ----- */
+
+
+void
+PpmImage_close ( PpmImage *img )
+{
+    if( img && img->map ) {
+        munmap( img->map, img->map_size );
+        img->map = NULL;
+        img->pixels = NULL;
+    }
+}		/* -----  end of function PpmImage_close  ----- */
+
+
+int
+ppm_write_header ( FILE *f, int width, int height )
+{
+    return (fprintf( f, "P6\n%d %d\n255\n", width, height ) < 0)? -1 : 0;
+}		/* -----  end of function ppm_write_header  ----- */
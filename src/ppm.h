@@ -0,0 +1,44 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  ppm.h
+ *
+ *    Description:  Memory mapped binary PPM (P6) images, so images bigger
+ *                  than RAM can be read a few rows at a time.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 12:34:08
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  PPM_INC
+#define  PPM_INC
+
+#include	<stddef.h>
+#include	<stdio.h>
+
+/* pixels points into the mapping, width x height RGB triples with no 
+ * padding between rows. Only 8-bit images (maxval 255) are supported */
+typedef struct PpmImage {
+    int width;
+    int height;
+    const unsigned char *pixels;
+    void *map;
+    size_t map_size;
+} PpmImage;
+
+int PpmImage_open ( PpmImage *img, const char *filename );
+
+void PpmImage_release ( PpmImage *img, int first_row, int end_row );
+
+void PpmImage_close ( PpmImage *img );
+
+int ppm_write_header ( FILE *f, int width, int height );
+
+#endif   /* ----- #ifndef PPM_INC  ----- */
@@ -0,0 +1,99 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  predict.c
+ *
+ *    Description:  Labelling a whole batch of samples with a trained model.
+ *                  The centroids are laid out for the vector kernels once
+ *                  and the samples handed out to the threads in blocks.
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 10:21:06
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	"distance.h"
+#include	"parallel.h"
+#include	"workspace.h"
+
+/* samples labelled per task */
+#define PREDICT_SAMPLES 4096
+
+/* state shared by the tasks of one KMeans_predict */
+struct PredictPass {
+    DistancePanel panel;    /* the centroids, laid out for the kernels */
+    const double *samples;
+    int dims;
+    int n_samples;
+    int *labels;
+    double *distances;      /* NULL if the caller doesn't want them */
+};
+
+static void
+predict_slot ( void *ctx, int task, int thread )
+{
+    struct PredictPass *p = ctx;
+    int start = task * PREDICT_SAMPLES;
+    int end = (start + PREDICT_SAMPLES < p->n_samples)?
+        start + PREDICT_SAMPLES : p->n_samples;
+    int i;
+
+    if( p->distances ) {
+        for( i=start; i<end; i++ ) {
+            double sq;
+            p->labels[i] = distance_sq_nearest( &p->panel,
+                    &p->samples[(size_t) i * p->dims], &sq );
+            p->distances[i] = sqrt(sq);
+        }
+    } else {
+        for( i=start; i<end; i++ ) {
+            p->labels[i] = distance_sq_nearest( &p->panel,
+                    &p->samples[(size_t) i * p->dims], NULL );
+        }
+    }
+}		/* -----  end of function predict_slot  ----- */
+
+
+/* Label n_samples samples, each the one KMeans_classify would give it. If
+ * distances isn't NULL it gets the distance from each sample to its
+ * centroid, like find_closest. Returns 0, or -1 if the model isn't fitted
+ * yet or we couldn't get the memory for the centroids' panel */
+int
+KMeans_predict ( KMeans *km, const double *samples, int n_samples,
+        int *labels, double *distances )
+{
+    struct PredictPass p;
+    WorkspaceScope scope;
+
+    if( !km || !km->fitted || !samples || !labels || n_samples < 0 ) {
+        return -1;
+    }
+
+    p.samples = samples;
+    p.dims = km->n_features;
+    p.n_samples = n_samples;
+    p.labels = labels;
+    p.distances = distances;
+
+    workspace_enter( km->workspace, &scope );
+    if( DistancePanel_init( &p.panel, km->n_features, km->n_clusters ) ) {
+        workspace_leave( &scope );
+        return -1;
+    }
+    DistancePanel_load( &p.panel, km->centroids );
+
+    parallel_for( km->n_threads,
+            (n_samples + PREDICT_SAMPLES-1) / PREDICT_SAMPLES,
+            predict_slot, &p );
+
+    DistancePanel_free( &p.panel );
+    workspace_leave( &scope );
+    return 0;
+}		/* -----  end of function KMeans_predict  ----- */
@@ -0,0 +1,362 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  profile.c
+ *
+ *    Description:  Where a model's time goes. Every phase is timed, and on
+ *                  Linux each thread of the process gets a group of hardware
+ *                  counters from perf_event_open (cycles, instructions, last
+ *                  level cache misses and branch misses) which are read at
+ *                  either end of it. Where the kernel won't give us counters,
+ *                  in most containers and VMs, only the timers are kept.
+ *
+ *        Version:  1.0
+ *        Created:  23/10/26 11:20:04
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"profile.h"
+#include	"monitor.h"
+#include	"parallel.h"
+#include	<pthread.h>
+
+#ifdef __linux__
+#include	<dirent.h>
+#include	<linux/perf_event.h>
+#include	<sys/syscall.h>
+#include	<unistd.h>
+#endif
+
+/* threads we keep counters open on, the pool's and a few callers' */
+#define PROFILE_MAX_THREADS (PARALLEL_MAX_THREADS + 16)
+
+/* the profile this thread's marks go to, and whether one is in progress */
+static __thread KMeansProfile *current;
+static __thread int in_phase;
+
+/* distance evaluations by the assignment passes and find_closest. Counted
+ * for the whole process, but only while some call has a profile entered */
+static long long evals;
+static int n_active;        /* changed under counters.lock */
+
+/* The counters of every thread we've seen, one group per thread so they're
+ * all scheduled together. They're opened when the first profile is entered
+ * and closed when the last one leaves, and in between left running; a 
+ * phase is the difference between two reads. The threads are only looked 
+ * for again on entering, or at the start of a phase once the pool has 
+ * spawned more workers or a thread has gone, so unless another call is 
+ * entering at the same time, a phase's two reads are of the same threads */
+static struct {
+    pthread_mutex_t lock;
+    int state;              /* 0 not tried yet, 1 counting, -1 unavailable */
+    int n_threads;
+    int n_workers;          /* the pool's, as of the last scan */
+    int stale;              /* a read failed, the thread has likely gone */
+    int tids[PROFILE_MAX_THREADS];
+    int fds[PROFILE_MAX_THREADS][PROFILE_N_COUNTERS];
+} counters = { PTHREAD_MUTEX_INITIALIZER };
+
+#ifdef __linux__
+
+/* in the order of KMeansPhaseCounts. The kernel maps cache misses to the
+ * last level cache on most CPUs */
+static const unsigned long long events[PROFILE_N_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES
+};
+
+/* what a read of a group leader gives back */
+struct GroupRead {
+    uint64_t nr;
+    uint64_t enabled;
+    uint64_t running;
+    uint64_t values[PROFILE_N_COUNTERS];
+};
+
+static int
+counters_open ( int tid, int *fds )
+{
+    struct perf_event_attr attr;
+    int i;
+
+    for( i=0; i<PROFILE_N_COUNTERS; i++ ) {
+        memset( &attr, 0, sizeof(attr) );
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = events[i];
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP |
+            PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        fds[i] = syscall( SYS_perf_event_open, &attr, tid, -1,
+                (i)? fds[0] : -1, PERF_FLAG_FD_CLOEXEC );
+        if( fds[i] < 0 ) {
+            while( i-- ) {
+                close(fds[i]);
+            }
+            return -1;
+        }
+    }
+
+    return 0;
+}		/* -----  end of function counters_open  ----- */
+
+
+static void
+counters_close ( int t )
+{
+    int i;
+
+    for( i=0; i<PROFILE_N_COUNTERS; i++ ) {
+        close(counters.fds[t][i]);
+    }
+    counters.n_threads--;
+    counters.tids[t] = counters.tids[counters.n_threads];
+    memcpy( counters.fds[t], counters.fds[counters.n_threads],
+            sizeof(counters.fds[t]) );
+}		/* -----  end of function counters_close  ----- */
+
+
+/* Open counters on any thread we haven't seen yet, and close them on the 
+ * ones which have gone. The pool only spawns its workers when a job first
+ * asks for them, so the phase that does has to go without theirs */
+static void
+counters_scan ( void )
+{
+    DIR *dir = opendir( "/proc/self/task" );
+    unsigned char seen[PROFILE_MAX_THREADS] = { 0 };
+    struct dirent *e;
+    int i, n_old = counters.n_threads;
+
+    counters.n_workers = parallel_num_workers();
+    counters.stale = 0;
+
+    if( !dir ) {
+        counters.state = (counters.state)? counters.state : -1;
+        return;
+    }
+
+    while( (e = readdir(dir)) ) {
+        int tid = atoi( e->d_name );
+        if( tid <= 0 ) {
+            continue;
+        }
+
+        for( i=0; i<n_old && counters.tids[i] != tid; i++ );
+        if( i < n_old ) {
+            seen[i] = 1;
+            continue;
+        }
+
+        i = counters.n_threads;
+        if( i < PROFILE_MAX_THREADS && !counters_open( tid, counters.fds[i] ) ) {
+            counters.tids[i] = tid;
+            counters.n_threads++;
+        }
+    }
+    closedir(dir);
+
+    /* from the back, so the ones moved into a gap have been looked at */
+    for( i=n_old-1; i>=0; i-- ) {
+        if( !seen[i] ) {
+            counters_close(i);
+        }
+    }
+
+    /* the first scan decides. If not even our own thread could be counted
+     * we won't get anywhere with the others */
+    if( !counters.state ) {
+        counters.state = (counters.n_threads > 0)? 1 : -1;
+    }
+}		/* -----  end of function counters_scan  ----- */
+
+
+static void
+counters_read ( long long *counts )
+{
+    struct GroupRead r;
+    int t, i;
+
+    memset( counts, 0, sizeof(long long) * PROFILE_N_COUNTERS );
+
+    for( t=0; t<counters.n_threads; t++ ) {
+        if( read( counters.fds[t][0], &r, sizeof(r) ) != sizeof(r) ||
+                r.nr != PROFILE_N_COUNTERS ) {
+            counters.stale = 1;
+            continue;
+        }
+
+        /* a group which had to share the hardware was only counting for
+         * part of the time, so scale it up to the whole */
+        double scale = (r.running > 0 && r.running < r.enabled)?
+            (double) r.enabled / r.running : 1.0;
+        for( i=0; i<PROFILE_N_COUNTERS; i++ ) {
+            counts[i] += (long long) (r.values[i] * scale);
+        }
+    }
+}		/* -----  end of function counters_read  ----- */
+
+
+static void
+counters_close_all ( void )
+{
+    while( counters.n_threads > 0 ) {
+        counters_close( counters.n_threads - 1 );
+    }
+    counters.state = (counters.state > 0)? 0 : counters.state;
+}		/* -----  end of function counters_close_all  ----- */
+
+#else
+
+static void
+counters_scan ( void )
+{
+    counters.state = -1;
+}		/* -----  end of function counters_scan  ----- */
+
+
+static void
+counters_close_all ( void )
+{
+}		/* -----  end of function counters_close_all  ----- */
+
+
+static void
+counters_read ( long long *counts )
+{
+    memset( counts, 0, sizeof(long long) * PROFILE_N_COUNTERS );
+}		/* -----  end of function counters_read  ----- */
+
+#endif
+
+
+void
+profile_enter ( KMeansProfile *profile, ProfileScope *scope )
+{
+    scope->prev = current;
+    scope->profile = (profile != current)? profile : NULL;
+    if( scope->profile ) {
+        pthread_mutex_lock( &counters.lock );
+        __atomic_add_fetch( &n_active, 1, __ATOMIC_RELAXED );
+        if( counters.state >= 0 ) {
+            counters_scan();
+        }
+        pthread_mutex_unlock( &counters.lock );
+        scope->evals = __atomic_load_n( &evals, __ATOMIC_RELAXED );
+    }
+    current = profile;
+}		/* -----  end of function profile_enter  ----- */
+
+
+void
+profile_leave ( ProfileScope *scope )
+{
+    if( scope->profile ) {
+        scope->profile->distance_evals +=
+            __atomic_load_n( &evals, __ATOMIC_RELAXED ) - scope->evals;
+
+        /* the last one out closes the counters */
+        pthread_mutex_lock( &counters.lock );
+        if( !__atomic_sub_fetch( &n_active, 1, __ATOMIC_RELAXED ) ) {
+            counters_close_all();
+        }
+        pthread_mutex_unlock( &counters.lock );
+    }
+    current = scope->prev;
+}		/* -----  end of function profile_leave  ----- */
+
+
+void
+profile_begin ( ProfileMark *mark )
+{
+    mark->profile = NULL;
+    if( !current || in_phase ) {
+        return;
+    }
+
+    in_phase = 1;
+    mark->profile = current;
+
+    pthread_mutex_lock( &counters.lock );
+    if( counters.state > 0 && (counters.stale ||
+                counters.n_workers != parallel_num_workers()) ) {
+        counters_scan();
+    }
+    if( counters.state > 0 ) {
+        counters_read( mark->counts );
+    }
+    pthread_mutex_unlock( &counters.lock );
+
+    mark->start = monitor_clock();
+}		/* -----  end of function profile_begin  ----- */
+
+
+void
+profile_end ( ProfileMark *mark, KMeansPhase phase )
+{
+    KMeansProfile *p = mark->profile;
+    long long counts[PROFILE_N_COUNTERS];
+    int counted = 0;
+
+    if( !p ) {
+        return;
+    }
+
+    double seconds = monitor_clock() - mark->start;
+
+    pthread_mutex_lock( &counters.lock );
+    if( counters.state > 0 ) {
+        counters_read( counts );
+        counted = 1;
+    }
+    pthread_mutex_unlock( &counters.lock );
+
+    KMeansPhaseCounts *c = &p->phases[phase];
+    c->calls++;
+    c->seconds += seconds;
+    if( counted ) {
+        c->cycles += counts[0] - mark->counts[0];
+        c->instructions += counts[1] - mark->counts[1];
+        c->llc_misses += counts[2] - mark->counts[2];
+        c->branch_misses += counts[3] - mark->counts[3];
+        p->counters = 1;
+    }
+
+    in_phase = 0;
+}		/* -----  end of function profile_end  ----- */
+
+
+void
+profile_distances ( long long n )
+{
+    if( __atomic_load_n( &n_active, __ATOMIC_RELAXED ) ) {
+        __atomic_add_fetch( &evals, n, __ATOMIC_RELAXED );
+    }
+}		/* -----  end of function profile_distances  ----- */
+
+
+/* what the slots of an assignment pass say they computed */
+void
+profile_slots ( const KMeansSlots *slots )
+{
+    long long n = 0;
+    int k;
+
+    if( !__atomic_load_n( &n_active, __ATOMIC_RELAXED ) ) {
+        return;
+    }
+
+    for( k=0; k<slots->n_slots; k++ ) {
+        n += slots->evals[k];
+    }
+    __atomic_add_fetch( &evals, n, __ATOMIC_RELAXED );
+}		/* -----  end of function profile_slots  ----- */
@@ -0,0 +1,59 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  profile.h
+ *
+ *    Description:  Marks around the phases of training for a model with a
+ *                  KMeansProfile attached. Each KMeans_* call enters its
+ *                  model's profile, and until it leaves, the phases marked on
+ *                  that thread are added to it. Not part of the public
+ *                  interface in kmeans.h.
+ *
+ *        Version:  1.0
+ *        Created:  23/10/26 11:20:04
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  PROFILE_INC
+#define  PROFILE_INC
+
+#include	"kmeans.h"
+#include	"slots.h"
+
+#define PROFILE_N_COUNTERS 4
+
+/* What to go back to on leaving. Like a workspace, entering a NULL profile
+ * turns the marks off until the matching leave */
+typedef struct ProfileScope {
+    KMeansProfile *prev;
+    KMeansProfile *profile;
+    long long evals;        /* distance evaluations when we entered */
+} ProfileScope;
+
+/* One phase in progress. A mark made inside another phase is ignored, so
+ * the seeding's own Lloyd passes count as seeding */
+typedef struct ProfileMark {
+    KMeansProfile *profile; /* NULL when this mark isn't counting */
+    double start;
+    long long counts[PROFILE_N_COUNTERS];
+} ProfileMark;
+
+void profile_enter ( KMeansProfile *profile, ProfileScope *scope );
+
+void profile_leave ( ProfileScope *scope );
+
+void profile_begin ( ProfileMark *mark );
+
+void profile_end ( ProfileMark *mark, KMeansPhase phase );
+
+void profile_distances ( long long n );
+
+void profile_slots ( const KMeansSlots *slots );
+
+#endif   /* ----- #ifndef PROFILE_INC  ----- */
@@ -0,0 +1,139 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  rng.c
+ *
+ *    Description:  A small, fast pseudo random number generator
+ *                  (xoshiro256**) for sampling the data. Unlike rand() every
+ *                  stream carries its own state.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 15:21:48
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"rng.h"
+
+static inline uint64_t
+rotl ( uint64_t x, int k )
+{
+    return (x << k) | (x >> (64 - k));
+}		/* -----  end of function rotl  ----- */
+
+
+void
+Rng_seed ( Rng *rng, uint64_t seed )
+{
+    /* xoshiro must not start from all zeros, so spread the seed over the
+     * state with splitmix64 as its authors recommend */
+    int i;
+    for( i=0; i<4; i++ ) {
+        uint64_t z = (seed += 0x9e3779b97f4a7c15ULL);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+        rng->s[i] = z ^ (z >> 31);
+    }
+}		/* -----  end of function Rng_seed  ----- */
+
+
+uint64_t
+Rng_next ( Rng *rng )
+{
+    uint64_t *s = rng->s;
+    uint64_t result = rotl( s[1] * 5, 7 ) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl( s[3], 45 );
+
+    return result;
+}		/* -----  end of function Rng_next  ----- */
+
+
+double
+Rng_uniform ( Rng *rng )
+{
+    /* top 53 bits, so every double in [0,1) is a multiple of 2^-53 */
+    return (Rng_next( rng ) >> 11) * 0x1.0p-53;
+}		/* -----  end of function Rng_uniform  ----- */
+
+
+int
+Rng_below ( Rng *rng, int n )
+{
+    /* Lemire's multiply and reject. Unlike rand()%n there is no bias towards
+     * the small numbers */
+    uint64_t bound = (uint64_t) n;
+    uint64_t threshold = (0 - bound) % bound;
+
+    for(;;) {
+        unsigned __int128 m = (unsigned __int128) Rng_next( rng ) * bound;
+        if( (uint64_t) m >= threshold ) {
+            return (int)( m >> 64 );
+        }
+    }
+}		/* -----  end of function Rng_below  ----- */
+
+
+/* advance by the number of draws the polynomial in jump stands for */
+static void
+rng_jump_by ( Rng *rng, const uint64_t jump[4] )
+{
+    uint64_t s[4] = { 0, 0, 0, 0 };
+    int i, b, j;
+
+    for( i=0; i<4; i++ ) {
+        for( b=0; b<64; b++ ) {
+            if( jump[i] & (uint64_t) 1 << b ) {
+                for( j=0; j<4; j++ ) {
+                    s[j] ^= rng->s[j];
+                }
+            }
+            Rng_next( rng );
+        }
+    }
+
+    for( j=0; j<4; j++ ) {
+        rng->s[j] = s[j];
+    }
+}		/* -----  end of function rng_jump_by  ----- */
+
+
+void
+Rng_jump ( Rng *rng )
+{
+    static const uint64_t jump[4] = {
+        0x180ec6d33cfd0abaULL, 0xd5a61266f0c9392cULL,
+        0xa9582618e03fc9aaULL, 0x39abdc4529b1661cULL
+    };
+    rng_jump_by( rng, jump );
+}		/* -----  end of function Rng_jump  ----- */
+
+
+void
+Rng_long_jump ( Rng *rng )
+{
+    static const uint64_t jump[4] = {
+        0x76e15d3efefdcbbfULL, 0xc5004e441c522fb3ULL,
+        0x77710069854ee241ULL, 0x39109bb02acbe635ULL
+    };
+    rng_jump_by( rng, jump );
+}		/* -----  end of function Rng_long_jump  ----- */
+
+
+void
+Rng_split ( Rng *rng, Rng *child )
+{
+    *child = *rng;
+    Rng_jump( rng );
+}		/* -----  end of function Rng_split  ----- */
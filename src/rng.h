@@ -0,0 +1,51 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  rng.h
+ *
+ *    Description:  A small, fast pseudo random number generator
+ *                  (xoshiro256**) for sampling the data. Unlike rand() every
+ *                  stream carries its own state, and can be split into
+ *                  substreams which never overlap, one per task.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 15:21:48
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  RNG_INC
+#define  RNG_INC
+
+#include	<stdint.h>
+
+typedef struct Rng {
+    uint64_t s[4];
+} Rng;
+
+void Rng_seed ( Rng *rng, uint64_t seed );
+
+uint64_t Rng_next ( Rng *rng );
+
+double Rng_uniform ( Rng *rng );
+
+int Rng_below ( Rng *rng, int n );
+
+/* Skip 2^128 draws ahead, or 2^192 for the long jump. A stream can be cut
+ * into 2^64 long jumps, each of those into 2^64 jumps, and no two of the
+ * pieces will ever overlap */
+void Rng_jump ( Rng *rng );
+
+void Rng_long_jump ( Rng *rng );
+
+/* Hand child the stream where rng is, and move rng a jump on. Splitting n
+ * times gives n independent substreams, the same ones however many threads
+ * end up drawing from them */
+void Rng_split ( Rng *rng, Rng *child );
+
+#endif   /* ----- #ifndef RNG_INC  ----- */
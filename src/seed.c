@@ -0,0 +1,480 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  seed.c
+ *
+ *    Description:  k-means++ and k-means|| (Bahmani et al., 2012) seeding.
+ *                  Both keep the squared distance from every sample to its
+ *                  nearest chosen centroid and only ever compare the samples
+ *                  against the centroids chosen since the last update.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 17:15:44
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	"distance.h"
+#include	"parallel.h"
+#include	"workspace.h"
+
+/* Samples are handled in fixed blocks of this size. Each block keeps the
+ * total mass (weight x squared distance) of its samples, so a draw only has
+ * to walk the block totals and then scan inside a single block. The blocks
+ * never depend on the thread count, so neither do the draws */
+#define SEED_BLOCK_SAMPLES 4096
+
+/* k-means|| weighs its candidates in at most this many chunks */
+#define SEED_MAX_CHUNKS 64
+
+struct SeedPass {
+    double *samples;
+    double *weights;        /* NULL when every sample counts once */
+    int dims;
+    int n_samples;
+    double *min_dist;       /* squared distance to the nearest centroid */
+    double *block_mass;
+    DistancePanel panel;    /* the centroids chosen since the last update */
+    double *rows;           /* the same, unpacked when the panel is empty */
+    int n_rows;
+
+    /* k-means|| only */
+    unsigned char *chosen;
+    uint64_t round_seed;
+    double oversample;      /* expected picks per round */
+    double cost;
+    int n_chunks;
+    double *chunk_weights;  /* n_chunks x candidates */
+    int n_candidates;
+};
+
+static void
+block_range ( struct SeedPass *p, int block, int *start, int *end )
+{
+    *start = block * SEED_BLOCK_SAMPLES;
+    *end = *start + SEED_BLOCK_SAMPLES;
+    if( *end > p->n_samples ) {
+        *end = p->n_samples;
+    }
+}		/* -----  end of function block_range  ----- */
+
+
+/* compare the block against the newest centroids and total up its mass */
+static void
+seed_update_block ( void *ctx, int block, int thread )
+{
+    struct SeedPass *p = ctx;
+    int i, start, end;
+    double mass = 0;
+
+    block_range( p, block, &start, &end );
+    for( i=start; i<end; i++ ) {
+        const double *x = &p->samples[(size_t) i * p->dims];
+        double d;
+        if( p->panel.data ) {
+            distance_sq_nearest( &p->panel, x, &d );
+        } else {
+            distance_sq_nearest_rows( p->rows, x, p->dims, p->n_rows, &d );
+        }
+        if( d < p->min_dist[i] ) {
+            p->min_dist[i] = d;
+        }
+        mass += ((p->weights)? p->weights[i] : 1.0) * p->min_dist[i];
+    }
+
+    p->block_mass[block] = mass;
+}		/* -----  end of function seed_update_block  ----- */
+
+
+static void
+seed_update ( struct SeedPass *p, double *centroids, int n_new,
+        int n_threads )
+{
+    int n_blocks = (p->n_samples + SEED_BLOCK_SAMPLES-1) / SEED_BLOCK_SAMPLES;
+
+    /* the distances have to be brought up to date either way, or the next
+     * draw could pick one of these centroids again. Without the memory for
+     * a panel they're compared as they are */
+    p->rows = centroids;
+    p->n_rows = n_new;
+    if( !DistancePanel_init( &p->panel, p->dims, n_new ) ) {
+        DistancePanel_load( &p->panel, centroids );
+    }
+    parallel_for( n_threads, n_blocks, seed_update_block, p );
+    DistancePanel_free( &p->panel );
+}		/* -----  end of function seed_update  ----- */
+
+
+/* Draw a sample with probability proportional to its weight times its
+ * squared distance from the centroids, or to its weight alone if dist is
+ * NULL. Returns -1 when there is nothing left to draw */
+static int
+seed_draw ( struct SeedPass *p, double *dist, Rng *rng )
+{
+    int n_blocks = (p->n_samples + SEED_BLOCK_SAMPLES-1) / SEED_BLOCK_SAMPLES;
+    int b, i, start, end, last = -1;
+    double total = 0;
+
+    if( !dist && !p->weights ) {
+        return Rng_below( rng, p->n_samples );
+    }
+
+    if( dist ) {
+        for( b=0; b<n_blocks; b++ ) {
+            total += p->block_mass[b];
+        }
+    } else {
+        for( i=0; i<p->n_samples; i++ ) {
+            total += p->weights[i];
+        }
+    }
+
+    if( !(total > 0) ) {
+        return (dist)? -1 : Rng_below( rng, p->n_samples );
+    }
+
+    double r = Rng_uniform( rng ) * total;
+
+    for( b=0; b<n_blocks; b++ ) {
+        double mass = 0;
+
+        block_range( p, b, &start, &end );
+        if( dist ) {
+            mass = p->block_mass[b];
+        } else {
+            for( i=start; i<end; i++ ) {
+                mass += p->weights[i];
+            }
+        }
+
+        if( r >= mass && b < n_blocks-1 ) {
+            r -= mass;
+            continue;
+        }
+
+        /* it's in this block. Rounding can leave r a hair past the end, so
+         * remember the last sample that could have been picked */
+        for( i=start; i<end; i++ ) {
+            double m = ((p->weights)? p->weights[i] : 1.0) *
+                ((dist)? dist[i] : 1.0);
+            if( m > 0 ) {
+                last = i;
+                if( r < m ) {
+                    return i;
+                }
+                r -= m;
+            }
+        }
+        if( last >= 0 ) {
+            return last;
+        }
+    }
+
+    return last;
+}		/* -----  end of function seed_draw  ----- */
+
+
+static int
+seed_pass_init ( struct SeedPass *p, double *samples, double *weights,
+        int dims, int n_samples )
+{
+    int n_blocks = (n_samples + SEED_BLOCK_SAMPLES-1) / SEED_BLOCK_SAMPLES;
+    int i;
+
+    memset( p, 0, sizeof(*p) );
+    p->samples = samples;
+    p->weights = weights;
+    p->dims = dims;
+    p->n_samples = n_samples;
+    p->min_dist = workspace_alloc( sizeof(double) * n_samples );
+    p->block_mass = workspace_alloc( sizeof(double) * n_blocks );
+
+    if( !p->min_dist || !p->block_mass ) {
+        workspace_free(p->min_dist);
+        workspace_free(p->block_mass);
+        return -1;
+    }
+
+    for( i=0; i<n_samples; i++ ) {
+        p->min_dist[i] = HUGE_VAL;
+    }
+    return 0;
+}		/* -----  end of function seed_pass_init  ----- */
+
+
+/* Without the memory for the distances, draw the centroids at random, by 
+ * weight if there are any, as weighted_init_centroids does when it can't 
+ * have its running total */
+static void
+seed_fallback ( double *centroids, double *samples, double *weights, 
+        int dims, int n_centroids, int n_samples, Rng *rng )
+{
+    if( weights ) {
+        weighted_init_centroids( centroids, samples, weights, dims, 
+                n_centroids, n_samples, rng );
+    } else {
+        lloyd_init_centroids( centroids, samples, dims, n_centroids, 
+                n_samples, rng );
+    }
+}		/* -----  end of function seed_fallback  ----- */
+
+
+void
+kmpp_init_centroids_parallel ( double *centroids, double *samples,
+        double *weights, int dims, int n_centroids, int n_samples,
+        int n_threads, Rng *rng )
+{
+    struct SeedPass p;
+    int i, s;
+
+    if( !centroids || !samples || dims < 1 || n_centroids < 1 ||
+            n_samples < 1 || !rng ) {
+        return;
+    }
+
+    if( seed_pass_init( &p, samples, weights, dims, n_samples ) ) {
+        seed_fallback( centroids, samples, weights, dims, n_centroids, 
+                n_samples, rng );
+        return;
+    }
+
+    /* start by choosing a random initial point */
+    s = seed_draw( &p, NULL, rng );
+    memcpy( centroids, &samples[(size_t) s*dims], sizeof(double) * dims );
+
+    for( i=1; i<n_centroids; i++ ) {
+        /* only the centroid we just added can have moved any sample's
+         * nearest distance, so that's all we compare against */
+        seed_update( &p, &centroids[(i-1)*dims], 1, n_threads );
+
+        /* choose a new centroid from the set of sample points with a
+         * probability that is proportional to their square distance from
+         * the nearest cluster. If every sample sits on a centroid already,
+         * fall back to picking one at random */
+        s = seed_draw( &p, p.min_dist, rng );
+        if( s < 0 ) {
+            s = seed_draw( &p, NULL, rng );
+        }
+        memcpy( &centroids[i*dims], &samples[(size_t) s*dims],
+                sizeof(double) * dims );
+    }
+
+    workspace_free(p.min_dist);
+    workspace_free(p.block_mass);
+}		/* -----  end of function kmpp_init_centroids_parallel  ----- */
+
+
+/* pick samples independently, each with probability oversample x its share
+ * of the current cost. Every block draws from its own stream, seeded from
+ * the round and the block number */
+static void
+kmpar_sample_block ( void *ctx, int block, int thread )
+{
+    struct SeedPass *p = ctx;
+    int i, start, end;
+    Rng rng;
+
+    Rng_seed( &rng, p->round_seed + (uint64_t) block );
+
+    block_range( p, block, &start, &end );
+    for( i=start; i<end; i++ ) {
+        double w = (p->weights)? p->weights[i] : 1.0;
+        double prob = p->oversample * w * p->min_dist[i] / p->cost;
+        p->chosen[i] = Rng_uniform( &rng ) < prob;
+    }
+}		/* -----  end of function kmpar_sample_block  ----- */
+
+
+/* count how much of the data each candidate stands in for */
+static void
+kmpar_weigh_chunk ( void *ctx, int chunk, int thread )
+{
+    struct SeedPass *p = ctx;
+    double *w = &p->chunk_weights[(size_t) chunk * p->n_candidates];
+    int start = (int)( (long long) p->n_samples * chunk / p->n_chunks );
+    int end = (int)( (long long) p->n_samples * (chunk+1) / p->n_chunks );
+    int i;
+
+    memset( w, 0, sizeof(double) * p->n_candidates );
+    for( i=start; i<end; i++ ) {
+        int c = distance_sq_nearest( &p->panel,
+                &p->samples[(size_t) i * p->dims], NULL );
+        w[c] += (p->weights)? p->weights[i] : 1.0;
+    }
+}		/* -----  end of function kmpar_weigh_chunk  ----- */
+
+
+/* Run the oversampling rounds. The candidates are copied out of the samples
+ * as they're chosen, we expect about oversample x n_centroids of them per
+ * round. Returns how many there are, or -1 if we ran out of memory */
+static int
+kmpar_oversample ( struct SeedPass *p, double **candidates, int n_centroids,
+        int rounds, int n_threads, Rng *rng )
+{
+    int n_blocks = (p->n_samples + SEED_BLOCK_SAMPLES-1) / SEED_BLOCK_SAMPLES;
+    int dims = p->dims;
+    int cap = n_centroids;
+    int r, i, b, s;
+
+    double *cand = workspace_alloc( sizeof(double) * cap * dims );
+    p->chosen = workspace_alloc( p->n_samples );
+    if( !cand || !p->chosen ) {
+        workspace_free(cand);
+        workspace_free(p->chosen);
+        return -1;
+    }
+
+    s = seed_draw( p, NULL, rng );
+    memcpy( cand, &p->samples[(size_t) s*dims], sizeof(double) * dims );
+    p->n_candidates = 1;
+    seed_update( p, cand, 1, n_threads );
+
+    for( r=0; r<rounds; r++ ) {
+        p->cost = 0;
+        for( b=0; b<n_blocks; b++ ) {
+            p->cost += p->block_mass[b];
+        }
+        if( !(p->cost > 0) ) {
+            break;
+        }
+
+        p->round_seed = Rng_next( rng );
+        parallel_for( n_threads, n_blocks, kmpar_sample_block, p );
+
+        /* gather the picks in sample order */
+        int first = p->n_candidates;
+        for( i=0; i<p->n_samples; i++ ) {
+            if( !p->chosen[i] ) {
+                continue;
+            }
+            if( p->n_candidates == cap ) {
+                double *grown = workspace_realloc( cand,
+                        sizeof(double) * cap * dims,
+                        sizeof(double) * cap*2 * dims );
+                if( !grown ) {
+                    workspace_free(cand);
+                    workspace_free(p->chosen);
+                    return -1;
+                }
+                cand = grown;
+                cap *= 2;
+            }
+            memcpy( &cand[(size_t) p->n_candidates * dims],
+                    &p->samples[(size_t) i*dims], sizeof(double) * dims );
+            p->n_candidates++;
+        }
+
+        if( p->n_candidates > first ) {
+            seed_update( p, &cand[(size_t) first * dims],
+                    p->n_candidates - first, n_threads );
+        }
+    }
+
+    workspace_free(p->chosen);
+    *candidates = cand;
+    return p->n_candidates;
+}		/* -----  end of function kmpar_oversample  ----- */
+
+
+/* weigh each candidate by the data closest to it, reduced in chunk order so
+ * the weights don't depend on the thread count */
+static int
+kmpar_weigh ( struct SeedPass *p, double *candidates, double *cand_weights,
+        int n_threads )
+{
+    int i, c;
+
+    p->n_chunks = p->n_samples / SEED_BLOCK_SAMPLES;
+    if( p->n_chunks > SEED_MAX_CHUNKS ) {
+        p->n_chunks = SEED_MAX_CHUNKS;
+    }
+    if( p->n_chunks < 1 ) {
+        p->n_chunks = 1;
+    }
+
+    p->chunk_weights = workspace_alloc( sizeof(double) * p->n_chunks *
+            p->n_candidates );
+    DistancePanel_init( &p->panel, p->dims, p->n_candidates );
+
+    if( !p->chunk_weights || !p->panel.data ) {
+        workspace_free(p->chunk_weights);
+        DistancePanel_free( &p->panel );
+        return -1;
+    }
+
+    DistancePanel_load( &p->panel, candidates );
+    parallel_for( n_threads, p->n_chunks, kmpar_weigh_chunk, p );
+
+    memset( cand_weights, 0, sizeof(double) * p->n_candidates );
+    for( c=0; c<p->n_chunks; c++ ) {
+        double *w = &p->chunk_weights[(size_t) c * p->n_candidates];
+        for( i=0; i<p->n_candidates; i++ ) {
+            cand_weights[i] += w[i];
+        }
+    }
+
+    workspace_free(p->chunk_weights);
+    DistancePanel_free( &p->panel );
+    return 0;
+}		/* -----  end of function kmpar_weigh  ----- */
+
+
+void
+kmpar_init_centroids ( double *centroids, double *samples, double *weights,
+        int dims, int n_centroids, int n_samples, double oversample,
+        int rounds, int n_threads, Rng *rng )
+{
+    struct SeedPass p;
+    double *cand = NULL, *cand_weights = NULL;
+    int *labels = NULL;
+
+    if( !centroids || !samples || dims < 1 || n_centroids < 1 ||
+            n_samples < 1 || !rng ) {
+        return;
+    }
+
+    if( seed_pass_init( &p, samples, weights, dims, n_samples ) ) {
+        seed_fallback( centroids, samples, weights, dims, n_centroids, 
+                n_samples, rng );
+        return;
+    }
+
+    p.oversample = oversample * n_centroids;
+    int n_cand = kmpar_oversample( &p, &cand, n_centroids, rounds,
+            n_threads, rng );
+
+    /* with fewer candidates than centroids there's nothing to choose from */
+    int ok = n_cand >= n_centroids;
+    if( ok ) {
+        cand_weights = workspace_alloc( sizeof(double) * n_cand );
+        labels = workspace_alloc( sizeof(int) * n_cand );
+        ok = cand_weights && labels &&
+            !kmpar_weigh( &p, cand, cand_weights, n_threads );
+    }
+
+    /* boil the candidates down to n_centroids with a weighted k-means++
+     * followed by Lloyd. There are few enough of them that this is cheap */
+    if( ok ) {
+        kmpp_init_centroids_parallel( centroids, cand, cand_weights, dims,
+                n_centroids, n_cand, n_threads, rng );
+        cluster_kmeans_parallel( centroids, cand, cand_weights, dims,
+                n_centroids, n_cand, labels, n_threads, NULL );
+    }
+
+    workspace_free(cand);
+    workspace_free(cand_weights);
+    workspace_free(labels);
+    workspace_free(p.min_dist);
+    workspace_free(p.block_mass);
+
+    if( !ok ) {
+        kmpp_init_centroids_parallel( centroids, samples, weights, dims,
+                n_centroids, n_samples, n_threads, rng );
+    }
+}		/* -----  end of function kmpar_init_centroids  ----- */
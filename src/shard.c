@@ -0,0 +1,524 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  shard.c
+ *
+ *    Description:  Lloyd's algorithm over worker processes. Each worker is
+ *                  forked with a socket back to us, loads its own shard of
+ *                  the samples and keeps it. Every iteration we send the
+ *                  centroids out, the workers label their samples and send
+ *                  back the partial sums of their reduction slots, and we
+ *                  reduce those just as KMeansSlots_reduce would in one
+ *                  process. The centroids and labels come out the same.
+ *
+ *        Version:  1.0
+ *        Created:  21/10/26 09:41:17
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"shard.h"
+#include	"distance.h"
+#include	"monitor.h"
+#include	"workspace.h"
+#include	"profile.h"
+#include	<errno.h>
+#include	<unistd.h>
+#include	<sys/socket.h>
+#include	<sys/wait.h>
+
+/* what the coordinator can ask of a worker */
+enum ShardOp {
+    SHARD_ROW,              /* send sample index */
+    SHARD_SUM,              /* send the sum of each feature */
+    SHARD_DEVIATION,        /* read the means, send the squared deviations */
+    SHARD_ASSIGN,           /* read the centroids, send the slots' sums */
+    SHARD_LABELS,           /* send the labels of every sample */
+    SHARD_QUIT
+};
+
+struct ShardRequest {
+    int op;
+    int index;
+};
+
+/* sockets can take less than we asked for, and signals interrupt them. A
+ * worker which has gone away is an error rather than a SIGPIPE */
+static int
+shard_send ( int fd, const void *buf, size_t size )
+{
+    const char *p = buf;
+
+    while( size > 0 ) {
+        ssize_t r = send( fd, p, size, MSG_NOSIGNAL );
+        if( r < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( r <= 0 ) {
+            return -1;
+        }
+        p += r;
+        size -= r;
+    }
+
+    return 0;
+}		/* -----  end of function shard_send  ----- */
+
+
+static int
+shard_recv ( int fd, void *buf, size_t size )
+{
+    char *p = buf;
+
+    while( size > 0 ) {
+        ssize_t r = recv( fd, p, size, 0 );
+        if( r < 0 && errno == EINTR ) {
+            continue;
+        }
+        if( r <= 0 ) {
+            return -1;
+        }
+        p += r;
+        size -= r;
+    }
+
+    return 0;
+}		/* -----  end of function shard_recv  ----- */
+
+
+static int
+shard_request ( ShardWorker *w, int op, int index )
+{
+    struct ShardRequest q = { op, index };
+    return shard_send( w->fd, &q, sizeof(q) );
+}		/* -----  end of function shard_request  ----- */
+
+
+/* Label the worker's samples one slot at a time, the same way
+ * kmeans_pass_slot does, and send each slot's partial sums back */
+static int
+shard_assign ( Shards *sh, ShardWorker *w, int fd, const DistancePanel *panel,
+        KMeansSlots *one, const double *samples, int *labels )
+{
+    int dims = sh->dims, k = sh->n_centroids;
+    int i, slot, start, end;
+
+    for( slot=w->first_slot; slot<w->end_slot; slot++ ) {
+        int n_changed = 0;
+
+        KMeansSlots_range( &sh->slots, slot, &start, &end );
+        KMeansSlots_clear( one, 0 );
+
+        for( i=start; i<end; i++ ) {
+            const double *sample = &samples[(size_t) (i - w->start) * dims];
+            double d;
+            int l = distance_sq_nearest( panel, sample, &d );
+
+            if( labels[i - w->start] != l ) {
+                labels[i - w->start] = l;
+                n_changed++;
+            }
+
+            one->inertia[0] += d;
+            KMeansSlots_add( one, 0, l, sample, 1.0 );
+        }
+
+        one->changed[0] = n_changed;
+        one->evals[0] = (long long) (end - start) * k;
+
+        if( shard_send( fd, one->sums, sizeof(double) * k * dims ) ||
+                shard_send( fd, one->weights, sizeof(double) * k ) ||
+                shard_send( fd, one->counts, sizeof(int) * k ) ||
+                shard_send( fd, one->changed, sizeof(int) ) ||
+                shard_send( fd, one->inertia, sizeof(double) ) ||
+                shard_send( fd, one->evals, sizeof(long long) ) ) {
+            return -1;
+        }
+    }
+
+    return 0;
+}		/* -----  end of function shard_assign  ----- */
+
+
+/* The life of a worker process. Load the shard, say whether that worked,
+ * then answer the coordinator until it tells us to quit or goes away. We're
+ * a fork of a process which may have had threads, so we stay on this one */
+static void
+shard_worker ( Shards *sh, ShardWorker *w, int fd, KMeansShardLoader load,
+        void *data )
+{
+    int dims = sh->dims, k = sh->n_centroids, n = w->end - w->start;
+    struct ShardRequest q;
+    DistancePanel panel;
+    KMeansSlots one;
+    WorkspaceScope scope;
+    int i, j, status, ok;
+
+    /* our copy of the coordinator's workspace isn't ours to hand out */
+    workspace_enter( NULL, &scope );
+
+    double *samples = malloc( sizeof(double) * dims * n );
+    int *labels = calloc( n, sizeof(int) );
+    double *centroids = malloc( sizeof(double) * k * dims );
+    double *row = malloc( sizeof(double) * dims );
+    int panel_ok = !DistancePanel_init( &panel, dims, k );
+    int one_ok = !KMeansSlots_init( &one, dims, k, 1 );
+
+    status = (samples && labels && centroids && row && panel_ok && one_ok &&
+            !load( samples, w->start, w->end, data ))? 0 : -1;
+    ok = !shard_send( fd, &status, sizeof(status) ) && !status;
+
+    while( ok && !shard_recv( fd, &q, sizeof(q) ) && q.op != SHARD_QUIT ) {
+        switch( q.op ) {
+            case SHARD_ROW:
+                ok = q.index >= w->start && q.index < w->end &&
+                    !shard_send( fd, &samples[(size_t) (q.index - w->start) *
+                            dims], sizeof(double) * dims );
+                break;
+            case SHARD_SUM:
+                memset( row, 0, sizeof(double) * dims );
+                for( i=0; i<n; i++ ) {
+                    for( j=0; j<dims; j++ ) {
+                        row[j] += samples[(size_t) i * dims + j];
+                    }
+                }
+                ok = !shard_send( fd, row, sizeof(double) * dims );
+                break;
+            case SHARD_DEVIATION:
+                /* the means go in the centroids' buffer, it's big enough */
+                ok = !shard_recv( fd, centroids, sizeof(double) * dims );
+                memset( row, 0, sizeof(double) * dims );
+                for( i=0; ok && i<n; i++ ) {
+                    for( j=0; j<dims; j++ ) {
+                        double d = samples[(size_t) i * dims + j] -
+                            centroids[j];
+                        row[j] += d * d;
+                    }
+                }
+                ok = ok && !shard_send( fd, row, sizeof(double) * dims );
+                break;
+            case SHARD_ASSIGN:
+                ok = !shard_recv( fd, centroids, sizeof(double) * k * dims );
+                if( ok ) {
+                    DistancePanel_load( &panel, centroids );
+                    ok = !shard_assign( sh, w, fd, &panel, &one, samples,
+                            labels );
+                }
+                break;
+            case SHARD_LABELS:
+                ok = !shard_send( fd, labels, sizeof(int) * n );
+                break;
+            default:
+                ok = 0;
+                break;
+        }
+    }
+
+    if( one_ok ) {
+        KMeansSlots_free( &one );
+    }
+    if( panel_ok ) {
+        DistancePanel_free( &panel );
+    }
+    free(row);
+    free(centroids);
+    free(labels);
+    free(samples);
+    close( fd );
+    workspace_leave( &scope );
+}		/* -----  end of function shard_worker  ----- */
+
+
+/* Fork a worker for each shard and wait for them all to load. The shards
+ * are runs of whole reduction slots, so there are at most as many of them
+ * as slots. Returns 0, or -1 if any worker couldn't be started or couldn't
+ * load its samples */
+int
+shards_start ( Shards *sh, int dims, int n_centroids, int n_samples,
+        int n_shards, KMeansShardLoader load, void *data )
+{
+    int i, ok = 1;
+
+    memset( sh, 0, sizeof(*sh) );
+    if( dims < 1 || n_centroids < 1 || n_samples < 1 || !load ) {
+        return -1;
+    }
+
+    sh->dims = dims;
+    sh->n_centroids = n_centroids;
+    sh->n_samples = n_samples;
+    if( KMeansSlots_init( &sh->slots, dims, n_centroids, n_samples ) ) {
+        return -1;
+    }
+
+    if( n_shards > sh->slots.n_slots ) {
+        n_shards = sh->slots.n_slots;
+    }
+    if( n_shards < 1 ) {
+        n_shards = 1;
+    }
+
+    sh->workers = workspace_calloc( n_shards, sizeof(ShardWorker) );
+    if( !sh->workers ) {
+        KMeansSlots_free( &sh->slots );
+        return -1;
+    }
+
+    for( i=0; i<n_shards; i++ ) {
+        ShardWorker *w = &sh->workers[i];
+        int fds[2], unused;
+
+        w->fd = -1;
+        w->first_slot = (int)( (long long) sh->slots.n_slots * i / n_shards );
+        w->end_slot = (int)( (long long) sh->slots.n_slots * (i+1) / n_shards );
+        KMeansSlots_range( &sh->slots, w->first_slot, &w->start, &unused );
+        KMeansSlots_range( &sh->slots, w->end_slot-1, &unused, &w->end );
+
+        if( socketpair( AF_UNIX, SOCK_STREAM, 0, fds ) ) {
+            ok = 0;
+            break;
+        }
+
+        w->pid = fork();
+        if( w->pid < 0 ) {
+            close( fds[0] );
+            close( fds[1] );
+            ok = 0;
+            break;
+        }
+
+        if( w->pid == 0 ) {
+            int j;
+
+            /* the other workers' sockets are the coordinator's business.
+             * Holding them open would hide it when we quit */
+            close( fds[0] );
+            for( j=0; j<i; j++ ) {
+                close( sh->workers[j].fd );
+            }
+            shard_worker( sh, w, fds[1], load, data );
+            _exit( 0 );
+        }
+
+        close( fds[1] );
+        w->fd = fds[0];
+        sh->n_workers++;
+    }
+
+    for( i=0; i<sh->n_workers; i++ ) {
+        int status = -1;
+        if( shard_recv( sh->workers[i].fd, &status, sizeof(status) ) ||
+                status ) {
+            ok = 0;
+        }
+    }
+
+    if( !ok ) {
+        shards_stop( sh );
+        return -1;
+    }
+
+    return 0;
+}		/* -----  end of function shards_start  ----- */
+
+
+/* copy sample index of the whole set out of whichever shard has it */
+int
+shards_row ( Shards *sh, int index, double *row )
+{
+    int i;
+
+    for( i=0; i<sh->n_workers; i++ ) {
+        ShardWorker *w = &sh->workers[i];
+        if( index >= w->start && index < w->end ) {
+            if( shard_request( w, SHARD_ROW, index ) ||
+                    shard_recv( w->fd, row, sizeof(double) * sh->dims ) ) {
+                return -1;
+            }
+            return 0;
+        }
+    }
+
+    return -1;
+}		/* -----  end of function shards_row  ----- */
+
+
+/* The spread of the samples, as kmeans_spread works it out, in two rounds:
+ * one for the means and one for the variances. 0 if a worker fails us */
+double
+shards_spread ( Shards *sh )
+{
+    int dims = sh->dims;
+    double *mean = workspace_calloc( dims, sizeof(double) );
+    double *part = workspace_alloc( sizeof(double) * dims );
+    double *sq = workspace_calloc( dims, sizeof(double) );
+    double spread = 0;
+    int i, j, ok = mean && part && sq;
+
+    for( i=0; ok && i<sh->n_workers; i++ ) {
+        ShardWorker *w = &sh->workers[i];
+        ok = !shard_request( w, SHARD_SUM, 0 ) &&
+            !shard_recv( w->fd, part, sizeof(double) * dims );
+        for( j=0; ok && j<dims; j++ ) {
+            mean[j] += part[j];
+        }
+    }
+    for( j=0; ok && j<dims; j++ ) {
+        mean[j] /= sh->n_samples;
+    }
+
+    for( i=0; ok && i<sh->n_workers; i++ ) {
+        ShardWorker *w = &sh->workers[i];
+        ok = !shard_request( w, SHARD_DEVIATION, 0 ) &&
+            !shard_send( w->fd, mean, sizeof(double) * dims ) &&
+            !shard_recv( w->fd, part, sizeof(double) * dims );
+        for( j=0; ok && j<dims; j++ ) {
+            sq[j] += part[j];
+        }
+    }
+
+    if( ok ) {
+        for( j=0; j<dims; j++ ) {
+            spread += sq[j] / sh->n_samples;
+        }
+        spread = sqrt( spread / dims );
+    }
+
+    workspace_free(sq);
+    workspace_free(part);
+    workspace_free(mean);
+
+    return spread;
+}		/* -----  end of function shards_spread  ----- */
+
+
+/* Train the centroids, which have already been seeded. Like
+ * cluster_kmeans_parallel, it carries on until an iteration changes no
+ * labels or the monitor says to stop. labels can be NULL, otherwise the
+ * workers send theirs at the end. Returns 0, or -1 if a worker went away,
+ * in which case the centroids are the last ones we completed */
+int
+cluster_kmeans_sharded ( Shards *sh, double *centroids, int *labels,
+        KMeansMonitor *monitor )
+{
+    int dims = sh->dims, k = sh->n_centroids;
+    KMeansSlots *s = &sh->slots;
+    KMeansIterStats stats;
+    int *counts = workspace_alloc( sizeof(int) * k );
+    double *old = NULL;
+    int i, slot, ok = (counts != NULL);
+
+    if( monitor && !monitor->callback ) {
+        monitor = NULL;
+    }
+    if( monitor ) {
+        old = workspace_alloc( sizeof(double) * k * dims );
+        ok = ok && old;
+    }
+
+    memset( &stats, 0, sizeof(stats) );
+
+    int reassigned = sh->n_samples;
+    while( ok && reassigned > 0 ) {
+        ProfileMark mark;
+        double t = 0;
+        if( monitor ) {
+            memcpy( old, centroids, sizeof(double) * k * dims );
+            t = monitor_clock();
+        }
+
+        /* the workers are other processes, so the counters only see us
+         * waiting on them */
+        profile_begin( &mark );
+
+        /* everyone gets the centroids before we wait on anyone, so the
+         * workers all label their shards at once */
+        for( i=0; ok && i<sh->n_workers; i++ ) {
+            ok = !shard_request( &sh->workers[i], SHARD_ASSIGN, 0 ) &&
+                !shard_send( sh->workers[i].fd, centroids,
+                        sizeof(double) * k * dims );
+        }
+
+        for( i=0; ok && i<sh->n_workers; i++ ) {
+            ShardWorker *w = &sh->workers[i];
+            for( slot=w->first_slot; ok && slot<w->end_slot; slot++ ) {
+                ok = !shard_recv( w->fd, &s->sums[(size_t) slot * k * dims],
+                        sizeof(double) * k * dims ) &&
+                    !shard_recv( w->fd, &s->weights[(size_t) slot * k],
+                            sizeof(double) * k ) &&
+                    !shard_recv( w->fd, &s->counts[(size_t) slot * k],
+                            sizeof(int) * k ) &&
+                    !shard_recv( w->fd, &s->changed[slot], sizeof(int) ) &&
+                    !shard_recv( w->fd, &s->inertia[slot], sizeof(double) ) &&
+                    !shard_recv( w->fd, &s->evals[slot], sizeof(long long) );
+            }
+        }
+        if( ok ) {
+            profile_slots( s );
+        }
+        profile_end( &mark, KMEANS_PHASE_ASSIGN );
+        if( !ok ) {
+            break;
+        }
+
+        if( monitor ) {
+            stats.assign_seconds = monitor_clock() - t;
+            t = monitor_clock();
+        }
+
+        profile_begin( &mark );
+        reassigned = KMeansSlots_reduce( s, centroids, counts );
+        profile_end( &mark, KMEANS_PHASE_UPDATE );
+
+        if( monitor ) {
+            stats.update_seconds = monitor_clock() - t;
+            stats.iteration++;
+            stats.changed = reassigned;
+            stats.max_shift = monitor_max_shift( old, centroids, dims, k );
+            if( monitor_report( monitor, s, &stats ) ) {
+                break;
+            }
+        }
+    }
+
+    for( i=0; ok && labels && i<sh->n_workers; i++ ) {
+        ShardWorker *w = &sh->workers[i];
+        ok = !shard_request( w, SHARD_LABELS, 0 ) &&
+            !shard_recv( w->fd, &labels[w->start],
+                    sizeof(int) * (w->end - w->start) );
+    }
+
+    workspace_free(old);
+    workspace_free(counts);
+
+    return (ok)? 0 : -1;
+}		/* -----  end of function cluster_kmeans_sharded  ----- */
+
+
+/* tell the workers to quit and wait for them */
+void
+shards_stop ( Shards *sh )
+{
+    int i;
+
+    for( i=0; i<sh->n_workers; i++ ) {
+        ShardWorker *w = &sh->workers[i];
+        if( w->fd >= 0 ) {
+            shard_request( w, SHARD_QUIT, 0 );
+            close( w->fd );
+            w->fd = -1;
+        }
+        while( waitpid( w->pid, NULL, 0 ) < 0 && errno == EINTR ) {
+        }
+    }
+
+    workspace_free(sh->workers);
+    KMeansSlots_free( &sh->slots );
+    sh->workers = NULL;
+    sh->n_workers = 0;
+}		/* -----  end of function shards_stop  ----- */
@@ -0,0 +1,62 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  shard.h
+ *
+ *    Description:  Lloyd's algorithm over worker processes, each of which
+ *                  loads and keeps its own shard of the samples. The
+ *                  coordinator only ever holds the centroids and the
+ *                  reduction slots. Not part of the public interface in
+ *                  kmeans.h.
+ *
+ *        Version:  1.0
+ *        Created:  21/10/26 09:41:17
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  SHARD_INC
+#define  SHARD_INC
+
+#include	"kmeans.h"
+#include	"slots.h"
+#include	<sys/types.h>
+
+/* A worker owns whole reduction slots, so the coordinator can reduce their
+ * partial sums in exactly the order the in-process engines do */
+typedef struct ShardWorker {
+    pid_t pid;
+    int fd;                 /* our end of the socket to it, -1 once gone */
+    int first_slot;
+    int end_slot;
+    int start;              /* its samples are [start, end) of the set */
+    int end;
+} ShardWorker;
+
+typedef struct Shards {
+    int dims;
+    int n_centroids;
+    int n_samples;
+    int n_workers;
+    KMeansSlots slots;      /* every worker's partial sums, in slot order */
+    ShardWorker *workers;
+} Shards;
+
+int shards_start ( Shards *sh, int dims, int n_centroids, int n_samples,
+        int n_shards, KMeansShardLoader load, void *data );
+
+int shards_row ( Shards *sh, int index, double *row );
+
+double shards_spread ( Shards *sh );
+
+int cluster_kmeans_sharded ( Shards *sh, double *centroids, int *labels,
+        KMeansMonitor *monitor );
+
+void shards_stop ( Shards *sh );
+
+#endif   /* ----- #ifndef SHARD_INC  ----- */
@@ -0,0 +1,515 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  silhouette.c
+ *
+ *    Description:  Scores for picking between models. The exact silhouette
+ *                  compares every sample with every other, a sampled one
+ *                  estimates it from a few random samples with a confidence
+ *                  interval, and the margin score only looks at how much
+ *                  closer the nearest centroid is than the second nearest.
+ *
+ *        Version:  1.0
+ *        Created:  19/10/26 09:41:52
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	"distance.h"
+#include	"parallel.h"
+#include	"workspace.h"
+#include	"profile.h"
+
+/* samples scored by one task, and how many of the others they're compared
+ * with per kernel call. The columns have to be a multiple of 8 for
+ * distance_sq_range */
+#define SILHOUETTE_ROWS     32
+#define SILHOUETTE_COLS     512
+
+/* samples per task for the passes which only look at the centroids */
+#define SILHOUETTE_SAMPLES  4096
+
+/* two sided 95% quantile of the normal distribution */
+#define SILHOUETTE_Z        1.959963984540054
+
+/* state shared by the tasks scoring samples against all the others */
+struct SilhouettePass {
+    DistancePanel panel;    /* every sample, grouped by cluster */
+    double *panel_w;        /* weights in panel order, NULL when all 1 */
+    int *offsets;           /* cluster c is panel columns offsets[c] up to
+                             * offsets[c+1] */
+    double *mass;           /* total weight of each cluster */
+    double *samples;
+    int *labels;
+    int dims;
+    int n_clusters;
+    const int *rows;        /* the samples to score, NULL for all in order */
+    int n_rows;
+    double *scores;         /* n_rows, silhouette of each */
+    double *scratch;        /* ROWS x k sums and COLS distances per thread */
+};
+
+/* state shared by the tasks which only need the centroids */
+struct CentroidPass {
+    DistancePanel panel;
+    double *samples;
+    double *weights;
+    int dims;
+    int n_samples;
+    double *partial;        /* per task, for silhouette_margin_slot */
+    double *scratch;        /* k distances per thread */
+};
+
+
+/* Silhouette of the rows of one task. For each we add up the (weighted)
+ * distances to the samples of every cluster, a block of columns at a time
+ * so the panel stays in cache across the rows. The panel is grouped by
+ * cluster, which turns the sums into runs rather than a scatter */
+static void
+silhouette_rows_slot ( void *ctx, int task, int thread )
+{
+    struct SilhouettePass *p = ctx;
+    int k = p->n_clusters;
+    int n = p->panel.n_points;
+    double *acc = &p->scratch[(size_t) thread * (SILHOUETTE_ROWS * k +
+            SILHOUETTE_COLS)];
+    double *dist = &acc[SILHOUETTE_ROWS * k];
+    int start = task * SILHOUETTE_ROWS;
+    int end = (start + SILHOUETTE_ROWS < p->n_rows)?
+        start + SILHOUETTE_ROWS : p->n_rows;
+    int r, j, j0, c, c0 = 0;
+
+    memset( acc, 0, sizeof(double) * SILHOUETTE_ROWS * k );
+
+    for( j0=0; j0<n; j0+=SILHOUETTE_COLS ) {
+        int j1 = (j0 + SILHOUETTE_COLS < n)? j0 + SILHOUETTE_COLS : n;
+
+        while( p->offsets[c0+1] <= j0 ) {
+            c0++;
+        }
+
+        for( r=start; r<end; r++ ) {
+            int i = (p->rows)? p->rows[r] : r;
+            double *sums = &acc[(r - start) * k];
+
+            distance_sq_range( &p->panel, &p->samples[(size_t) i * p->dims],
+                    j0, j1, dist );
+
+            for( j=j0, c=c0; j<j1; c++ ) {
+                int e = (p->offsets[c+1] < j1)? p->offsets[c+1] : j1;
+                double s = 0;
+                if( p->panel_w ) {
+                    for( ; j<e; j++ ) {
+                        s += p->panel_w[j] * sqrt( dist[j-j0] );
+                    }
+                } else {
+                    for( ; j<e; j++ ) {
+                        s += sqrt( dist[j-j0] );
+                    }
+                }
+                sums[c] += s;
+            }
+        }
+    }
+
+    for( r=start; r<end; r++ ) {
+        int i = (p->rows)? p->rows[r] : r;
+        int a = p->labels[i];
+        double *sums = &acc[(r - start) * k];
+        double own, other = HUGE_VAL;
+
+        /* a sample alone in its cluster scores 0. A weight is a number of
+         * identical samples, the others sit at distance 0 and count */
+        p->scores[r] = 0;
+        if( p->mass[a] <= 1 ) {
+            continue;
+        }
+        own = sums[a] / (p->mass[a] - 1);
+
+        for( c=0; c<k; c++ ) {
+            if( c != a && p->mass[c] > 0 && sums[c] / p->mass[c] < other ) {
+                other = sums[c] / p->mass[c];
+            }
+        }
+
+        double m = (own > other)? own : other;
+        if( other < HUGE_VAL && m > 0 ) {
+            p->scores[r] = (other - own) / m;
+        }
+    }
+}		/* -----  end of function silhouette_rows_slot  ----- */
+
+
+/* Group the samples by cluster into the panel and weigh up the clusters */
+static int
+silhouette_pass_init ( struct SilhouettePass *p, double *samples,
+        double *weights, int *labels, int dims, int n_clusters,
+        int n_samples, int n_threads )
+{
+    int i, c;
+
+    memset( p, 0, sizeof(*p) );
+    p->samples = samples;
+    p->labels = labels;
+    p->dims = dims;
+    p->n_clusters = n_clusters;
+
+    double *grouped = workspace_alloc( sizeof(double) * n_samples * dims );
+    int *next = workspace_alloc( sizeof(int) * n_clusters );
+    p->offsets = workspace_alloc( sizeof(int) * (n_clusters + 1) );
+    p->mass = workspace_alloc( sizeof(double) * n_clusters );
+    p->scratch = workspace_alloc( sizeof(double) * n_threads *
+            (SILHOUETTE_ROWS * n_clusters + SILHOUETTE_COLS) );
+    if( weights ) {
+        p->panel_w = workspace_alloc( sizeof(double) * n_samples );
+    }
+    DistancePanel_init( &p->panel, dims, n_samples );
+
+    if( !grouped || !next || !p->offsets || !p->mass || !p->scratch ||
+            (weights && !p->panel_w) || !p->panel.data ) {
+        workspace_free(grouped);
+        workspace_free(next);
+        return -1;
+    }
+
+    /* counting sort on the labels */
+    memset( p->offsets, 0, sizeof(int) * (n_clusters + 1) );
+    memset( p->mass, 0, sizeof(double) * n_clusters );
+    for( i=0; i<n_samples; i++ ) {
+        p->offsets[labels[i] + 1]++;
+        p->mass[labels[i]] += (weights)? weights[i] : 1.0;
+    }
+    for( c=0; c<n_clusters; c++ ) {
+        p->offsets[c+1] += p->offsets[c];
+        next[c] = p->offsets[c];
+    }
+    for( i=0; i<n_samples; i++ ) {
+        int j = next[labels[i]]++;
+        memcpy( &grouped[(size_t) j * dims], &samples[(size_t) i * dims],
+                sizeof(double) * dims );
+        if( weights ) {
+            p->panel_w[j] = weights[i];
+        }
+    }
+
+    DistancePanel_load( &p->panel, grouped );
+    workspace_free(grouped);
+    workspace_free(next);
+
+    return 0;
+}		/* -----  end of function silhouette_pass_init  ----- */
+
+
+static void
+silhouette_pass_free ( struct SilhouettePass *p )
+{
+    DistancePanel_free( &p->panel );
+    workspace_free(p->panel_w);
+    workspace_free(p->offsets);
+    workspace_free(p->mass);
+    workspace_free(p->scratch);
+    workspace_free(p->scores);
+}		/* -----  end of function silhouette_pass_free  ----- */
+
+
+double
+silhouette_exact ( double *samples, double *weights, int *labels, int dims,
+        int n_clusters, int n_samples, int n_threads )
+{
+    struct SilhouettePass p;
+    double tot = 0, w = 0;
+    int i;
+
+    if( !samples || !labels || dims < 1 || n_clusters < 1 ||
+            n_samples < 1 ) {
+        return NAN;
+    }
+    if( n_threads < 1 ) {
+        n_threads = 1;
+    }
+    if( n_threads > PARALLEL_MAX_THREADS ) {
+        n_threads = PARALLEL_MAX_THREADS;
+    }
+
+    if( silhouette_pass_init( &p, samples, weights, labels, dims,
+                n_clusters, n_samples, n_threads ) ) {
+        silhouette_pass_free( &p );
+        return NAN;
+    }
+
+    p.n_rows = n_samples;
+    p.scores = workspace_alloc( sizeof(double) * n_samples );
+    if( !p.scores ) {
+        silhouette_pass_free( &p );
+        return NAN;
+    }
+
+    parallel_for( n_threads, (n_samples + SILHOUETTE_ROWS-1) / SILHOUETTE_ROWS,
+            silhouette_rows_slot, &p );
+
+    /* add them up in order so the thread count doesn't matter */
+    for( i=0; i<n_samples; i++ ) {
+        double wi = (weights)? weights[i] : 1.0;
+        tot += wi * p.scores[i];
+        w += wi;
+    }
+
+    silhouette_pass_free( &p );
+
+    return (w > 0)? tot / w : 0;
+}		/* -----  end of function silhouette_exact  ----- */
+
+
+double
+silhouette_sampled ( double *samples, double *weights, int *labels, int dims,
+        int n_clusters, int n_samples, int n_draws, int n_threads, Rng *rng,
+        double *ci )
+{
+    struct SilhouettePass p;
+    int i;
+
+    memset( &p, 0, sizeof(p) );
+
+    /* drawing as many samples as there are costs as much as the real thing */
+    if( n_draws >= n_samples ) {
+        if( ci ) {
+            *ci = 0;
+        }
+        return silhouette_exact( samples, weights, labels, dims, n_clusters,
+                n_samples, n_threads );
+    }
+
+    if( !samples || !labels || !rng || dims < 1 || n_clusters < 1 ||
+            n_samples < 1 ) {
+        return NAN;
+    }
+    if( n_draws < 2 ) {
+        n_draws = 2;
+    }
+    if( n_threads < 1 ) {
+        n_threads = 1;
+    }
+    if( n_threads > PARALLEL_MAX_THREADS ) {
+        n_threads = PARALLEL_MAX_THREADS;
+    }
+
+    int *rows = workspace_alloc( sizeof(int) * n_draws );
+    double *cumulative = NULL;
+    if( weights ) {
+        cumulative = workspace_alloc( sizeof(double) * n_samples );
+    }
+
+    if( !rows || (weights && !cumulative) || silhouette_pass_init( &p,
+                samples, weights, labels, dims, n_clusters, n_samples,
+                n_threads ) ) {
+        workspace_free(rows);
+        workspace_free(cumulative);
+        silhouette_pass_free( &p );
+        return NAN;
+    }
+
+    /* Draw with replacement, a sample with weight w being w times as likely
+     * to come up. The mean of the drawn scores is then an unbiased estimate
+     * of the weighted mean over all of them */
+    if( weights ) {
+        double tot = 0;
+        for( i=0; i<n_samples; i++ ) {
+            tot += weights[i];
+            cumulative[i] = tot;
+        }
+        for( i=0; i<n_draws; i++ ) {
+            double u = Rng_uniform( rng ) * tot;
+            int lo = 0, hi = n_samples - 1;
+            while( lo < hi ) {
+                int mid = (lo + hi) / 2;
+                if( cumulative[mid] > u ) {
+                    hi = mid;
+                } else {
+                    lo = mid + 1;
+                }
+            }
+            rows[i] = lo;
+        }
+    } else {
+        for( i=0; i<n_draws; i++ ) {
+            rows[i] = Rng_below( rng, n_samples );
+        }
+    }
+
+    p.rows = rows;
+    p.n_rows = n_draws;
+    p.scores = workspace_alloc( sizeof(double) * n_draws );
+    if( !p.scores ) {
+        workspace_free(rows);
+        workspace_free(cumulative);
+        silhouette_pass_free( &p );
+        return NAN;
+    }
+
+    parallel_for( n_threads, (n_draws + SILHOUETTE_ROWS-1) / SILHOUETTE_ROWS,
+            silhouette_rows_slot, &p );
+
+    double mean = 0, var = 0;
+    for( i=0; i<n_draws; i++ ) {
+        mean += p.scores[i];
+    }
+    mean /= n_draws;
+    for( i=0; i<n_draws; i++ ) {
+        var += (p.scores[i] - mean) * (p.scores[i] - mean);
+    }
+    var /= n_draws - 1;
+
+    if( ci ) {
+        *ci = SILHOUETTE_Z * sqrt( var / n_draws );
+    }
+
+    workspace_free(rows);
+    workspace_free(cumulative);
+    silhouette_pass_free( &p );
+
+    return mean;
+}		/* -----  end of function silhouette_sampled  ----- */
+
+
+static void
+silhouette_margin_slot ( void *ctx, int task, int thread )
+{
+    struct CentroidPass *p = ctx;
+    int k = p->panel.n_points;
+    double *dist = &p->scratch[(size_t) thread * k];
+    int start = task * SILHOUETTE_SAMPLES;
+    int end = (start + SILHOUETTE_SAMPLES < p->n_samples)?
+        start + SILHOUETTE_SAMPLES : p->n_samples;
+    double tot = 0;
+    int i, j;
+
+    for( i=start; i<end; i++ ) {
+        double min1 = HUGE_VAL, min2 = HUGE_VAL;
+
+        distance_sq_all( &p->panel, &p->samples[(size_t) i * p->dims], dist );
+        for( j=0; j<k; j++ ) {
+            if( dist[j] < min1 ) {
+                min2 = min1;
+                min1 = dist[j];
+            } else if( dist[j] < min2 ) {
+                min2 = dist[j];
+            }
+        }
+
+        min1 = sqrt(min1);
+        min2 = sqrt(min2);
+        if( min2 > 0 ) {
+            tot += ((p->weights)? p->weights[i] : 1.0) * (min2-min1) / min2;
+        }
+    }
+
+    p->partial[task] = tot;
+}		/* -----  end of function silhouette_margin_slot  ----- */
+
+
+double
+silhouette_margin ( double *points, double *samples, double *weights,
+        int n_samples, int dims, int n_points, int n_threads )
+{
+    struct CentroidPass p;
+    int n_tasks = (n_samples + SILHOUETTE_SAMPLES-1) / SILHOUETTE_SAMPLES;
+    double tot = 0, w = 0;
+    int i;
+
+    /* there's no second nearest with fewer than two */
+    if( !points || !samples || dims < 1 || n_points < 2 || n_samples < 1 ) {
+        return 0;
+    }
+    if( n_threads < 1 ) {
+        n_threads = 1;
+    }
+    if( n_threads > PARALLEL_MAX_THREADS ) {
+        n_threads = PARALLEL_MAX_THREADS;
+    }
+
+    p.samples = samples;
+    p.weights = weights;
+    p.dims = dims;
+    p.n_samples = n_samples;
+    p.partial = workspace_alloc( sizeof(double) * n_tasks );
+    p.scratch = workspace_alloc( sizeof(double) * n_points * n_threads );
+    DistancePanel_init( &p.panel, dims, n_points );
+
+    if( p.partial && p.scratch && p.panel.data ) {
+        DistancePanel_load( &p.panel, points );
+        parallel_for( n_threads, n_tasks, silhouette_margin_slot, &p );
+
+        for( i=0; i<n_tasks; i++ ) {
+            tot += p.partial[i];
+        }
+        for( i=0; i<n_samples; i++ ) {
+            w += (weights)? weights[i] : 1.0;
+        }
+    }
+
+    DistancePanel_free( &p.panel );
+    workspace_free(p.partial);
+    workspace_free(p.scratch);
+
+    return (w > 0)? tot / w : NAN;
+}		/* -----  end of function silhouette_margin  ----- */
+
+
+double
+KMeans_silhouette ( KMeans *km, double *samples, double *weights,
+        int n_samples, KMeansScore mode, int n_draws, double *ci )
+{
+    double score = NAN;
+    WorkspaceScope scope;
+    ProfileScope profiling;
+    ProfileMark mark;
+
+    if( ci ) {
+        *ci = 0;
+    }
+
+    workspace_enter( km->workspace, &scope );
+    profile_enter( km->profile, &profiling );
+    profile_begin( &mark );
+
+    if( mode == KMEANS_SCORE_MARGIN ) {
+        score = silhouette_margin( km->centroids, samples, weights, n_samples,
+                km->n_features, km->n_clusters, km->n_threads );
+        profile_end( &mark, KMEANS_PHASE_SILHOUETTE );
+        profile_leave( &profiling );
+        workspace_leave( &scope );
+        return score;
+    }
+
+    /* the others need to know which cluster every sample is in */
+    int *labels = workspace_alloc( sizeof(int) * n_samples );
+
+    if( labels && !KMeans_predict( km, samples, n_samples, labels, NULL ) ) {
+        if( mode == KMEANS_SCORE_EXACT ) {
+            score = silhouette_exact( samples, weights, labels,
+                    km->n_features, km->n_clusters, n_samples,
+                    km->n_threads );
+        } else {
+            /* the draws come from the model's stream, a long jump of it
+             * per call like training takes */
+            Rng rng = km->rng;
+            Rng_long_jump( &km->rng );
+            score = silhouette_sampled( samples, weights, labels,
+                    km->n_features, km->n_clusters, n_samples, n_draws,
+                    km->n_threads, &rng, ci );
+        }
+    }
+
+    workspace_free(labels);
+    profile_end( &mark, KMEANS_PHASE_SILHOUETTE );
+    profile_leave( &profiling );
+    workspace_leave( &scope );
+
+    return score;
+}		/* -----  end of function KMeans_silhouette  ----- */
@@ -0,0 +1,202 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  slots.c
+ *
+ *    Description:  Reduction slots shared by the parallel training engines.
+ *                  Not part of the public interface in kmeans.h.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 13:40:05
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"slots.h"
+#include	"workspace.h"
+#include	<stdlib.h>
+#include	<string.h>
+
+/* how many slots KMeansSlots_init will use for a problem this size */
+int
+KMeansSlots_count ( int dims, int n_centroids, int n_samples )
+{
+    int n_slots = n_samples / KMEANS_SLOT_SAMPLES;
+    long long slot_size = (long long) sizeof(double) * dims * n_centroids;
+    long long max_slots = KMEANS_SLOT_BUDGET / slot_size;
+
+    if( n_slots > KMEANS_MAX_SLOTS ) {
+        n_slots = KMEANS_MAX_SLOTS;
+    }
+    if( n_slots > max_slots ) {
+        n_slots = (int) max_slots;
+    }
+    if( n_slots < 1 ) {
+        n_slots = 1;
+    }
+
+    return n_slots;
+}		/* -----  end of function KMeansSlots_count  ----- */
+
+
+int
+KMeansSlots_init ( KMeansSlots *s, int dims, int n_centroids, int n_samples )
+{
+    int n_slots = KMeansSlots_count( dims, n_centroids, n_samples );
+
+    s->n_slots = n_slots;
+    s->dims = dims;
+    s->n_centroids = n_centroids;
+    s->n_samples = n_samples;
+    s->weighted = 0;
+    s->sums = workspace_alloc( sizeof(double) * n_slots * n_centroids * dims );
+    s->weights = workspace_alloc( sizeof(double) * n_slots * n_centroids );
+    s->total = workspace_alloc( sizeof(double) * n_centroids );
+    s->counts = workspace_alloc( sizeof(int) * n_slots * n_centroids );
+    s->changed = workspace_alloc( sizeof(int) * n_slots );
+    s->inertia = workspace_alloc( sizeof(double) * n_slots );
+    s->evals = workspace_alloc( sizeof(long long) * n_slots );
+
+    if( !s->sums || !s->weights || !s->total || !s->counts || !s->changed ||
+            !s->inertia || !s->evals ) {
+        KMeansSlots_free(s);
+        return -1;
+    }
+
+    return 0;
+}		/* -----  end of function KMeansSlots_init  ----- */
+
+
+void
+KMeansSlots_free ( KMeansSlots *s )
+{
+    if(s) {
+        workspace_free(s->sums);
+        workspace_free(s->weights);
+        workspace_free(s->total);
+        workspace_free(s->counts);
+        workspace_free(s->changed);
+        workspace_free(s->inertia);
+        workspace_free(s->evals);
+        s->sums = NULL;
+        s->weights = NULL;
+        s->total = NULL;
+        s->counts = NULL;
+        s->changed = NULL;
+        s->inertia = NULL;
+        s->evals = NULL;
+    }
+}		/* -----  end of function KMeansSlots_free  ----- */
+
+
+void
+KMeansSlots_range ( KMeansSlots *s, int slot, int *start, int *end )
+{
+    *start = (int)( (long long) s->n_samples * slot / s->n_slots );
+    *end = (int)( (long long) s->n_samples * (slot+1) / s->n_slots );
+}		/* -----  end of function KMeansSlots_range  ----- */
+
+
+void
+KMeansSlots_clear ( KMeansSlots *s, int slot )
+{
+    memset( &s->sums[(size_t) slot * s->n_centroids * s->dims], 0, 
+            sizeof(double) * s->n_centroids * s->dims );
+    memset( &s->weights[(size_t) slot * s->n_centroids], 0, 
+            sizeof(double) * s->n_centroids );
+    memset( &s->counts[(size_t) slot * s->n_centroids], 0, 
+            sizeof(int) * s->n_centroids );
+    s->changed[slot] = 0;
+    s->inertia[slot] = 0;
+    s->evals[slot] = 0;
+}		/* -----  end of function KMeansSlots_clear  ----- */
+
+
+void
+KMeansSlots_add ( KMeansSlots *s, int slot, int label, const double *sample, 
+        double weight )
+{
+    double *sum = &s->sums[((size_t) slot * s->n_centroids + label) * s->dims];
+    int j;
+
+    /* weight is 1 for unweighted samples, and multiplying by 1 is exact, so
+     * both kinds of training share this path */
+    s->counts[(size_t) slot * s->n_centroids + label]++;
+    s->weights[(size_t) slot * s->n_centroids + label] += weight;
+    for( j=0; j<s->dims; j++ ) {
+        sum[j] += weight * sample[j];
+    }
+}		/* -----  end of function KMeansSlots_add  ----- */
+
+
+/* Compact samples are summed in double like the rest. Every byte and float 
+ * is exact in a double, and so is any sum of bytes below 2^53 */
+void
+KMeansSlots_add_f32 ( KMeansSlots *s, int slot, int label, 
+        const float *sample )
+{
+    double *sum = &s->sums[((size_t) slot * s->n_centroids + label) * s->dims];
+    int j;
+
+    s->counts[(size_t) slot * s->n_centroids + label]++;
+    s->weights[(size_t) slot * s->n_centroids + label] += 1.0;
+    for( j=0; j<s->dims; j++ ) {
+        sum[j] += sample[j];
+    }
+}		/* -----  end of function KMeansSlots_add_f32  ----- */
+
+
+void
+KMeansSlots_add_u8 ( KMeansSlots *s, int slot, int label, 
+        const uint8_t *sample )
+{
+    double *sum = &s->sums[((size_t) slot * s->n_centroids + label) * s->dims];
+    int j;
+
+    s->counts[(size_t) slot * s->n_centroids + label]++;
+    s->weights[(size_t) slot * s->n_centroids + label] += 1.0;
+    for( j=0; j<s->dims; j++ ) {
+        sum[j] += sample[j];
+    }
+}		/* -----  end of function KMeansSlots_add_u8  ----- */
+
+
+int
+KMeansSlots_reduce ( KMeansSlots *s, double *centroids, int *counts )
+{
+    int dims = s->dims, n_centroids = s->n_centroids;
+    int n_changed = 0;
+    int i, j, k;
+
+    /* reduce the slots in order. This is the only place the threads' work
+     * is combined, so it's what keeps the result deterministic */
+    memset( centroids, 0, sizeof(double) * n_centroids * dims );
+    memset( counts, 0, sizeof(int) * n_centroids );
+    memset( s->total, 0, sizeof(double) * n_centroids );
+    for( k=0; k<s->n_slots; k++ ) {
+        double *sums = &s->sums[(size_t) k * n_centroids * dims];
+        for( i=0; i<n_centroids * dims; i++ ) {
+            centroids[i] += sums[i];
+        }
+        for( i=0; i<n_centroids; i++ ) {
+            counts[i] += s->counts[k * n_centroids + i];
+            s->total[i] += s->weights[k * n_centroids + i];
+        }
+        n_changed += s->changed[k];
+    }
+
+    /* divide by number of samples (or their total weight) in each cluster */
+    for( i=0; i<n_centroids; i++ ) {
+        double n = (s->weighted)? s->total[i] : counts[i];
+        for( j=0; j<dims; j++ ) {
+            centroids[i*dims + j] /= ((n > 0)? n : 1);
+        }
+    }
+
+    return n_changed;
+}		/* -----  end of function KMeansSlots_reduce  ----- */
@@ -0,0 +1,71 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  slots.h
+ *
+ *    Description:  Reduction slots shared by the parallel training engines.
+ *                  Not part of the public interface in kmeans.h.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 13:40:05
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  SLOTS_INC
+#define  SLOTS_INC
+
+#include	<stdint.h>
+
+/* The engines split the samples into reduction slots. Every slot keeps its
+ * own partial sums and counts, and the slots are always reduced in the same
+ * order. The number of slots depends only on the problem size, never on the
+ * number of threads, so the centroids come out bit for bit the same whether
+ * we run on one core or on twenty four. */
+#define KMEANS_SLOT_SAMPLES 4096
+#define KMEANS_MAX_SLOTS    64
+#define KMEANS_SLOT_BUDGET  (64*1024*1024)
+
+typedef struct KMeansSlots {
+    int n_slots;
+    int dims;
+    int n_centroids;
+    int n_samples;
+    int weighted;           /* divide by total weight rather than count */
+    double *sums;           /* n_slots x n_centroids x dims */
+    double *weights;        /* n_slots x n_centroids */
+    double *total;          /* n_centroids, scratch for the reduction */
+    int *counts;            /* n_slots x n_centroids */
+    int *changed;           /* n_slots */
+    double *inertia;        /* n_slots, only filled in when monitored */
+    long long *evals;       /* n_slots, distances computed by the slot */
+} KMeansSlots;
+
+int KMeansSlots_count ( int dims, int n_centroids, int n_samples );
+
+int KMeansSlots_init ( KMeansSlots *s, int dims, int n_centroids, 
+        int n_samples );
+
+void KMeansSlots_free ( KMeansSlots *s );
+
+void KMeansSlots_range ( KMeansSlots *s, int slot, int *start, int *end );
+
+void KMeansSlots_clear ( KMeansSlots *s, int slot );
+
+void KMeansSlots_add ( KMeansSlots *s, int slot, int label, 
+        const double *sample, double weight );
+
+void KMeansSlots_add_f32 ( KMeansSlots *s, int slot, int label, 
+        const float *sample );
+
+void KMeansSlots_add_u8 ( KMeansSlots *s, int slot, int label, 
+        const uint8_t *sample );
+
+int KMeansSlots_reduce ( KMeansSlots *s, double *centroids, int *counts );
+
+#endif   /* ----- #ifndef SLOTS_INC  ----- */
@@ -0,0 +1,194 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  stream.c
+ *
+ *    Description:  Streaming segmentation of memory mapped PPM images. 
+ *                  Three stages: count the colours tile by tile, train on 
+ *                  them and compile a lookup table, then classify and write
+ *                  the output tile by tile.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 12:58:41
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"stream.h"
+#include	"colorlut.h"
+#include	"palette.h"
+#include	"parallel.h"
+#include	"ppm.h"
+#include	<errno.h>
+#include	<stdio.h>
+
+/* one tile of the classification stage */
+struct StreamTile {
+    ColorLut lut;
+    const unsigned char *pixels;    /* first row of the tile */
+    unsigned char *out;
+    unsigned char *colors;          /* what to write for each label */
+    int width;
+};
+
+static void
+stream_row_task ( void *ctx, int row, int thread )
+{
+    struct StreamTile *t = ctx;
+    const unsigned char *in = &t->pixels[(size_t) row * t->width * 3];
+    unsigned char *out = &t->out[(size_t) row * t->width * 3];
+    int x;
+
+    for( x=0; x<t->width; x++, in+=3, out+=3 ) {
+        int l = ColorLut_classify( &t->lut, in[0], in[1], in[2] );
+        out[0] = t->colors[l*3];
+        out[1] = t->colors[l*3 + 1];
+        out[2] = t->colors[l*3 + 2];
+    }
+}		/* -----  end of function stream_row_task  ----- */
+
+
+/* The training stage. Only the colour histogram is kept, which is the same 
+ * size whatever the image, and each tile is handed back to the kernel as 
+ * soon as it has been counted */
+static int
+stream_train ( KMeans *km, PpmImage *img, const StreamOptions *opts )
+{
+    long long n_pixels = (long long) img->width * img->height;
+    long long step = (opts->sample_step > 1)? opts->sample_step : 1;
+    long long i;
+    int row;
+    Palette palette;
+
+    /* a colour's count has to fit the histogram's 32 bits */
+    if( n_pixels / step > UINT32_MAX ) {
+        step = n_pixels / UINT32_MAX + 1;
+    }
+
+    if( Palette_init( &palette ) ) {
+        return -1;
+    }
+
+    for( row=0; row<img->height; row+=opts->tile_rows ) {
+        int end = row + opts->tile_rows;
+        if( end > img->height ) {
+            end = img->height;
+        }
+
+        long long first = (long long) row * img->width;
+        long long last = (long long) end * img->width;
+        for( i=(first + step-1) / step * step; i<last; i+=step ) {
+            const unsigned char *p = &img->pixels[i*3];
+            Palette_add( &palette, p[0], p[1], p[2] );
+        }
+
+        PpmImage_release( img, row, end );
+    }
+
+    if( Palette_build( &palette ) < 0 ) {
+        Palette_free( &palette );
+        return -1;
+    }
+
+    if( opts->warm ) {
+        KMeans_cluster_warm( km, palette.colors, palette.weights, 
+                palette.n_colors, NULL );
+    } else if( opts->k_max > km->n_clusters ) {
+        KMeans_sweep( km, palette.colors, palette.weights, palette.n_colors,
+                km->n_clusters, opts->k_max, KMEANS_SCORE_SAMPLED, NULL );
+    } else {
+        KMeans_cluster_weighted( km, palette.colors, palette.weights, 
+                palette.n_colors, NULL );
+    }
+
+    Palette_free( &palette );
+
+    /* training that couldn't get its memory leaves nothing to classify with */
+    if( !km->fitted ) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return 0;
+}		/* -----  end of function stream_train  ----- */
+
+
+int
+stream_segment ( KMeans *km, const char *input, const char *output, 
+        const StreamOptions *opts, int *width, int *height )
+{
+    struct StreamTile t;
+    PpmImage img;
+    FILE *f = NULL;
+    int row, i, j, ok = 0;
+
+    if( km->n_features != 3 || opts->tile_rows < 1 ) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if( PpmImage_open( &img, input ) ) {
+        return -1;
+    }
+
+    *width = img.width;
+    *height = img.height;
+
+    t.pixels = img.pixels;
+    t.width = img.width;
+    t.lut.cells = NULL;
+    t.out = malloc( (size_t) opts->tile_rows * img.width * 3 );
+    t.colors = NULL;
+
+    /* a sweep can settle on a different k, so the colours are only sized 
+     * once the model is trained */
+    if( t.out && !stream_train( km, &img, opts ) ) {
+        t.colors = malloc( km->n_clusters * 3 );
+    }
+
+    if( t.colors && !ColorLut_init( &t.lut, km, opts->lut_bits ) ) {
+
+        for( i=0; i<km->n_clusters; i++ ) {
+            for( j=0; j<3; j++ ) {
+                t.colors[i*3 + j] = (opts->labels)? i * 255 / 
+                    ((km->n_clusters > 1)? km->n_clusters-1 : 1) : 
+                    (unsigned char) km->centroids[i*3 + j];
+            }
+        }
+
+        f = fopen( output, "wb" );
+        ok = f && !ppm_write_header( f, img.width, img.height );
+    }
+
+    /* the classification stage. Rows of a tile are shared out over the 
+     * threads, the tile is written, and its input let go */
+    for( row=0; ok && row<img.height; row+=opts->tile_rows ) {
+        int n = img.height - row;
+        if( n > opts->tile_rows ) {
+            n = opts->tile_rows;
+        }
+
+        t.pixels = &img.pixels[(size_t) row * img.width * 3];
+        parallel_for( km->n_threads, n, stream_row_task, &t );
+
+        ok = fwrite( t.out, (size_t) img.width * 3, n, f ) == (size_t) n;
+        PpmImage_release( &img, row, row + n );
+    }
+
+    if( f && fclose(f) ) {
+        ok = 0;
+    }
+
+    int err = errno;
+    ColorLut_free( &t.lut );
+    free(t.out);
+    free(t.colors);
+    PpmImage_close( &img );
+    errno = err;
+
+    return (ok)? 0 : -1;
+}		/* -----  end of function stream_segment  ----- */
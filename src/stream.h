@@ -0,0 +1,40 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  stream.h
+ *
+ *    Description:  Segments images too big to hold in memory. The image is 
+ *                  read and written a tile of rows at a time, so memory use
+ *                  depends on the tile size and not on the image size.
+ *
+ *        Version:  1.0
+ *        Created:  18/10/26 12:58:41
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  STREAM_INC
+#define  STREAM_INC
+
+#include	"kmeans.h"
+
+#define STREAM_TILE_ROWS 256
+
+typedef struct StreamOptions {
+    int tile_rows;          /* rows read, classified and written at a time */
+    int sample_step;        /* train on every sample_step-th pixel */
+    int labels;             /* write labels as grey levels, not colours */
+    int lut_bits;           /* cells per channel of the colour table */
+    int warm;               /* start from the model's centroids, no seeding */
+    int k_max;              /* sweep k up to this and keep the best */
+} StreamOptions;
+
+int stream_segment ( KMeans *kmeans, const char *input, const char *output,
+        const StreamOptions *opts, int *width, int *height );
+
+#endif   /* ----- #ifndef STREAM_INC  ----- */
@@ -0,0 +1,444 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  triangle.c
+ *
+ *    Description:  Hamerly's and Elkan's accelerated k-means. Both keep
+ *                  bounds on the distance from each sample to the centroids
+ *                  and use the triangle inequality to skip distances which
+ *                  can't change a label.
+ *
+ *        Version:  1.0
+ *        Created:  17/10/26 13:58:31
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"kmeans.h"
+#include	"distance.h"
+#include	"parallel.h"
+#include	"slots.h"
+#include	"monitor.h"
+#include	"workspace.h"
+#include	"profile.h"
+
+/* state shared by the tasks of one iteration of either algorithm */
+struct BoundsPass {
+    DistancePanel panel;
+    KMeansSlots slots;
+    double *samples;
+    double *weights;        /* NULL when every sample counts once */
+    double *centroids;
+    int dims;
+    int n_centroids;
+    int *labels;
+    int first;              /* no bounds yet, everything gets computed */
+    int monitored;          /* keep the inertia for a KMeansMonitor */
+
+    double *upper;          /* n_samples, distance to the assigned centroid */
+    double *lower;          /* n_samples for Hamerly, n x k for Elkan */
+    double *half_sep;       /* half the distance to the nearest centroid */
+    double *half_cc;        /* k x k half distances between centroids */
+    double *shift;          /* how far each centroid moved last update */
+    double max_shift;
+    double second_shift;
+    int max_shift_idx;
+    double *scratch;        /* k per thread */
+};
+
+/* Work out how far apart the centroids are. Hamerly only needs the nearest
+ * neighbour of each, Elkan wants the whole table */
+static void
+centroid_separation ( struct BoundsPass *p )
+{
+    int k = p->n_centroids, dims = p->dims;
+    int i, j;
+
+    for( i=0; i<k; i++ ) {
+        p->half_sep[i] = HUGE_VAL;
+    }
+
+    for( i=0; i<k; i++ ) {
+        for( j=i+1; j<k; j++ ) {
+            double d = 0.5 * euclidean_distance( &p->centroids[i*dims],
+                    &p->centroids[j*dims], dims );
+            if( p->half_cc ) {
+                p->half_cc[i*k + j] = d;
+                p->half_cc[j*k + i] = d;
+            }
+            if( d < p->half_sep[i] ) {
+                p->half_sep[i] = d;
+            }
+            if( d < p->half_sep[j] ) {
+                p->half_sep[j] = d;
+            }
+        }
+    }
+}		/* -----  end of function centroid_separation  ----- */
+
+
+/* After an update, record how far every centroid moved. The bounds are
+ * loosened by these amounts at the start of the next pass */
+static void
+centroid_shift ( struct BoundsPass *p, double *old )
+{
+    int i;
+
+    p->max_shift = 0;
+    p->second_shift = 0;
+    p->max_shift_idx = 0;
+    for( i=0; i<p->n_centroids; i++ ) {
+        double d = euclidean_distance( &old[i*p->dims],
+                &p->centroids[i*p->dims], p->dims );
+        p->shift[i] = d;
+
+        if( d > p->max_shift ) {
+            p->second_shift = p->max_shift;
+            p->max_shift = d;
+            p->max_shift_idx = i;
+        } else if( d > p->second_shift ) {
+            p->second_shift = d;
+        }
+    }
+}		/* -----  end of function centroid_shift  ----- */
+
+
+/* Whether a lower bound on the distance to centroid j rules it out for a
+ * sample assigned to a, upper being at least the distance to a. Where the
+ * two meet, j could be exactly as close, and then Lloyd would take the
+ * lower index, so only a higher one can be skipped. Pass j = -1 when the
+ * bound covers every other centroid */
+static inline int
+ruled_out ( double upper, double bound, int j, int a )
+{
+    return upper < bound || (upper == bound && ((j < 0)? a == 0 : j > a));
+}		/* -----  end of function ruled_out  ----- */
+
+
+/* The bounds only promise that upper[i] is at least the distance to the
+ * assigned centroid. A monitor wants the inertia, so work the distance out
+ * when the pass didn't. These aren't counted as distance evaluations, the
+ * algorithm didn't need them */
+static void
+bound_inertia ( struct BoundsPass *p, int slot, int i, int a, double weight,
+        int exact )
+{
+    double d = (exact)? p->upper[i] : euclidean_distance(
+            &p->samples[(size_t) i * p->dims], &p->centroids[a*p->dims],
+            p->dims );
+
+    p->slots.inertia[slot] += weight * d * d;
+}		/* -----  end of function bound_inertia  ----- */
+
+
+static void
+hamerly_pass_slot ( void *ctx, int slot, int thread )
+{
+    struct BoundsPass *p = ctx;
+    double *dist = &p->scratch[(size_t) thread * p->n_centroids];
+    int i, j, start, end, n_changed = 0;
+
+    KMeansSlots_clear( &p->slots, slot );
+    KMeansSlots_range( &p->slots, slot, &start, &end );
+
+    long long n_evals = 0;
+
+    for( i=start; i<end; i++ ) {
+        double *sample = &p->samples[(size_t) i * p->dims];
+        int a = p->labels[i];
+        int search = p->first;
+        int exact = 0;      /* upper[i] is the true distance */
+
+        if( !search ) {
+            p->upper[i] += p->shift[a];
+            p->lower[i] -= (a == p->max_shift_idx)?
+                p->second_shift : p->max_shift;
+
+            /* nothing can be closer than the second closest was, or than
+             * half way to the nearest other centroid */
+            double m = (p->half_sep[a] > p->lower[i])?
+                p->half_sep[a] : p->lower[i];
+
+            if( !ruled_out( p->upper[i], m, -1, a ) ) {
+                p->upper[i] = euclidean_distance( sample,
+                        &p->centroids[a*p->dims], p->dims );
+                search = !ruled_out( p->upper[i], m, -1, a );
+                exact = 1;
+                n_evals++;
+            }
+        }
+
+        if( search ) {
+            int best = 0;
+            double d1 = HUGE_VAL, d2 = HUGE_VAL;
+
+            distance_sq_all( &p->panel, sample, dist );
+            for( j=0; j<p->n_centroids; j++ ) {
+                if( dist[j] < d1 ) {
+                    d2 = d1;
+                    d1 = dist[j];
+                    best = j;
+                } else if( dist[j] < d2 ) {
+                    d2 = dist[j];
+                }
+            }
+
+            p->upper[i] = sqrt(d1);
+            p->lower[i] = sqrt(d2);
+            n_evals += p->n_centroids;
+
+            if( a != best ) {
+                p->labels[i] = a = best;
+                n_changed++;
+            }
+        }
+
+        double weight = (p->weights)? p->weights[i] : 1.0;
+        if( p->monitored ) {
+            bound_inertia( p, slot, i, a, weight, exact || search );
+        }
+
+        KMeansSlots_add( &p->slots, slot, a, sample, weight );
+    }
+
+    p->slots.changed[slot] = n_changed;
+    p->slots.evals[slot] = n_evals;
+}		/* -----  end of function hamerly_pass_slot  ----- */
+
+
+static void
+elkan_pass_slot ( void *ctx, int slot, int thread )
+{
+    struct BoundsPass *p = ctx;
+    int k = p->n_centroids, dims = p->dims;
+    double *dist = &p->scratch[(size_t) thread * k];
+    int i, j, start, end, n_changed = 0;
+
+    KMeansSlots_clear( &p->slots, slot );
+    KMeansSlots_range( &p->slots, slot, &start, &end );
+
+    long long n_evals = 0;
+
+    for( i=start; i<end; i++ ) {
+        double *sample = &p->samples[(size_t) i * dims];
+        double *lower = &p->lower[(size_t) i * k];
+        int a = p->labels[i];
+        int stale = 1;      /* upper[i] is only a bound */
+
+        if( p->first ) {
+            distance_sq_all( &p->panel, sample, dist );
+            n_evals += k;
+            stale = 0;
+
+            a = 0;
+            for( j=0; j<k; j++ ) {
+                lower[j] = sqrt( dist[j] );
+                if( dist[j] < dist[a] ) {
+                    a = j;
+                }
+            }
+            p->upper[i] = lower[a];
+        } else {
+            for( j=0; j<k; j++ ) {
+                lower[j] = (lower[j] > p->shift[j])? lower[j] - p->shift[j] : 0;
+            }
+            p->upper[i] += p->shift[a];
+
+            if( !ruled_out( p->upper[i], p->half_sep[a], -1, a ) ) {
+                for( j=0; j<k; j++ ) {
+                    if( j == a || ruled_out( p->upper[i], lower[j], j, a ) ||
+                            ruled_out( p->upper[i], p->half_cc[a*k + j], 
+                                j, a ) ) {
+                        continue;
+                    }
+
+                    /* tighten the upper bound once before using it to rule
+                     * out any more centroids */
+                    if( stale ) {
+                        p->upper[i] = euclidean_distance( sample,
+                                &p->centroids[a*dims], dims );
+                        lower[a] = p->upper[i];
+                        stale = 0;
+                        n_evals++;
+
+                        if( ruled_out( p->upper[i], lower[j], j, a ) ||
+                                ruled_out( p->upper[i], p->half_cc[a*k + j], 
+                                    j, a ) ) {
+                            continue;
+                        }
+                    }
+
+                    double d = euclidean_distance( sample,
+                            &p->centroids[j*dims], dims );
+                    lower[j] = d;
+                    n_evals++;
+
+                    /* on a tie prefer the lower index, like find_closest */
+                    if( d < p->upper[i] || (d == p->upper[i] && j < a) ) {
+                        a = j;
+                        p->upper[i] = d;
+                    }
+                }
+            }
+        }
+
+        if( p->labels[i] != a ) {
+            p->labels[i] = a;
+            n_changed++;
+        }
+
+        double weight = (p->weights)? p->weights[i] : 1.0;
+        if( p->monitored ) {
+            bound_inertia( p, slot, i, a, weight, !stale );
+        }
+
+        KMeansSlots_add( &p->slots, slot, a, sample, weight );
+    }
+
+    p->slots.changed[slot] = n_changed;
+    p->slots.evals[slot] = n_evals;
+}		/* -----  end of function elkan_pass_slot  ----- */
+
+
+/* Shared driver for both algorithms. The passes differ but the bookkeeping
+ * between them is the same. Returns -1 if it couldn't get the memory */
+static int
+cluster_bounded ( double *centroids, double *samples, double *weights,
+        int dims, int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor, int elkan )
+{
+    struct BoundsPass p;
+    KMeansIterStats stats;
+    ParallelTask pass = (elkan)? elkan_pass_slot : hamerly_pass_slot;
+    size_t n_lower = (elkan)? (size_t) n_samples * n_centroids : n_samples;
+
+    /* the bounds are meaningless with a single centroid */
+    if( n_centroids < 2 ) {
+        return cluster_kmeans_parallel( centroids, samples, weights, dims,
+                n_centroids, n_samples, labels, n_threads, monitor );
+    }
+
+    if( monitor && !monitor->callback ) {
+        monitor = NULL;
+    }
+
+    if( n_threads < 1 ) {
+        n_threads = 1;
+    }
+    if( n_threads > PARALLEL_MAX_THREADS ) {
+        n_threads = PARALLEL_MAX_THREADS;
+    }
+
+    memset( &p, 0, sizeof(p) );
+    p.samples = samples;
+    p.weights = weights;
+    p.centroids = centroids;
+    p.dims = dims;
+    p.n_centroids = n_centroids;
+    p.labels = labels;
+    p.first = 1;
+    p.monitored = (monitor != NULL);
+
+    double *old = workspace_alloc( sizeof(double) * n_centroids * dims );
+    int *counts = workspace_alloc( sizeof(int) * n_centroids );
+    p.upper = workspace_alloc( sizeof(double) * n_samples );
+    p.lower = workspace_alloc( sizeof(double) * n_lower );
+    p.half_sep = workspace_alloc( sizeof(double) * n_centroids );
+    p.shift = workspace_alloc( sizeof(double) * n_centroids );
+    p.scratch = workspace_alloc( sizeof(double) * n_centroids * n_threads );
+    if( elkan ) {
+        p.half_cc = workspace_alloc( sizeof(double) * n_centroids * 
+                n_centroids );
+    }
+    DistancePanel_init( &p.panel, dims, n_centroids );
+    KMeansSlots_init( &p.slots, dims, n_centroids, n_samples );
+    p.slots.weighted = (weights != NULL);
+
+    int ok = old && counts && p.upper && p.lower && p.half_sep && p.shift &&
+        p.scratch && (p.half_cc || !elkan) && p.panel.data && p.slots.sums;
+
+    if( ok ) {
+        memset( labels, 0, sizeof(int) * n_samples );
+        memset( &stats, 0, sizeof(stats) );
+
+        int reassigned = n_samples;
+        while( reassigned > 0 ) {
+            double t = (monitor)? monitor_clock() : 0;
+            ProfileMark mark;
+
+            profile_begin( &mark );
+            DistancePanel_load( &p.panel, centroids );
+            centroid_separation( &p );
+
+            parallel_for( n_threads, p.slots.n_slots, pass, &p );
+            profile_slots( &p.slots );
+            profile_end( &mark, KMEANS_PHASE_ASSIGN );
+
+            if( monitor ) {
+                stats.assign_seconds = monitor_clock() - t;
+                t = monitor_clock();
+            }
+
+            profile_begin( &mark );
+            memcpy( old, centroids, sizeof(double) * n_centroids * dims );
+            reassigned = KMeansSlots_reduce( &p.slots, centroids, counts );
+            centroid_shift( &p, old );
+            p.first = 0;
+            profile_end( &mark, KMEANS_PHASE_UPDATE );
+
+            if( monitor ) {
+                stats.update_seconds = monitor_clock() - t;
+                stats.iteration++;
+                stats.changed = reassigned;
+                stats.max_shift = p.max_shift;
+                if( monitor_report( monitor, &p.slots, &stats ) ) {
+                    break;
+                }
+            }
+        }
+    }
+
+    DistancePanel_free( &p.panel );
+    KMeansSlots_free( &p.slots );
+    workspace_free(old);
+    workspace_free(counts);
+    workspace_free(p.upper);
+    workspace_free(p.lower);
+    workspace_free(p.half_sep);
+    workspace_free(p.half_cc);
+    workspace_free(p.shift);
+    workspace_free(p.scratch);
+
+    /* Elkan needs n x k bounds. If we couldn't get them, Hamerly only needs
+     * two per sample and gives the same answer */
+    if( !ok && elkan ) {
+        return cluster_bounded( centroids, samples, weights, dims, 
+                n_centroids, n_samples, labels, n_threads, monitor, 0 );
+    }
+    return (ok)? 0 : -1;
+}		/* -----  end of function cluster_bounded  ----- */
+
+
+int
+cluster_kmeans_hamerly ( double *centroids, double *samples, double *weights,
+        int dims, int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor )
+{
+    return cluster_bounded( centroids, samples, weights, dims, n_centroids,
+            n_samples, labels, n_threads, monitor, 0 );
+}		/* -----  end of function cluster_kmeans_hamerly  ----- */
+
+
+int
+cluster_kmeans_elkan ( double *centroids, double *samples, double *weights,
+        int dims, int n_centroids, int n_samples, int *labels, int n_threads,
+        KMeansMonitor *monitor )
+{
+    return cluster_bounded( centroids, samples, weights, dims, n_centroids,
+            n_samples, labels, n_threads, monitor, 1 );
+}		/* -----  end of function cluster_kmeans_elkan  ----- */
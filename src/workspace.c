@@ -0,0 +1,281 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  workspace.c
+ *
+ *    Description:  A workspace is one block of memory handed out a piece at
+ *                  a time, like a stack. Freeing the newest piece gives it
+ *                  back, anything else is given back when the call that
+ *                  entered the workspace leaves it. What doesn't fit comes
+ *                  from the heap, and the workspace is regrown on leaving
+ *                  so that the same call fits next time.
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 16:02:51
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#include	"workspace.h"
+#include	"slots.h"
+#include	<stdlib.h>
+#include	<string.h>
+
+/* everything is aligned to a cache line, which covers the widest vectors
+ * too. Each piece is preceded by a header of this size */
+#define WORKSPACE_ALIGN 64
+
+/* pieces which didn't fit, kept until the outermost leave */
+struct Spill {
+    struct Spill *next;
+};
+
+struct KMeansWorkspace {
+    unsigned char *base;
+    size_t size;
+    size_t used;
+    size_t top;             /* header of the newest piece */
+    size_t spilled;         /* bytes taken from the heap instead */
+    size_t peak;            /* most used at once, spills included */
+    struct Spill *spills;
+    int depth;              /* scopes entered and not yet left */
+};
+
+/* what a piece remembers about the one before it */
+struct Header {
+    size_t used;
+    size_t top;
+};
+
+/* the workspace this thread's allocations come from, if any */
+static __thread KMeansWorkspace *current;
+
+static size_t
+round_up ( size_t size )
+{
+    return (size + WORKSPACE_ALIGN-1) / WORKSPACE_ALIGN * WORKSPACE_ALIGN;
+}		/* -----  end of function round_up  ----- */
+
+
+/* A rough guess at what training and predicting need, so that most models
+ * don't have to grow their workspace at all */
+KMeansWorkspace *
+KMeans_workspace_new ( int n_samples, int n_features, int n_clusters )
+{
+    KMeansWorkspace *ws = calloc( 1, sizeof(KMeansWorkspace) );
+    if( !ws ) {
+        return NULL;
+    }
+
+    size_t n = (n_samples > 0)? n_samples : 0;
+    size_t dims = (n_features > 0)? n_features : 1;
+    size_t k = (n_clusters > 0)? n_clusters : 1;
+    size_t slots = KMeansSlots_count( (int) dims, (int) k, (int) n );
+    size_t panel = dims * (k + 8) * sizeof(double);
+
+    /* labels and a seeding pass over the samples, the centroid panel, the
+     * old centroids and counts, and the reduction slots */
+    size_t size = n * (sizeof(int) + 2*sizeof(double)) + 2*panel +
+        k * sizeof(int) + slots * k * (dims * sizeof(double) +
+                sizeof(double) + sizeof(int)) +
+        k * sizeof(double) + slots * 3 * sizeof(double) +
+        32 * WORKSPACE_ALIGN;
+
+    ws->size = round_up( size );
+    ws->base = aligned_alloc( WORKSPACE_ALIGN, ws->size );
+    if( !ws->base ) {
+        free(ws);
+        return NULL;
+    }
+
+    return ws;
+}		/* -----  end of function KMeans_workspace_new  ----- */
+
+
+void
+KMeans_workspace_free ( KMeansWorkspace *ws )
+{
+    if(ws) {
+        free(ws->base);
+        free(ws);
+    }
+}		/* -----  end of function KMeans_workspace_free  ----- */
+
+
+void
+workspace_enter ( KMeansWorkspace *ws, WorkspaceScope *scope )
+{
+    scope->prev = current;
+    scope->ws = ws;
+    if(ws) {
+        scope->used = ws->used;
+        scope->top = ws->top;
+        ws->depth++;
+    }
+    current = ws;
+}		/* -----  end of function workspace_enter  ----- */
+
+
+void
+workspace_leave ( WorkspaceScope *scope )
+{
+    KMeansWorkspace *ws = scope->ws;
+
+    current = scope->prev;
+    if( !ws ) {
+        return;
+    }
+
+    ws->used = scope->used;
+    ws->top = scope->top;
+    if( --ws->depth > 0 ) {
+        return;
+    }
+
+    while( ws->spills ) {
+        struct Spill *next = ws->spills->next;
+        free(ws->spills);
+        ws->spills = next;
+    }
+
+    /* grow to fit everything this call needed at once, plus a little for
+     * calls that need slightly more. If we can't, we'll spill again */
+    if( ws->spilled ) {
+        size_t size = round_up( ws->peak + ws->peak/8 );
+        unsigned char *base = aligned_alloc( WORKSPACE_ALIGN, size );
+        if( base ) {
+            free(ws->base);
+            ws->base = base;
+            ws->size = size;
+        }
+        ws->spilled = 0;
+    }
+    ws->used = ws->top = 0;
+}		/* -----  end of function workspace_leave  ----- */
+
+
+void *
+workspace_alloc ( size_t size )
+{
+    KMeansWorkspace *ws = current;
+
+    size = round_up( (size)? size : 1 );
+    if( !ws ) {
+        return aligned_alloc( WORKSPACE_ALIGN, size );
+    }
+
+    if( ws->used + WORKSPACE_ALIGN + size <= ws->size ) {
+        struct Header *h = (struct Header *) &ws->base[ws->used];
+        h->used = ws->used;
+        h->top = ws->top;
+        ws->top = ws->used;
+        ws->used += WORKSPACE_ALIGN + size;
+        if( ws->used + ws->spilled > ws->peak ) {
+            ws->peak = ws->used + ws->spilled;
+        }
+        return (unsigned char *) h + WORKSPACE_ALIGN;
+    }
+
+    struct Spill *s = aligned_alloc( WORKSPACE_ALIGN, WORKSPACE_ALIGN + size );
+    if( !s ) {
+        return NULL;
+    }
+    s->next = ws->spills;
+    ws->spills = s;
+    ws->spilled += WORKSPACE_ALIGN + size;
+    if( ws->used + ws->spilled > ws->peak ) {
+        ws->peak = ws->used + ws->spilled;
+    }
+
+    return (unsigned char *) s + WORKSPACE_ALIGN;
+}		/* -----  end of function workspace_alloc  ----- */
+
+
+void *
+workspace_calloc ( size_t n, size_t size )
+{
+    void *p = workspace_alloc( n * size );
+    if(p) {
+        memset( p, 0, n * size );
+    }
+    return p;
+}		/* -----  end of function workspace_calloc  ----- */
+
+
+/* whether p was handed out by the current workspace */
+static int
+owned ( KMeansWorkspace *ws, void *p )
+{
+    unsigned char *b = p;
+    struct Spill *s;
+
+    if( b >= ws->base && b < ws->base + ws->size ) {
+        return 1;
+    }
+    for( s=ws->spills; s; s=s->next ) {
+        if( b == (unsigned char *) s + WORKSPACE_ALIGN ) {
+            return 1;
+        }
+    }
+    return 0;
+}		/* -----  end of function owned  ----- */
+
+
+void
+workspace_free ( void *p )
+{
+    KMeansWorkspace *ws = current;
+
+    if( !p ) {
+        return;
+    }
+
+    if( !ws || !owned( ws, p ) ) {
+        free(p);
+        return;
+    }
+
+    /* only the newest piece can be given back straight away */
+    if( (unsigned char *) p == &ws->base[ws->top + WORKSPACE_ALIGN] &&
+            ws->used > ws->top ) {
+        struct Header *h = (struct Header *) &ws->base[ws->top];
+        ws->used = h->used;
+        ws->top = h->top;
+    }
+}		/* -----  end of function workspace_free  ----- */
+
+
+void *
+workspace_realloc ( void *p, size_t old_size, size_t size )
+{
+    KMeansWorkspace *ws = current;
+
+    if( !p ) {
+        return workspace_alloc( size );
+    }
+
+    /* the newest piece can just grow, if there's room after it */
+    if( ws && (unsigned char *) p == &ws->base[ws->top + WORKSPACE_ALIGN] &&
+            ws->used > ws->top ) {
+        size_t end = ws->top + WORKSPACE_ALIGN + round_up( size );
+        if( end <= ws->size ) {
+            ws->used = end;
+            if( ws->used + ws->spilled > ws->peak ) {
+                ws->peak = ws->used + ws->spilled;
+            }
+            return p;
+        }
+    }
+
+    void *q = workspace_alloc( size );
+    if( q ) {
+        memcpy( q, p, (old_size < size)? old_size : size );
+        workspace_free( p );
+    }
+    return q;
+}		/* -----  end of function workspace_realloc  ----- */
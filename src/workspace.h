@@ -0,0 +1,51 @@
+/*
+ * ============================================================================
+ *
+ *       Filename:  workspace.h
+ *
+ *    Description:  Scratch memory for the engines. Each KMeans_* call enters
+ *                  its model's workspace, and until it leaves the
+ *                  workspace_* allocations made on that thread are carved out
+ *                  of it rather than the heap. Not part of the public
+ *                  interface in kmeans.h.
+ *
+ *        Version:  1.0
+ *        Created:  20/10/26 16:02:51
+ *       Revision:  none
+ *       Compiler:  gcc
+ *
+ *         Author:  Gary Munnelly (gm), munnellg@tcd.ie
+ *        Company:  Adapt Centre, Trinity College Dublin
+ *
+ * ============================================================================
+ */
+
+#ifndef  WORKSPACE_INC
+#define  WORKSPACE_INC
+
+#include	"kmeans.h"
+
+/* What to go back to on leaving. Scopes nest, and entering a NULL workspace
+ * sends the allocations back to the heap until the matching leave */
+typedef struct WorkspaceScope {
+    KMeansWorkspace *prev;
+    KMeansWorkspace *ws;
+    size_t used;
+    size_t top;
+} WorkspaceScope;
+
+void workspace_enter ( KMeansWorkspace *ws, WorkspaceScope *scope );
+
+void workspace_leave ( WorkspaceScope *scope );
+
+/* Like malloc, calloc, realloc and free, but always aligned to a cache line.
+ * Whatever is allocated inside a scope has to be freed before it's left */
+void *workspace_alloc ( size_t size );
+
+void *workspace_calloc ( size_t n, size_t size );
+
+void *workspace_realloc ( void *p, size_t old_size, size_t size );
+
+void workspace_free ( void *p );
+
+#endif   /* ----- #ifndef WORKSPACE_INC  ----- */